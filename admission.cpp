@@ -0,0 +1,47 @@
+#include <algorithm>
+
+#include "admission.hpp"
+
+/***************************************************************************************************
+ *                                        AdmissionControl                                         *
+ ***************************************************************************************************/
+
+/* function docs are in the header file */
+
+AdmissionControl::AdmissionControl(size_t max_queue, std::chrono::milliseconds target,
+                                   std::chrono::milliseconds interval)
+    : max_queue(max_queue), target(target), interval(interval) {}
+
+bool AdmissionControl::arrive() {
+    if (queued.load(std::memory_order_relaxed) >= max_queue) {
+        shed_full.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    queued.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+bool AdmissionControl::depart(clock::time_point now, clock::time_point enqueued) {
+    queued.fetch_sub(1, std::memory_order_relaxed);
+    clock::duration sojourn = now - enqueued;
+    min_sojourn = std::min(min_sojourn, sojourn);
+    if (now >= interval_end) {
+        // the queue never drained below target for a whole interval: it is a standing queue
+        overloaded = min_sojourn > target;
+        min_sojourn = clock::duration::max();
+        interval_end = now + interval;
+    }
+    if (sojourn > (overloaded ? target : interval)) {
+        shed_delay.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+    return false;
+} // AdmissionControl::depart()
+
+void AdmissionControl::render(std::ostream &os) const {
+    os << "# TYPE fs_admission_queued gauge\n";
+    os << "fs_admission_queued " << queued.load(std::memory_order_relaxed) << "\n";
+    os << "# TYPE fs_admission_shed_total counter\n";
+    os << "fs_admission_shed_total{reason=\"queue_full\"} " << shed_full.load(std::memory_order_relaxed) << "\n";
+    os << "fs_admission_shed_total{reason=\"queue_delay\"} " << shed_delay.load(std::memory_order_relaxed) << "\n";
+}
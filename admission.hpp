@@ -0,0 +1,66 @@
+/***************************************************************************************************
+ *                                        AdmissionControl                                         *
+ ***************************************************************************************************/
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+/*
+ * Load shedding policy for the worker pool's request queue.
+ *
+ * At most one request per worker thread runs at a time; the rest wait in the
+ * pool's queue, which holds at most max_queue of them, and beyond that a
+ * request is shed right away (the pool chooses which, see worker_pool).  The queue is managed with CoDel: the lowest
+ * queue delay seen in each interval tells a burst, which drains, from a
+ * standing queue, which does not.  Normally a request is shed only once it
+ * has queued for a whole interval; after an interval in which no request got
+ * through in under target, the queue is overloaded and anything that queued
+ * longer than target is shed when it reaches the head.  Bursts are absorbed,
+ * while under sustained overload admitted requests keep a queue delay near
+ * target and the workers stay busy with requests whose clients still wait.
+ *
+ * Shed requests are answered with FS_BUSY_REPLY instead of being served.
+ * The pool calls arrive() and depart() under its own lock.
+ */
+class AdmissionControl {
+public:
+    using clock = std::chrono::steady_clock;
+
+    AdmissionControl(size_t max_queue, std::chrono::milliseconds target, std::chrono::milliseconds interval);
+
+    /*
+     * A request is about to be queued.  Returns false if the queue is full and
+     * the request must be shed instead.
+     */
+    bool arrive();
+
+    /*
+     * The request at the head of the queue, queued since enqueued, is about
+     * to run.  Returns true if CoDel sheds it instead.
+     */
+    bool depart(clock::time_point now, clock::time_point enqueued);
+
+    /*
+     * Writes the admission gauge and counters in the Prometheus text format
+     */
+    void render(std::ostream &os) const;
+
+private:
+    const size_t max_queue;
+    const clock::duration target;
+    const clock::duration interval;
+
+    // CoDel state
+    clock::time_point interval_end{};
+    clock::duration min_sojourn = clock::duration::max();   // lowest queue delay this interval
+    bool overloaded = false;
+
+    // read by render() without the pool's lock
+    std::atomic<size_t> queued{0};
+    std::atomic<uint64_t> shed_full{0};         // arrivals shed because the queue was full
+    std::atomic<uint64_t> shed_delay{0};        // requests shed by CoDel
+};
@@ -0,0 +1,42 @@
+/***************************************************************************************************
+ *                                          Request arena                                          *
+ ***************************************************************************************************/
+#pragma once
+
+#include <cstddef>
+#include <memory_resource>
+
+/*
+ * Memory for the objects of one request: the header, the parsed request, its
+ * path and the regex captures.  Allocations are carved out of an inline
+ * buffer and never freed one by one; reset() takes the whole buffer back once
+ * the response is sent.  Each connection owns one, so a request that fits in
+ * REQUEST_ARENA_BYTES costs no heap allocation for them.  Larger ones (the
+ * paths of a big FS_STATMANY or FS_CREATE_BATCH) spill over to the heap, and
+ * reset() frees that too.
+ *
+ * Not thread safe: a connection's request is only touched by one thread at a
+ * time (its event loop, then a worker, then the loop again).
+ */
+
+// a single path request takes 2-3 KB, most of it the path deque's first node
+static constexpr size_t REQUEST_ARENA_BYTES = 4096;
+
+class request_arena {
+public:
+    request_arena() : resource(buffer, sizeof(buffer), std::pmr::new_delete_resource()) {}
+    request_arena(const request_arena&) = delete;
+    request_arena& operator=(const request_arena&) = delete;
+
+    std::pmr::memory_resource* get() { return &resource; }
+
+    /*
+     * Takes back everything allocated since the last reset().  Nothing
+     * allocated from the arena may be used afterwards.
+     */
+    void reset() { resource.release(); }
+
+private:
+    alignas(std::max_align_t) std::byte buffer[REQUEST_ARENA_BYTES];
+    std::pmr::monotonic_buffer_resource resource;
+};
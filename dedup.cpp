@@ -0,0 +1,106 @@
+#include <cstring>
+
+#include "dedup.hpp"
+
+/***************************************************************************************************
+ *                                           DedupIndex                                            *
+ ***************************************************************************************************/
+
+/* function docs are in the header file */
+
+uint64_t DedupIndex::fingerprint(const void* data) {
+    // multiply-xorshift over 64 bit words, then a final avalanche
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    uint64_t h = 0x9E3779B97F4A7C15ull;
+    for (size_t i = 0; i < FS_BLOCKSIZE; i += sizeof(uint64_t)) {
+        uint64_t word;
+        std::memcpy(&word, p + i, sizeof(word));
+        h = (h ^ word) * 0xFF51AFD7ED558CCDull;
+        h ^= h >> 32;
+    }
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+uint32_t DedupIndex::share(uint64_t fp) {
+    boost::lock_guard<boost::mutex> g(m);
+    auto it = by_fingerprint.find(fp);
+    if (it == by_fingerprint.end()) {
+        return 0;
+    }
+    ++blocks[it->second].refs;
+    return it->second;
+}
+
+void DedupIndex::add(uint64_t fp, uint32_t block) {
+    boost::lock_guard<boost::mutex> g(m);
+    blocks[block].refs = 1;
+    if (by_fingerprint.emplace(fp, block).second) {
+        blocks[block].indexed = true;
+        blocks[block].fp = fp;
+    }
+}
+
+void DedupIndex::ref(uint32_t block) {
+    boost::lock_guard<boost::mutex> g(m);
+    ++blocks[block].refs;
+}
+
+bool DedupIndex::release(uint32_t block) {
+    boost::lock_guard<boost::mutex> g(m);
+    if (--blocks[block].refs != 0) {
+        return false;
+    }
+    unindex(block);
+    return true;
+}
+
+bool DedupIndex::claim(uint32_t block) {
+    boost::lock_guard<boost::mutex> g(m);
+    if (blocks[block].refs != 1) {
+        return false;
+    }
+    unindex(block);
+    return true;
+}
+
+void DedupIndex::reindex(uint64_t fp, uint32_t block) {
+    boost::lock_guard<boost::mutex> g(m);
+    if (!blocks[block].indexed && by_fingerprint.emplace(fp, block).second) {
+        blocks[block].indexed = true;
+        blocks[block].fp = fp;
+    }
+}
+
+uint32_t DedupIndex::refs(uint32_t block) {
+    boost::lock_guard<boost::mutex> g(m);
+    return blocks[block].refs;
+}
+
+void DedupIndex::render(std::ostream &os) {
+    size_t shared = 0;
+    size_t saved = 0;
+    {
+        boost::lock_guard<boost::mutex> g(m);
+        for (const block_info &b : blocks) {
+            if (b.refs > 1) {
+                ++shared;
+                saved += b.refs - 1;
+            }
+        }
+    }
+    os << "# TYPE fs_dedup_shared_blocks gauge\n";
+    os << "fs_dedup_shared_blocks " << shared << "\n";
+    os << "# TYPE fs_dedup_saved_blocks gauge\n";
+    os << "fs_dedup_saved_blocks " << saved << "\n";
+}
+
+void DedupIndex::unindex(uint32_t block) {
+    block_info &b = blocks[block];
+    if (b.indexed) {
+        by_fingerprint.erase(b.fp);
+        b.indexed = false;
+    }
+}
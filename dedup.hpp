@@ -0,0 +1,104 @@
+/***************************************************************************************************
+ *                                           DedupIndex                                            *
+ ***************************************************************************************************/
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <unordered_map>
+
+#include <boost/thread.hpp>
+
+#include "fs_server.h"
+
+/*
+ * Content addressed file blocks, for the optional dedup mode (--dedup).
+ *
+ * Every data block in use has a reference count, the number of inode
+ * blocks[] entries pointing at it, and most are indexed by a fingerprint of
+ * their contents.  A write whose data is already on disk points the inode at
+ * that block instead of writing a new one.  A block is only changed in place
+ * while it has a single reference; a write to a shared block goes to another
+ * block (copy on write), and a block is freed when its last reference goes.
+ *
+ * Fingerprints only pick the candidate: its contents are compared before a
+ * block is shared, so a collision costs a disk read, never wrong data.  That
+ * read happens outside the index lock, so dedup writes do not queue behind
+ * each other's disk reads.  A block whose fingerprint is already indexed for
+ * other contents is simply not indexed.
+ *
+ * Thread safe.  The caller keeps a reference it holds stable with the inode
+ * lock of the file it belongs to.
+ */
+class DedupIndex {
+public:
+    /*
+     * Fast non-cryptographic 64 bit hash of a FS_BLOCKSIZE block
+     */
+    static uint64_t fingerprint(const void* data);
+
+    /*
+     * share
+     *
+     * Returns a block indexed under fp with one more reference, or 0 if there
+     * is none.  The block is only a candidate: the caller reads it, without
+     * the index lock, and confirms it holds the data.  The reference keeps
+     * the block from being freed or changed in place meanwhile (claim() fails
+     * while it is held).  If the data differs, the caller drops the reference
+     * with release() and frees the block if that was the last one.
+     */
+    uint32_t share(uint64_t fp);
+
+    /*
+     * A newly written block with one reference, indexed under fp
+     */
+    void add(uint64_t fp, uint32_t block);
+
+    /*
+     * One more reference to block, for copies and while rebuilding at startup
+     */
+    void ref(uint32_t block);
+
+    /*
+     * Drops a reference to block.  Returns true if it was the last one; the
+     * block is no longer indexed and the caller frees it.
+     */
+    bool release(uint32_t block);
+
+    /*
+     * claim
+     *
+     * If block has a single reference, takes it out of the index so nothing
+     * can start sharing it, and returns true: the holder of that reference may
+     * overwrite it and then reindex() it.  Returns false for a shared block.
+     */
+    bool claim(uint32_t block);
+
+    /*
+     * Indexes block under fp, unless another block already has fp
+     */
+    void reindex(uint64_t fp, uint32_t block);
+
+    /*
+     * Number of references to block, 0 if it is not a data block in use
+     */
+    uint32_t refs(uint32_t block);
+
+    /*
+     * Writes the dedup gauges in the Prometheus text format
+     */
+    void render(std::ostream &os);
+
+private:
+    struct block_info {
+        uint32_t refs = 0;
+        bool indexed = false;
+        uint64_t fp = 0;                    // when indexed
+    };
+
+    void unindex(uint32_t block);
+
+    boost::mutex m;
+    std::unordered_map<uint64_t, uint32_t> by_fingerprint;
+    block_info blocks[FS_DISKSIZE];
+};
@@ -0,0 +1,104 @@
+#include <algorithm>
+#include <thread>
+
+#include <boost/thread.hpp>
+
+#include "defrag.hpp"
+
+/***************************************************************************************************
+ *                                          Defragmenter                                           *
+ ***************************************************************************************************/
+
+/* function docs are in the header file */
+
+unsigned int count_extents(const fs_inode &inode) {
+    unsigned int res = 0;
+    uint32_t prev = 0;
+    for (uint32_t i = 0; i < inode.size; ++i) {
+        uint32_t block = inode.blocks[i];
+        if (block == 0) {
+            continue;
+        }
+        if (prev == 0 || block != prev + 1) {
+            ++res;
+        }
+        prev = block;
+    }
+    return res;
+}
+
+Defragmenter::Defragmenter(scan_fn scan, move_fn move) : scan(std::move(scan)), move(std::move(move)) {
+    boost::thread t([this]() { run(); });
+    t.detach();
+}
+
+void Defragmenter::request_began() {
+    active.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Defragmenter::request_ended() {
+    last_ended.store(clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+    active.fetch_sub(1, std::memory_order_relaxed);
+}
+
+bool Defragmenter::busy() const {
+    if (active.load(std::memory_order_relaxed) != 0) {
+        return true;
+    }
+    clock::time_point ended{clock::duration(last_ended.load(std::memory_order_relaxed))};
+    return clock::now() - ended < std::chrono::milliseconds(DEFRAG_IDLE_MS);
+}
+
+void Defragmenter::wait_idle() const {
+    while (busy()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(DEFRAG_IDLE_MS));
+    }
+}
+
+void Defragmenter::run() {
+    auto is_busy = [this]() { return busy(); };
+    while (true) {
+        wait_idle();
+        layout found = scan();
+        files.store(found.files, std::memory_order_relaxed);
+        fragmented_files.store(found.fragmented.size(), std::memory_order_relaxed);
+        data_blocks.store(found.data_blocks, std::memory_order_relaxed);
+        extents.store(found.extents, std::memory_order_relaxed);
+
+        // the most fragmented first, they gain the most
+        std::sort(found.fragmented.begin(), found.fragmented.end(),
+                  [](const candidate &a, const candidate &b) { return a.extents > b.extents; });
+        for (const candidate &c : found.fragmented) {
+            wait_idle();
+            size_t moved = move(c, is_busy);
+            if (moved == 0) {
+                files_given_up.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            files_moved.fetch_add(1, std::memory_order_relaxed);
+            blocks_moved.fetch_add(moved, std::memory_order_relaxed);
+            fragmented_files.fetch_sub(1, std::memory_order_relaxed);
+            extents.fetch_sub(c.extents - 1, std::memory_order_relaxed);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(DEFRAG_PASS_MS));
+    }
+} // Defragmenter::run()
+
+void Defragmenter::render(std::ostream &os) {
+    size_t f = files.load(std::memory_order_relaxed);
+    size_t e = extents.load(std::memory_order_relaxed);
+    size_t b = data_blocks.load(std::memory_order_relaxed);
+    os << "# TYPE fs_files_fragmented gauge\n";
+    os << "fs_files_fragmented " << fragmented_files.load(std::memory_order_relaxed) << "\n";
+    os << "# TYPE fs_file_extents gauge\n";
+    os << "fs_file_extents " << e << "\n";
+    // 0 when every file is one extent, 1 when no two blocks of a file are adjacent
+    os << "# TYPE fs_fragmentation gauge\n";
+    os << "fs_fragmentation " << (b > f ? static_cast<double>(e - f) / static_cast<double>(b - f) : 0.0) << "\n";
+    os << "# TYPE fs_defrag_files_moved_total counter\n";
+    os << "fs_defrag_files_moved_total " << files_moved.load(std::memory_order_relaxed) << "\n";
+    os << "# TYPE fs_defrag_blocks_moved_total counter\n";
+    os << "fs_defrag_blocks_moved_total " << blocks_moved.load(std::memory_order_relaxed) << "\n";
+    os << "# TYPE fs_defrag_given_up_total counter\n";
+    os << "fs_defrag_given_up_total " << files_given_up.load(std::memory_order_relaxed) << "\n";
+}
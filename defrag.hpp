@@ -0,0 +1,109 @@
+/***************************************************************************************************
+ *                                          Defragmenter                                           *
+ ***************************************************************************************************/
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <vector>
+
+#include "fs_server.h"
+
+/*
+ * Background defragmentation (--defrag).
+ *
+ * Blocks come off the free list lowest first, so after create and delete
+ * churn a file's blocks[] end up scattered over the disk.  Every
+ * DEFRAG_PASS_MS the defragmenter scans the tree for files whose data is in
+ * more than one extent (run of consecutive blocks) and rewrites each, most
+ * fragmented first, into one free run: the data is copied under the file's
+ * upgrade lock, so readers go on, then the inode is switched to the new
+ * blocks under a unique lock and the old blocks are freed.  The data is on
+ * disk before the inode points at it, as for any write.  Holes stay holes.
+ *
+ * It only runs while the server is idle: no request in flight and none
+ * finished in the last DEFRAG_IDLE_MS.  It checks before every block it
+ * copies, and a file being moved when a request arrives is given up, its
+ * new run freed and its inode untouched, so a foreground request waits for
+ * at most one block copy.
+ *
+ * Thread safe.
+ */
+
+static constexpr unsigned int DEFRAG_PASS_MS = 1000;
+static constexpr unsigned int DEFRAG_IDLE_MS = 50;
+
+/*
+ * Number of extents of a file's data blocks, holes not counted
+ */
+unsigned int count_extents(const fs_inode &inode);
+
+class Defragmenter {
+public:
+    using clock = std::chrono::steady_clock;
+
+    // a file found by a scan; generation tells whether it is still the same file when locked
+    struct candidate {
+        uint32_t block;
+        uint64_t generation;
+        unsigned int extents;
+    };
+
+    // what a scan found
+    struct layout {
+        size_t files = 0;                   // with at least one data block
+        size_t data_blocks = 0;
+        size_t extents = 0;
+        std::vector<candidate> fragmented;
+    };
+
+    using scan_fn = std::function<layout()>;
+    // moves a file into one run; returns the blocks moved, 0 if it was left as it was
+    using move_fn = std::function<size_t(const candidate &c, const std::function<bool()> &busy)>;
+
+    /*
+     * Runs passes on a thread of its own until the process exits
+     */
+    Defragmenter(scan_fn scan, move_fn move);
+
+    /*
+     * Called around every foreground request, two atomic operations each
+     */
+    void request_began();
+    void request_ended();
+
+    /*
+     * True if foreground requests are running or ended recently
+     */
+    bool busy() const;
+
+    /*
+     * Writes the fragmentation gauges and defrag counters in the Prometheus
+     * text format
+     */
+    void render(std::ostream &os);
+
+private:
+    void run();
+    // waits until the server is idle
+    void wait_idle() const;
+
+    scan_fn scan;
+    move_fn move;
+
+    std::atomic<unsigned int> active{0};    // foreground requests running
+    std::atomic<clock::rep> last_ended{0};
+
+    // as of the last scan, less what has been moved since
+    std::atomic<size_t> files{0};
+    std::atomic<size_t> fragmented_files{0};
+    std::atomic<size_t> data_blocks{0};
+    std::atomic<size_t> extents{0};
+
+    std::atomic<uint64_t> files_moved{0};
+    std::atomic<uint64_t> blocks_moved{0};
+    std::atomic<uint64_t> files_given_up{0};
+};
@@ -0,0 +1,158 @@
+/***************************************************************************************************
+ *                                         Directory scan                                          *
+ ***************************************************************************************************/
+#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "fs_server.h"
+
+/*
+ * Scan kernel for one directory page (FS_DIRENTRIES direntries).
+ *
+ * One pass over a page finds which slots are in use and which live entry has
+ * a given name.  Occupancy is read four slots per compare: the last 16 bytes
+ * of four entries are transposed so that their inode_blocks share a register.
+ * (An AVX2 gather of all eight measured slower than two transposes.)  Only
+ * the used slots are then compared by name, with 32 (AVX2) or 16 (SSE2) byte
+ * loads against a zero padded copy of the target, so a mismatch costs one
+ * compare and nothing is allocated.  Without SSE2 the same result is computed
+ * one slot at a time.
+ *
+ * Build with -mavx2 (or -march=native) for the AVX2 name compare; SSE2 is
+ * the baseline on x86-64.
+ */
+
+static_assert(sizeof(fs_direntry) == 64 && offsetof(fs_direntry, inode_block) == 60,
+              "the scan kernel reads direntries as 64 byte records");
+static_assert(FS_DIRENTRIES <= 32, "slot masks are 32 bits");
+
+/*
+ * The name to look for, zero padded to the size of a direntry.  Build it once
+ * per directory scan.
+ */
+struct dir_scan_key {
+#if defined(__AVX2__)
+    static constexpr size_t LANE = 32;
+#else
+    static constexpr size_t LANE = 16;
+#endif
+
+    alignas(32) char name[sizeof(fs_direntry)] = {};
+    size_t len;                             // > FS_MAXFILENAME: the name cannot match anything
+    uint64_t want;                          // bytes to compare, the name and its terminator
+
+    explicit dir_scan_key(std::string_view target) : len(target.size()) {
+        if (len <= FS_MAXFILENAME) {
+            std::memcpy(name, target.data(), len);
+        }
+        want = len <= FS_MAXFILENAME ? (uint64_t{1} << (len + 1)) - 1 : 0;
+    }
+};
+
+/*
+ * What a page holds, from scan_dir_page()
+ */
+struct dir_page_scan {
+    int match = -1;                         // slot of the live entry with the key's name, -1 if none
+    int first_free = -1;                    // first unused slot, -1 if the page is full
+    int live = 0;                           // number of used slots
+};
+
+namespace dir_scan_detail {
+
+// bit j is set if slot j is unused (inode_block == 0)
+inline uint32_t free_slots(const fs_direntry* page) {
+#if defined(__SSE2__)
+    static_assert(FS_DIRENTRIES % 4 == 0);
+    uint32_t mask = 0;
+    for (unsigned int j = 0; j < FS_DIRENTRIES; j += 4) {
+        // lane 3 of each entry's last 16 bytes is its inode_block
+        const char* p = reinterpret_cast<const char*>(page + j) + 48;
+        __m128i e0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        __m128i e1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 64));
+        __m128i e2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 128));
+        __m128i e3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 192));
+        __m128i blocks = _mm_unpackhi_epi64(_mm_unpackhi_epi32(e0, e1), _mm_unpackhi_epi32(e2, e3));
+        __m128i unused = _mm_cmpeq_epi32(blocks, _mm_setzero_si128());
+        mask |= static_cast<uint32_t>(_mm_movemask_ps(_mm_castsi128_ps(unused))) << j;
+    }
+    return mask;
+#else
+    uint32_t mask = 0;
+    for (unsigned int j = 0; j < FS_DIRENTRIES; ++j) {
+        if (page[j].inode_block == 0) {
+            mask |= uint32_t{1} << j;
+        }
+    }
+    return mask;
+#endif
+}
+
+// true if de's name is the key's; only the name and its terminator are compared
+inline bool name_equals(const fs_direntry &de, const dir_scan_key &key) {
+#if defined(__AVX2__)
+    const char* p = de.name;
+    for (size_t off = 0; off <= key.len; off += dir_scan_key::LANE) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + off));
+        __m256i b = _mm256_load_si256(reinterpret_cast<const __m256i*>(key.name + off));
+        uint32_t differ = ~static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b)));
+        if (differ & static_cast<uint32_t>(key.want >> off)) {
+            return false;
+        }
+    }
+    return true;
+#elif defined(__SSE2__)
+    const char* p = de.name;
+    for (size_t off = 0; off <= key.len; off += dir_scan_key::LANE) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + off));
+        __m128i b = _mm_load_si128(reinterpret_cast<const __m128i*>(key.name + off));
+        uint32_t differ = ~static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(a, b))) & 0xFFFF;
+        if (differ & static_cast<uint32_t>(key.want >> off)) {
+            return false;
+        }
+    }
+    return true;
+#else
+    return std::memcmp(de.name, key.name, key.len + 1) == 0;
+#endif
+}
+
+} // namespace dir_scan_detail
+
+/*
+ * scan_dir_page
+ *
+ *  Scans the FS_DIRENTRIES entries of page once for the slot named by key,
+ *  the first free slot and the number of live slots.
+ */
+inline dir_page_scan scan_dir_page(const fs_direntry* page, const dir_scan_key &key) {
+    constexpr uint32_t all = FS_DIRENTRIES == 32 ? ~uint32_t{0} : (uint32_t{1} << FS_DIRENTRIES) - 1;
+    uint32_t unused = dir_scan_detail::free_slots(page);
+    uint32_t used = ~unused & all;
+
+    dir_page_scan res;
+    res.live = std::popcount(used);
+    res.first_free = unused ? std::countr_zero(unused) : -1;
+    if (key.want == 0) {
+        return res;
+    }
+    for (uint32_t left = used; left; left &= left - 1) {
+        int j = std::countr_zero(left);
+        if (dir_scan_detail::name_equals(page[j], key)) {
+            res.match = j;
+            break;
+        }
+    }
+    return res;
+}
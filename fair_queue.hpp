@@ -0,0 +1,114 @@
+/***************************************************************************************************
+ *                                            FairQueue                                            *
+ ***************************************************************************************************/
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory_resource>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+/*
+ * Queue of per-flow FIFOs (one flow per user) served with deficit round
+ * robin.  Every item costs one unit: a flow of weight w gets up to w items
+ * out per turn, so while several flows are backlogged each gets a share of
+ * the pops proportional to its weight, and a flow with few items waits for
+ * at most one turn of every other backlogged flow, however long their queues.
+ *
+ * Flows and their queues are allocated from memory, which the owner can make
+ * a pool so that steady traffic does not go back to the heap.
+ *
+ * Not thread safe, the owner locks it.
+ */
+template <typename T>
+class FairQueue {
+public:
+    using weight_fn = std::function<unsigned int(const std::string&)>;
+
+    explicit FairQueue(weight_fn weight, std::pmr::memory_resource* memory = std::pmr::get_default_resource())
+        : weight(std::move(weight)), flows(memory), active(memory) {}
+
+    bool empty() const { return size_ == 0; }
+    size_t size() const { return size_; }
+
+    void push(const std::string &key, T item) {
+        auto [it, created] = flows.try_emplace(key);
+        flow &f = it->second;
+        if (created) {
+            f.key = &it->first;
+            f.weight = std::max(1u, weight(key));
+        }
+        if (f.items.empty()) {
+            active.push_back(&f);
+        }
+        f.items.push_back(std::move(item));
+        ++size_;
+    }
+
+    /*
+     * Takes the next item, the queue must not be empty
+     */
+    T pop() {
+        flow &f = *active.front();
+        if (f.credit == 0) {
+            // the start of this flow's turn
+            f.credit = f.weight;
+        }
+        T item = std::move(f.items.front());
+        f.items.pop_front();
+        --f.credit;
+        --size_;
+        if (f.items.empty()) {
+            active.pop_front();
+            flows.erase(*f.key);
+        } else if (f.credit == 0) {
+            active.pop_front();
+            active.push_back(&f);
+        }
+        return item;
+    }
+
+    /*
+     * Makes room for an item of key's flow in a full queue: removes the
+     * newest item of the longest flow into victim, unless key's own flow
+     * would be at least as long.  Returns false if nothing was removed.
+     */
+    bool displace(const std::string &key, T &victim) {
+        flow* longest = nullptr;
+        for (flow* f : active) {
+            if (!longest || f->items.size() > longest->items.size()) {
+                longest = f;
+            }
+        }
+        auto own = flows.find(key);
+        size_t own_size = own == flows.end() ? 0 : own->second.items.size();
+        if (!longest || longest->items.size() <= own_size + 1) {
+            return false;
+        }
+        victim = std::move(longest->items.back());
+        longest->items.pop_back();
+        --size_;
+        return true;
+    }
+
+private:
+    struct flow {
+        // the map hands its memory down to items
+        using allocator_type = std::pmr::polymorphic_allocator<>;
+        explicit flow(const allocator_type &alloc) : items(alloc) {}
+
+        const std::string* key = nullptr;       // the flows map's key, stable while the flow exists
+        unsigned int weight = 1;
+        unsigned int credit = 0;                // pops left in the current turn
+        std::pmr::deque<T> items;
+    };
+
+    weight_fn weight;
+    std::pmr::unordered_map<std::string, flow> flows;   // only flows with items queued
+    std::pmr::deque<flow*> active;                      // round robin order
+    size_t size_ = 0;
+};
@@ -1,28 +1,102 @@
 // Code for file server
 #include <iostream>
+#include <string>
 
 #include "network.hpp"
 #include "fs_server.h"
 
 /// IMPORTANT: Network is big-endian, host is little-endian
 
+static void usage() {
+    std::cout << "./fs <portnum : optional> [--lease-ms N] [--loops N] [--workers N]\n"
+              << "     [--max-queue N] [--target-ms N] [--backlog N]\n"
+              << "     [--weight <username>=N]... [--dedup 0|1] [--listeners N]\n"
+              << "     [--replica-socket PATH] [--follow PATH] [--max-staleness-ms N]\n"
+              << "     [--defrag 0|1]\n";
+}
+
 int main(int argc, char* argv[]) {
-    // handle input, no more than 2 should exist
-    if (argc > 2) {
-        std::cout << "Too many arguments passed to the program\n";
-        std::cout << "./fs <portnum : optional>\n";
-        return -1;
-    }
+    server_config config;
 
-    // get the port number
-    int portnum = 0;
+    // the port number comes first if given
+    int arg = 1;
+    if (arg < argc && argv[arg][0] != '-') {
+        config.port = std::stoi(argv[arg]); // assume argv[1] is a valid integer
+        ++arg;
+    }
 
-    if (argc == 2) {
-        portnum = std::stoi(argv[1]); // assume argv[1] is a valid integer
+    // the rest are settings with a value each
+    for (; arg < argc; arg += 2) {
+        std::string flag = argv[arg];
+        if (arg + 1 >= argc) {
+            std::cout << "Missing value for " << flag << "\n";
+            usage();
+            return -1;
+        }
+        std::string text = argv[arg + 1];
+        if (flag == "--weight") {
+            // <username>=<weight>, may be given once per user
+            size_t eq = text.find('=');
+            if (eq == 0 || eq == std::string::npos || eq + 1 == text.size()) {
+                std::cout << "Expected --weight <username>=<weight>\n";
+                usage();
+                return -1;
+            }
+            config.weights[text.substr(0, eq)] = static_cast<unsigned int>(std::stoul(text.substr(eq + 1)));
+            continue;
+        }
+        if (flag == "--replica-socket") {
+            config.replica_socket = text;       // unix socket replicas follow this server on
+            continue;
+        }
+        if (flag == "--follow") {
+            config.follow = text;               // serve reads as a replica of the primary there
+            continue;
+        }
+        unsigned int value = static_cast<unsigned int>(std::stoul(text));
+        if (flag == "--lease-ms") {
+            config.lease_ms = value;    // 0 disables client cache leases
+        } else if (flag == "--loops") {
+            config.loops = value;
+        } else if (flag == "--workers") {
+            config.workers = value;
+        } else if (flag == "--max-queue") {
+            config.max_queue = value;
+        } else if (flag == "--target-ms") {
+            config.target_ms = value;
+        } else if (flag == "--backlog") {
+            config.backlog = value;
+        } else if (flag == "--dedup") {
+            config.dedup = value != 0;  // share blocks with identical contents
+        } else if (flag == "--listeners") {
+            config.listeners = value;   // SO_REUSEPORT accept sharding
+        } else if (flag == "--max-staleness-ms") {
+            config.max_staleness_ms = value;
+        } else if (flag == "--defrag") {
+            config.defrag = value != 0;  // rewrite fragmented files while idle
+        } else {
+            std::cout << "Unknown argument " << flag << "\n";
+            usage();
+            return -1;
+        }
     }
     
+    // a replica applies its primary's writes without logging them, so it cannot feed replicas itself
+    if (!config.follow.empty() && !config.replica_socket.empty()) {
+        std::cout << "--follow and --replica-socket cannot be combined\n";
+        usage();
+        return -1;
+    }
+
+    // a replica's disk must stay block for block its primary's
+    if (!config.follow.empty() && config.defrag) {
+        std::cout << "--follow and --defrag cannot be combined\n";
+        usage();
+        return -1;
+    }
+
     // Create the network server
-    Network network(portnum);
+    Network network(config);
 
     try {
         network.start_server();
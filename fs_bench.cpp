@@ -0,0 +1,479 @@
+/***************************************************************************************************
+ *                                            fs_bench                                             *
+ ***************************************************************************************************/
+/*
+ * End-to-end load generator for the file server.
+ *
+ * Drives the fs_client.h API from N client threads and reports throughput and
+ * p50/p99/p999 latency per operation type as JSON.  By default the server is
+ * started in-process on a loopback port against the disk from libfs_server.o,
+ * so a run needs nothing but a formatted disk image (createfs).
+ *
+ * Build:
+ *     g++ -std=c++20 -O2 -o fs_bench fs_bench.cpp network.cpp request.cpp metrics.cpp lock_profiler.cpp tracer.cpp lease_table.cpp scheduler.cpp admission.cpp dedup.cpp replication.cpp snapshot.cpp defrag.cpp \
+ *         fs_client.cpp libfs_server.o -lboost_thread -lboost_regex -pthread -ldl
+ *
+ * (link libfs_client.o instead of fs_client.cpp for the one-connection-per-call client)
+ *
+ * Example:
+ *     ./fs_bench --threads 8 --seconds 10 --mix 70:20:5:5 --dist zipf --out bench.json
+ */
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <array>
+#include <random>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <stdexcept>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <boost/thread.hpp>
+
+#include "fs_client.h"
+#include "fs_server.h"
+#include "network.hpp"
+
+using bench_clock = std::chrono::steady_clock;
+
+enum bench_op { OP_READ, OP_WRITE, OP_CREATE, OP_DELETE, OP_COUNT };
+
+static const char* const op_names[OP_COUNT] = {"read", "write", "create", "delete"};
+
+struct bench_config {
+    unsigned int threads      = 4;
+    double seconds            = 10.0;
+    unsigned long ops         = 0;            // ops per thread, 0 means run for seconds
+    std::array<unsigned int, OP_COUNT> mix{70, 20, 5, 5};
+    unsigned int depth        = 2;            // levels of directories below the bench root
+    unsigned int fanout       = 4;            // subdirectories per directory
+    unsigned int files        = 8;            // files per leaf directory
+    unsigned int file_blocks  = 4;            // blocks written to each file at setup
+    bool zipf                 = false;        // working set skew, uniform otherwise
+    double zipf_s             = 0.99;
+    std::string host          = "localhost";
+    int port                  = 0;            // 0 starts an in-process server
+    std::string user          = "bench";
+    unsigned int seed         = 1;
+    std::string out           = "-";
+    bool keep                 = false;        // leave the tree on disk after the run
+};
+
+/*
+ * Latency samples and error counts of one client thread, merged at the end.
+ */
+struct thread_stats {
+    std::array<std::vector<uint64_t>, OP_COUNT> lat_ns;
+    std::array<unsigned long, OP_COUNT> errors{};
+};
+
+/*
+ * Picks an index in [0, n) either uniformly or from a Zipf distribution
+ * with exponent s, using a precomputed CDF.
+ */
+class index_sampler {
+public:
+    index_sampler(size_t n, bool zipf, double s) : n_(n) {
+        if (!zipf) {
+            return;
+        }
+        cdf_.resize(n);
+        double sum = 0;
+        for (size_t i = 0; i < n; ++i) {
+            sum += 1.0 / std::pow(static_cast<double>(i + 1), s);
+            cdf_[i] = sum;
+        }
+        for (double &c : cdf_) {
+            c /= sum;
+        }
+    }
+
+    size_t operator()(std::mt19937_64 &rng) const {
+        if (cdf_.empty()) {
+            return std::uniform_int_distribution<size_t>(0, n_ - 1)(rng);
+        }
+        double u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+        size_t i = std::lower_bound(cdf_.begin(), cdf_.end(), u) - cdf_.begin();
+        return std::min(i, n_ - 1);
+    }
+
+private:
+    size_t n_;
+    std::vector<double> cdf_;
+};
+
+static void usage() {
+    std::cerr <<
+        "./fs_bench [options]\n"
+        "  --threads N          client threads (4)\n"
+        "  --seconds S          run length (10)\n"
+        "  --ops N              ops per thread instead of --seconds\n"
+        "  --mix R:W:C:D        op weights for read/write/create/delete (70:20:5:5)\n"
+        "  --depth D            directory depth below the bench root (2)\n"
+        "  --fanout F           subdirectories per directory (4)\n"
+        "  --files N            files per leaf directory (8)\n"
+        "  --file-blocks B      blocks per file (4)\n"
+        "  --dist uniform|zipf  working set skew (uniform)\n"
+        "  --zipf-s S           zipf exponent (0.99)\n"
+        "  --server HOST:PORT   use a running server instead of an in-process one\n"
+        "  --user NAME          username for all requests (bench)\n"
+        "  --seed N             random seed (1)\n"
+        "  --out FILE           JSON report destination, - for stdout (-)\n"
+        "  --keep               do not delete the tree afterwards\n";
+}
+
+static bool parse_args(int argc, char* argv[], bench_config &cfg) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) {
+                throw std::runtime_error("missing value for " + arg);
+            }
+            return argv[++i];
+        };
+        if (arg == "--threads") {
+            cfg.threads = std::stoul(value());
+        } else if (arg == "--seconds") {
+            cfg.seconds = std::stod(value());
+        } else if (arg == "--ops") {
+            cfg.ops = std::stoul(value());
+        } else if (arg == "--mix") {
+            std::stringstream ss(value());
+            std::string part;
+            for (unsigned int &w : cfg.mix) {
+                if (!std::getline(ss, part, ':')) {
+                    throw std::runtime_error("--mix needs four weights");
+                }
+                w = std::stoul(part);
+            }
+        } else if (arg == "--depth") {
+            cfg.depth = std::stoul(value());
+        } else if (arg == "--fanout") {
+            cfg.fanout = std::stoul(value());
+        } else if (arg == "--files") {
+            cfg.files = std::stoul(value());
+        } else if (arg == "--file-blocks") {
+            cfg.file_blocks = std::stoul(value());
+        } else if (arg == "--dist") {
+            std::string d = value();
+            if (d != "uniform" && d != "zipf") {
+                throw std::runtime_error("--dist must be uniform or zipf");
+            }
+            cfg.zipf = (d == "zipf");
+        } else if (arg == "--zipf-s") {
+            cfg.zipf_s = std::stod(value());
+        } else if (arg == "--server") {
+            std::string s = value();
+            size_t colon = s.rfind(':');
+            if (colon == std::string::npos) {
+                throw std::runtime_error("--server needs HOST:PORT");
+            }
+            cfg.host = s.substr(0, colon);
+            cfg.port = std::stoi(s.substr(colon + 1));
+        } else if (arg == "--user") {
+            cfg.user = value();
+        } else if (arg == "--seed") {
+            cfg.seed = std::stoul(value());
+        } else if (arg == "--out") {
+            cfg.out = value();
+        } else if (arg == "--keep") {
+            cfg.keep = true;
+        } else {
+            usage();
+            return false;
+        }
+    }
+    if (cfg.threads == 0 || cfg.fanout == 0 || cfg.files == 0 || cfg.file_blocks == 0
+        || cfg.file_blocks > FS_MAXFILEBLOCKS || cfg.user.empty() || cfg.user.size() > FS_MAXUSERNAME) {
+        throw std::runtime_error("invalid configuration");
+    }
+    return true;
+} // parse_args()
+
+/*
+ * Asks the OS for a free loopback port for the in-process server.
+ */
+static int pick_free_port() {
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port        = 0;
+    socklen_t len = sizeof(addr);
+    if (s < 0 || bind(s, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0
+        || getsockname(s, reinterpret_cast<sockaddr*>(&addr), &len) < 0) {
+        throw std::runtime_error("could not pick a free port");
+    }
+    close(s);
+    return ntohs(addr.sin_port);
+}
+
+static void wait_for_server(int port) {
+    for (int attempt = 0; attempt < 500; ++attempt) {
+        int s = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr{};
+        addr.sin_family      = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port        = htons(port);
+        bool up = connect(s, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0;
+        close(s);
+        if (up) {
+            return;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    throw std::runtime_error("in-process server did not come up");
+}
+
+/*
+ * Builds the directory tree and fills every file.  Returns the leaf
+ * directories and files so the workers can address them by index.
+ */
+static void build_tree(const bench_config &cfg, const std::string &root,
+                       std::vector<std::string> &leaf_dirs, std::vector<std::string> &files) {
+    const char* user = cfg.user.c_str();
+    if (fs_create(user, root.c_str(), 'd') != 0) {
+        throw std::runtime_error("could not create " + root);
+    }
+    std::vector<std::string> level{root};
+    for (unsigned int d = 0; d < cfg.depth; ++d) {
+        std::vector<std::string> next;
+        for (const std::string &dir : level) {
+            for (unsigned int i = 0; i < cfg.fanout; ++i) {
+                std::string child = dir + "/d" + std::to_string(i);
+                if (fs_create(user, child.c_str(), 'd') != 0) {
+                    throw std::runtime_error("could not create " + child);
+                }
+                next.push_back(child);
+            }
+        }
+        level = std::move(next);
+    }
+    leaf_dirs = level;
+
+    char buf[FS_BLOCKSIZE];
+    for (const std::string &dir : leaf_dirs) {
+        for (unsigned int i = 0; i < cfg.files; ++i) {
+            std::string file = dir + "/f" + std::to_string(i);
+            if (fs_create(user, file.c_str(), 'f') != 0) {
+                throw std::runtime_error("could not create " + file);
+            }
+            for (unsigned int b = 0; b < cfg.file_blocks; ++b) {
+                std::memset(buf, 'a' + (b % 26), FS_BLOCKSIZE);
+                if (fs_writeblock(user, file.c_str(), b, buf) != 0) {
+                    throw std::runtime_error("could not fill " + file + " (disk full?)");
+                }
+            }
+            files.push_back(file);
+        }
+    }
+} // build_tree()
+
+static void run_worker(const bench_config &cfg, unsigned int id, const std::vector<std::string> &leaf_dirs,
+                       const std::vector<std::string> &files, const index_sampler &file_pick,
+                       const index_sampler &dir_pick, const std::atomic<bool> &stop, thread_stats &stats,
+                       std::vector<std::string> &created) {
+    std::mt19937_64 rng(cfg.seed * 7919 + id);
+    std::discrete_distribution<int> op_pick(cfg.mix.begin(), cfg.mix.end());
+    std::uniform_int_distribution<unsigned int> block_pick(0, cfg.file_blocks - 1);
+    const char* user = cfg.user.c_str();
+    char buf[FS_BLOCKSIZE];
+    std::memset(buf, 'w', FS_BLOCKSIZE);
+    unsigned long next_name = 0;
+
+    for (unsigned long n = 0; cfg.ops ? n < cfg.ops : !stop.load(std::memory_order_relaxed); ++n) {
+        int op = op_pick(rng);
+        // keep the working set stable: deletes only remove this thread's own creates
+        if (op == OP_DELETE && created.empty()) {
+            op = OP_CREATE;
+        }
+        std::string target;
+        int rc = 0;
+        auto start = bench_clock::now();
+        switch (op) {
+            case OP_READ:
+                rc = fs_readblock(user, files[file_pick(rng)].c_str(), block_pick(rng), buf);
+                break;
+            case OP_WRITE:
+                rc = fs_writeblock(user, files[file_pick(rng)].c_str(), block_pick(rng), buf);
+                break;
+            case OP_CREATE:
+                target = leaf_dirs[dir_pick(rng)] + "/t" + std::to_string(id) + "_" + std::to_string(next_name++);
+                start = bench_clock::now();
+                rc = fs_create(user, target.c_str(), 'f');
+                if (rc == 0) {
+                    created.push_back(target);
+                }
+                break;
+            case OP_DELETE:
+                target = std::move(created.back());
+                created.pop_back();
+                start = bench_clock::now();
+                rc = fs_delete(user, target.c_str());
+                break;
+        }
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - start).count();
+        stats.lat_ns[op].push_back(static_cast<uint64_t>(ns));
+        if (rc != 0) {
+            ++stats.errors[op];
+        }
+    }
+} // run_worker()
+
+static double percentile_us(const std::vector<uint64_t> &sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t idx = static_cast<size_t>(std::ceil(p * sorted.size())) - 1;
+    return sorted[std::min(idx, sorted.size() - 1)] / 1000.0;
+}
+
+static void write_report(std::ostream &os, const bench_config &cfg, double elapsed_s,
+                         std::vector<thread_stats> &stats) {
+    unsigned long total = 0;
+    os << "{\n";
+    os << "  \"config\": {\"threads\": " << cfg.threads << ", \"depth\": " << cfg.depth
+       << ", \"fanout\": " << cfg.fanout << ", \"files\": " << cfg.files
+       << ", \"file_blocks\": " << cfg.file_blocks << ", \"dist\": \"" << (cfg.zipf ? "zipf" : "uniform")
+       << "\", \"zipf_s\": " << cfg.zipf_s << ", \"mix\": [" << cfg.mix[0] << ", " << cfg.mix[1]
+       << ", " << cfg.mix[2] << ", " << cfg.mix[3] << "], \"in_process\": "
+       << (cfg.port == 0 ? "true" : "false") << "},\n";
+    os << "  \"elapsed_s\": " << elapsed_s << ",\n";
+    os << "  \"ops\": {\n";
+    for (int op = 0; op < OP_COUNT; ++op) {
+        std::vector<uint64_t> merged;
+        unsigned long errors = 0;
+        for (thread_stats &s : stats) {
+            merged.insert(merged.end(), s.lat_ns[op].begin(), s.lat_ns[op].end());
+            errors += s.errors[op];
+        }
+        std::sort(merged.begin(), merged.end());
+        total += merged.size();
+        os << "    \"" << op_names[op] << "\": {\"count\": " << merged.size() << ", \"errors\": " << errors
+           << ", \"ops_per_sec\": " << merged.size() / elapsed_s
+           << ", \"p50_us\": " << percentile_us(merged, 0.50)
+           << ", \"p99_us\": " << percentile_us(merged, 0.99)
+           << ", \"p999_us\": " << percentile_us(merged, 0.999)
+           << ", \"max_us\": " << (merged.empty() ? 0 : merged.back() / 1000.0) << "}"
+           << (op + 1 < OP_COUNT ? "," : "") << "\n";
+    }
+    os << "  },\n";
+    os << "  \"total_ops\": " << total << ",\n";
+    os << "  \"ops_per_sec\": " << total / elapsed_s << "\n";
+    os << "}\n";
+} // write_report()
+
+int main(int argc, char* argv[]) {
+    bench_config cfg;
+    try {
+        if (!parse_args(argc, argv, cfg)) {
+            return -1;
+        }
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << "\n";
+        usage();
+        return -1;
+    }
+
+    // the disk library traces every block access to cout; keep the report clean
+    std::unique_ptr<Network> network;
+
+    try {
+        int port = cfg.port;
+        if (port == 0) {
+            std::cout.setstate(std::ios::badbit);
+            port = pick_free_port();
+            network = std::make_unique<Network>(server_config{port});
+            boost::thread server([&network]() {
+                try {
+                    network->start_server();
+                } catch (const std::runtime_error &e) {
+                    std::cerr << "server: " << e.what() << "\n";
+                }
+            });
+            server.detach();
+            wait_for_server(port);
+        }
+        if (fs_clientinit(cfg.host.c_str(), static_cast<uint16_t>(port)) != 0) {
+            throw std::runtime_error("fs_clientinit failed");
+        }
+
+        std::string root = "/bench" + std::to_string(getpid());
+        std::vector<std::string> leaf_dirs, files;
+        build_tree(cfg, root, leaf_dirs, files);
+
+        index_sampler file_pick(files.size(), cfg.zipf, cfg.zipf_s);
+        index_sampler dir_pick(leaf_dirs.size(), cfg.zipf, cfg.zipf_s);
+        std::vector<thread_stats> stats(cfg.threads);
+        std::vector<std::vector<std::string>> created(cfg.threads);
+        std::atomic<bool> stop{false};
+
+        auto start = bench_clock::now();
+        boost::thread_group workers;
+        for (unsigned int t = 0; t < cfg.threads; ++t) {
+            workers.create_thread([&, t]() {
+                run_worker(cfg, t, leaf_dirs, files, file_pick, dir_pick, stop, stats[t], created[t]);
+            });
+        }
+        if (cfg.ops == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(static_cast<long>(cfg.seconds * 1000)));
+            stop = true;
+        }
+        workers.join_all();
+        double elapsed = std::chrono::duration<double>(bench_clock::now() - start).count();
+
+        if (!cfg.keep) {
+            const char* user = cfg.user.c_str();
+            for (auto &list : created) {
+                for (const std::string &p : list) {
+                    fs_delete(user, p.c_str());
+                }
+            }
+            for (const std::string &f : files) {
+                fs_delete(user, f.c_str());
+            }
+            // directories bottom-up: deepest paths have the most components
+            std::vector<std::string> dirs = leaf_dirs;
+            while (!dirs.empty() && dirs.front() != root) {
+                std::vector<std::string> parents;
+                for (const std::string &d : dirs) {
+                    fs_delete(user, d.c_str());
+                    std::string parent = d.substr(0, d.rfind('/'));
+                    if (parents.empty() || parents.back() != parent) {
+                        parents.push_back(parent);
+                    }
+                }
+                dirs = std::move(parents);
+            }
+            fs_delete(user, root.c_str());
+        }
+
+        if (cfg.out == "-") {
+            // session connections can still be tracing their last send, so leave cout silenced
+            std::ostringstream report;
+            write_report(report, cfg, elapsed, stats);
+            fputs(report.str().c_str(), stdout);
+        } else {
+            std::ofstream out(cfg.out);
+            write_report(out, cfg, elapsed, stats);
+        }
+    } catch (const std::exception &e) {
+        std::cout.clear();
+        std::cerr << e.what() << "\n";
+        return -1;
+    }
+    // the in-process server never returns from start_server
+    std::cout.flush();
+    std::_Exit(0);
+} // main()
@@ -0,0 +1,1173 @@
+/***************************************************************************************************
+ *                                            fs_client                                            *
+ ***************************************************************************************************/
+/*
+ * Source-built implementation of fs_client.h, a drop-in replacement for
+ * libfs_client.o.
+ *
+ * libfs_client.o opens a new connection for every call.  This client keeps a
+ * few persistent connections instead: each is opened with an FS_SESSION
+ * handshake, after which the server answers any number of requests on it, in
+ * order (failures with FS_ERROR_REPLY instead of closing it, requests the
+ * server is too busy for with FS_BUSY_REPLY).
+ *
+ * Every request is asynchronous underneath.  Requests are queued on one of
+ * the channels (connections); whichever thread finds the channel idle sends
+ * everything queued in one sendmsg() and keeps going until the queue is
+ * empty, so requests issued while a send is under way are batched into the
+ * next one.  Responses arrive in request order and are matched to the FIFO of
+ * in-flight requests by the channel's receiver thread.
+ *
+ * A receiver thread notices a connection the server closed as soon as it
+ * happens.  Reads that got no response on a lost connection are retried
+ * once on a fresh one.  Anything else fails with -1, since the server may
+ * have run it before the connection went down.
+ *
+ * With fs_clientcache() on, reads ask for a read lease (FS_READLEASE) and
+ * keep the block and the path's inode until the lease expires; the server
+ * holds back writers to the file until then.
+ */
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "fs_client.h"
+
+// persistent connections to the server, requests are spread over them round robin
+static constexpr size_t CLIENT_CONNECTIONS = 8;
+
+// most requests put in one sendmsg()
+static constexpr size_t MAX_BATCH = 256;
+
+static constexpr char SESSION_REQUEST[] = "FS_SESSION";
+
+/*
+ * One persistent connection and its receive buffer.  Responses are read in
+ * chunks rather than a byte at a time, several can arrive in one recv().
+ */
+struct connection {
+    int fd = -1;
+    std::vector<char> rbuf;
+    size_t rpos = 0;
+
+    /*
+     * Reads up to and including the next null terminator into out (without it).
+     * Returns false on error or EOF.  got_data is set once any byte has arrived.
+     */
+    bool read_string(std::string &out, bool &got_data);
+
+    /*
+     * Reads exactly len bytes into buf, returns false on error or EOF
+     */
+    bool read_exact(void* buf, size_t len);
+
+private:
+    bool fill();
+};
+
+bool connection::fill() {
+    if (rpos == rbuf.size()) {
+        rbuf.clear();
+        rpos = 0;
+    }
+    char chunk[4096];
+    ssize_t n;
+    do {
+        n = recv(fd, chunk, sizeof(chunk), 0);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        return false;
+    }
+    rbuf.insert(rbuf.end(), chunk, chunk + n);
+    return true;
+}
+
+bool connection::read_string(std::string &out, bool &got_data) {
+    out.clear();
+    while (true) {
+        for (; rpos < rbuf.size(); ++rpos) {
+            got_data = true;
+            if (rbuf[rpos] == '\0') {
+                ++rpos;
+                return true;
+            }
+            out.push_back(rbuf[rpos]);
+        }
+        // a response header is never longer than its request plus a little
+        if (out.size() > FS_MAXUSERNAME + FS_MAXPATHNAME + 32 || !fill()) {
+            return false;
+        }
+    }
+}
+
+bool connection::read_exact(void* buf, size_t len) {
+    char* dst = static_cast<char*>(buf);
+    while (len > 0) {
+        if (rpos == rbuf.size() && !fill()) {
+            return false;
+        }
+        size_t n = std::min(len, rbuf.size() - rpos);
+        memcpy(dst, rbuf.data() + rpos, n);
+        rpos += n;
+        dst += n;
+        len -= n;
+    }
+    return true;
+}
+
+/*
+ * Sends every iovec, returns false on error.  MSG_NOSIGNAL keeps a connection
+ * the server already closed from killing the process with SIGPIPE.
+ */
+static bool send_all(int fd, iovec* iov, int iovcnt) {
+    while (iovcnt > 0) {
+        msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        // skip what was sent
+        while (iovcnt > 0 && static_cast<size_t>(n) >= iov->iov_len) {
+            n -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + n;
+            iov->iov_len -= n;
+        }
+    }
+    return true;
+}
+
+using cache_clock = std::chrono::steady_clock;
+
+/*
+ * Blocks and path -> inode resolutions, each only used while the lease it
+ * was read under is valid.  Lease expiry is counted from when the request
+ * was queued, which is never after the server granted it.
+ */
+class block_cache {
+public:
+    bool enabled() const { return capacity.load(std::memory_order_relaxed) != 0; }
+    void set_capacity(size_t max_blocks);
+
+    /*
+     * Copies the cached block into out if the lease on its file is still
+     * valid.  key is "<username> <pathname>".
+     */
+    bool lookup(const std::string &key, unsigned int block, void* out);
+
+    /*
+     * Stores a block read with FS_READLEASE.  requested is when the request
+     * was queued.
+     */
+    void store(const std::string &key, unsigned int block, const void* data, uint32_t inode,
+               cache_clock::time_point requested, std::chrono::milliseconds lease);
+
+    /*
+     * True if block of the file key resolves to (or of the file with inode
+     * block inode) is cached under a live lease, so it is inside the file
+     */
+    bool holds(const std::string &key, unsigned int block);
+    bool holds_inode(uint32_t inode, unsigned int block);
+
+    /*
+     * Drops the file key resolves to, for writes and deletes of this process
+     */
+    void invalidate(const std::string &key);
+
+    /*
+     * invalidate() for key and every path under it, for tree deletes
+     */
+    void invalidate_tree(const std::string &key);
+
+    /*
+     * Drops the file with inode block inode, for writes by handle
+     */
+    void invalidate_inode(uint32_t inode);
+
+private:
+    struct file_entry {
+        cache_clock::time_point expires{};
+        uint64_t epoch = 0;             // changes whenever the blocks are dropped
+        std::unordered_map<unsigned int, std::array<char, FS_BLOCKSIZE>> blocks;
+    };
+    struct path_entry {
+        uint32_t inode;
+        uint64_t epoch;                 // epoch of the file when it was resolved
+    };
+
+    void drop(std::unordered_map<uint32_t, file_entry>::iterator it);
+    void make_room(cache_clock::time_point now);
+
+    std::atomic<size_t> capacity{0};
+    std::mutex m;
+    std::unordered_map<std::string, path_entry> paths;
+    std::unordered_map<uint32_t, file_entry> files;         // by inode block
+    size_t cached_blocks = 0;
+    uint64_t next_epoch = 1;
+};
+
+void block_cache::set_capacity(size_t max_blocks) {
+    std::lock_guard<std::mutex> g(m);
+    capacity.store(max_blocks, std::memory_order_relaxed);
+    if (max_blocks == 0) {
+        paths.clear();
+        files.clear();
+        cached_blocks = 0;
+    }
+}
+
+bool block_cache::lookup(const std::string &key, unsigned int block, void* out) {
+    std::lock_guard<std::mutex> g(m);
+    auto p = paths.find(key);
+    if (p == paths.end()) {
+        return false;
+    }
+    auto f = files.find(p->second.inode);
+    if (f == files.end() || f->second.epoch != p->second.epoch || cache_clock::now() >= f->second.expires) {
+        return false;
+    }
+    auto b = f->second.blocks.find(block);
+    if (b == f->second.blocks.end()) {
+        return false;
+    }
+    memcpy(out, b->second.data(), FS_BLOCKSIZE);
+    return true;
+}
+
+void block_cache::store(const std::string &key, unsigned int block, const void* data, uint32_t inode,
+                        cache_clock::time_point requested, std::chrono::milliseconds lease) {
+    if (lease.count() == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> g(m);
+    if (!enabled()) {
+        return;
+    }
+    auto f = files.find(inode);
+    if (f == files.end()) {
+        make_room(requested);
+        f = files.emplace(inode, file_entry{}).first;
+        f->second.epoch = next_epoch++;
+    } else if (requested >= f->second.expires) {
+        // the old lease lapsed before this one, a write may have happened in between
+        cached_blocks -= f->second.blocks.size();
+        f->second.blocks.clear();
+        f->second.epoch = next_epoch++;
+    }
+    if (cached_blocks >= capacity.load(std::memory_order_relaxed)) {
+        return;
+    }
+    file_entry &file = f->second;
+    file.expires = std::max(file.expires, requested + lease);
+    auto [b, inserted] = file.blocks.try_emplace(block);
+    memcpy(b->second.data(), data, FS_BLOCKSIZE);
+    cached_blocks += inserted;
+    paths[key] = path_entry{inode, file.epoch};
+}
+
+bool block_cache::holds(const std::string &key, unsigned int block) {
+    std::lock_guard<std::mutex> g(m);
+    auto p = paths.find(key);
+    if (p == paths.end()) {
+        return false;
+    }
+    auto f = files.find(p->second.inode);
+    return f != files.end() && f->second.epoch == p->second.epoch && cache_clock::now() < f->second.expires &&
+           f->second.blocks.contains(block);
+}
+
+bool block_cache::holds_inode(uint32_t inode, unsigned int block) {
+    std::lock_guard<std::mutex> g(m);
+    auto f = files.find(inode);
+    return f != files.end() && cache_clock::now() < f->second.expires && f->second.blocks.contains(block);
+}
+
+void block_cache::invalidate(const std::string &key) {
+    std::lock_guard<std::mutex> g(m);
+    auto p = paths.find(key);
+    if (p == paths.end()) {
+        return;
+    }
+    auto f = files.find(p->second.inode);
+    if (f != files.end()) {
+        drop(f);
+    }
+    paths.erase(p);
+}
+
+void block_cache::invalidate_tree(const std::string &key) {
+    std::lock_guard<std::mutex> g(m);
+    std::string prefix = key + "/";
+    for (auto p = paths.begin(); p != paths.end();) {
+        if (p->first != key && p->first.compare(0, prefix.size(), prefix) != 0) {
+            ++p;
+            continue;
+        }
+        auto f = files.find(p->second.inode);
+        if (f != files.end()) {
+            drop(f);
+        }
+        p = paths.erase(p);
+    }
+}
+
+void block_cache::invalidate_inode(uint32_t inode) {
+    std::lock_guard<std::mutex> g(m);
+    auto f = files.find(inode);
+    if (f != files.end()) {
+        drop(f);
+    }
+}
+
+void block_cache::drop(std::unordered_map<uint32_t, file_entry>::iterator it) {
+    cached_blocks -= it->second.blocks.size();
+    files.erase(it);
+}
+
+void block_cache::make_room(cache_clock::time_point now) {
+    if (cached_blocks < capacity.load(std::memory_order_relaxed)) {
+        return;
+    }
+    // expired files first, everything if that is not enough
+    for (auto it = files.begin(); it != files.end();) {
+        auto next = std::next(it);
+        if (it->second.expires <= now) {
+            drop(it);
+        }
+        it = next;
+    }
+    if (cached_blocks >= capacity.load(std::memory_order_relaxed)) {
+        files.clear();
+        cached_blocks = 0;
+    }
+    std::erase_if(paths, [this](const auto &kv) { return !files.contains(kv.second.inode); });
+}
+
+static block_cache cache;
+
+/*
+ * A queued request
+ */
+struct pending_op {
+    std::string header;                     // sent with its null terminator
+    std::string payload;                    // sent after the header, if any
+    void* response = nullptr;               // FS_BLOCKSIZE bytes, or nullptr
+    fs_callback done;
+    unsigned int attempts = 0;              // connections it was sent on
+    bool failed = false;                    // its response was cut off
+    // running it twice has the effect of running it once, so it is sent again if its connection drops
+    bool retry_safe = false;
+
+    // null terminated strings that follow the response header, handed to on_strings before done(0)
+    size_t strings = 0;
+    std::function<void(std::vector<std::string>&)> on_strings;
+    // if set, given the last of those strings, the number of strings that follow it
+    std::function<size_t(const std::string&)> more_strings;
+
+    // FS_READLEASE only, where the block goes in the cache
+    bool lease = false;
+    std::string cache_key;
+    unsigned int block = 0;
+    cache_clock::time_point requested{};
+};
+
+/*
+ * One persistent connection, the requests waiting to be sent on it and the
+ * ones waiting for a response.
+ */
+class channel {
+public:
+    explicit channel(const sockaddr_storage &addr, socklen_t addr_len) : addr(addr), addr_len(addr_len) {}
+
+    /*
+     * Queues op and, unless another thread is already sending on this
+     * channel, sends until the queue is empty.
+     */
+    void submit(std::unique_ptr<pending_op> op);
+
+private:
+    /*
+     * Sends everything queued.  Called with m held by the one thread that set
+     * flushing; only that thread touches the socket for writing, opens new
+     * connections and closes dead ones.
+     */
+    void drain(std::unique_lock<std::mutex> &g);
+
+    void receive_loop(connection c);
+
+    /*
+     * The receiver of lost_fd gave up on it.  Unanswered requests go back to
+     * the front of the queue; response_started marks the oldest one failed,
+     * and so are those that are not retry_safe: the server may have run them
+     * already, and running them again would fail ("exists", "not found").
+     */
+    void connection_lost(int lost_fd, bool response_started);
+
+    connection open_connection();
+
+    const sockaddr_storage addr;
+    const socklen_t addr_len;
+
+    std::mutex m;
+    int fd = -1;
+    bool flushing = false;
+    std::vector<int> dead_fds;                          // closed by the next drain
+    std::deque<std::unique_ptr<pending_op>> outbox;     // not sent yet
+    std::deque<std::unique_ptr<pending_op>> in_flight;  // sent, in response order
+};
+
+void channel::submit(std::unique_ptr<pending_op> op) {
+    std::unique_lock<std::mutex> g(m);
+    outbox.push_back(std::move(op));
+    if (flushing) {
+        // the sending thread will pick it up with the next batch
+        return;
+    }
+    flushing = true;
+    drain(g);
+}
+
+void channel::drain(std::unique_lock<std::mutex> &g) {
+    std::vector<iovec> iov;
+    std::vector<std::unique_ptr<pending_op>> finished;
+    while (true) {
+        for (int dead : dead_fds) {
+            close(dead);
+        }
+        dead_fds.clear();
+
+        // requests that can't be sent (again)
+        for (auto it = outbox.begin(); it != outbox.end();) {
+            if ((*it)->failed || (*it)->attempts >= 2) {
+                finished.push_back(std::move(*it));
+                it = outbox.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        if (!finished.empty()) {
+            g.unlock();
+            for (auto &op : finished) {
+                op->done(-1);
+            }
+            finished.clear();
+            g.lock();
+            continue;
+        }
+        if (outbox.empty()) {
+            break;
+        }
+
+        if (fd < 0) {
+            g.unlock();
+            connection c = open_connection();
+            g.lock();
+            if (c.fd < 0) {
+                // the server is unreachable, fail everything queued
+                for (auto &op : outbox) {
+                    finished.push_back(std::move(op));
+                }
+                outbox.clear();
+                continue;
+            }
+            fd = c.fd;
+            std::thread([this, c = std::move(c)]() mutable { receive_loop(std::move(c)); }).detach();
+        }
+
+        iov.clear();
+        while (!outbox.empty() && iov.size() < 2 * MAX_BATCH) {
+            pending_op* op = outbox.front().get();
+            ++op->attempts;
+            iov.push_back({op->header.data(), op->header.size() + 1});
+            if (!op->payload.empty()) {
+                iov.push_back({op->payload.data(), op->payload.size()});
+            }
+            in_flight.push_back(std::move(outbox.front()));
+            outbox.pop_front();
+        }
+        int cur = fd;
+        g.unlock();
+        // the ops stay alive until their response is read, which can't happen before they are sent
+        bool sent = send_all(cur, iov.data(), static_cast<int>(iov.size()));
+        g.lock();
+        if (!sent && fd == cur) {
+            // let the receiver requeue what's in flight
+            shutdown(cur, SHUT_RDWR);
+        }
+    }
+    flushing = false;
+} // channel::drain()
+
+void channel::receive_loop(connection c) {
+    while (true) {
+        std::string reply;
+        bool got_data = false;
+        if (!c.read_string(reply, got_data)) {
+            connection_lost(c.fd, got_data);
+            return;
+        }
+        std::unique_ptr<pending_op> op;
+        {
+            std::lock_guard<std::mutex> g(m);
+            if (!in_flight.empty()) {
+                op = std::move(in_flight.front());
+                in_flight.pop_front();
+            }
+        }
+        if (!op) {
+            // nothing was asked for
+            connection_lost(c.fd, false);
+            return;
+        }
+        // a request the server shed failed too; retrying here would only add to its load
+        if (reply == FS_ERROR_REPLY || reply == FS_BUSY_REPLY) {
+            op->done(-1);
+            continue;
+        }
+        std::string lease_info;
+        std::vector<std::string> strings(op->strings);
+        bool complete = reply == op->header && (!op->lease || c.read_string(lease_info, got_data));
+        for (size_t i = 0; complete && i < strings.size(); ++i) {
+            complete = c.read_string(strings[i], got_data);
+        }
+        if (complete && op->more_strings) {
+            size_t more = op->more_strings(strings.back());
+            for (size_t i = 0; complete && i < more; ++i) {
+                strings.emplace_back();
+                complete = c.read_string(strings.back(), got_data);
+            }
+        }
+        if (!complete || (op->response && !c.read_exact(op->response, FS_BLOCKSIZE))) {
+            // out of sync with the server, nothing else on this connection can be trusted
+            op->done(-1);
+            connection_lost(c.fd, false);
+            return;
+        }
+        if (op->on_strings) {
+            op->on_strings(strings);
+        }
+        if (op->lease) {
+            // "<inode_block> <lease_ms>"
+            unsigned long inode = 0;
+            unsigned long lease_ms = 0;
+            if (sscanf(lease_info.c_str(), "%lu %lu", &inode, &lease_ms) == 2) {
+                cache.store(op->cache_key, op->block, op->response, static_cast<uint32_t>(inode), op->requested,
+                            std::chrono::milliseconds(lease_ms));
+            }
+        }
+        op->done(0);
+    }
+} // channel::receive_loop()
+
+void channel::connection_lost(int lost_fd, bool response_started) {
+    std::unique_lock<std::mutex> g(m);
+    if (response_started && !in_flight.empty()) {
+        in_flight.front()->failed = true;
+    }
+    for (auto &op : in_flight) {
+        op->failed = op->failed || !op->retry_safe;
+    }
+    while (!in_flight.empty()) {
+        outbox.push_front(std::move(in_flight.back()));
+        in_flight.pop_back();
+    }
+    fd = -1;
+    if (flushing) {
+        // the sending thread may still be using it
+        dead_fds.push_back(lost_fd);
+        return;
+    }
+    close(lost_fd);
+    if (!outbox.empty()) {
+        flushing = true;
+        drain(g);
+    }
+}
+
+connection channel::open_connection() {
+    connection c;
+    c.fd = socket(addr.ss_family, SOCK_STREAM, 0);
+    if (c.fd < 0) {
+        return c;
+    }
+    int yesval = 1;
+    setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &yesval, sizeof(yesval));
+    iovec iov{const_cast<char*>(SESSION_REQUEST), sizeof(SESSION_REQUEST)};
+    std::string reply;
+    bool got_data = false;
+    if (connect(c.fd, reinterpret_cast<const sockaddr*>(&addr), addr_len) < 0
+            || !send_all(c.fd, &iov, 1) || !c.read_string(reply, got_data) || reply != SESSION_REQUEST) {
+        // unreachable, or the server does not support sessions
+        close(c.fd);
+        c.fd = -1;
+    }
+    return c;
+}
+
+// set once by fs_clientinit, never freed so receiver threads can outlive main()
+static std::vector<channel*>* channels = nullptr;
+static std::atomic<size_t> next_channel{0};
+static std::once_flag init_flag;
+
+/*
+ * True for the requests that only read, which can be sent again after a lost
+ * connection.  Block writes are too when they do not extend the file, see
+ * fs_writeblock_async().
+ */
+static bool read_only_request(const std::string &header) {
+    static const char* const reads[] = {"FS_READBLOCK ", "FS_READLEASE ", "FS_READHANDLE ", "FS_OPEN ",
+                                        "FS_STAT ", "FS_STATMANY ", "FS_READDIR "};
+    for (const char* type : reads) {
+        if (header.compare(0, strlen(type), type) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * make_op
+ *
+ * A request for header (and FS_BLOCKSIZE bytes of payload if given).  On
+ * success FS_BLOCKSIZE response bytes are copied into response if given.
+ * done gets 0 on success, -1 on failure.
+ */
+static std::unique_ptr<pending_op> make_op(std::string header, const void* payload, void* response,
+                                           fs_callback done) {
+    auto op = std::make_unique<pending_op>();
+    op->retry_safe = read_only_request(header);
+    op->header = std::move(header);
+    if (payload) {
+        op->payload.assign(static_cast<const char*>(payload), FS_BLOCKSIZE);
+    }
+    op->response = response;
+    op->done = std::move(done);
+    return op;
+}
+
+/*
+ * Queues op on the next channel
+ */
+static void submit(std::unique_ptr<pending_op> op) {
+    if (!channels) {
+        op->done(-1);
+        return;
+    }
+    size_t i = next_channel.fetch_add(1, std::memory_order_relaxed) % channels->size();
+    (*channels)[i]->submit(std::move(op));
+}
+
+/*
+ * Runs one of the callback variants and returns its result as a future
+ */
+template <typename Start>
+static std::future<int> as_future(Start &&start) {
+    auto result = std::make_shared<std::promise<int>>();
+    std::future<int> f = result->get_future();
+    start([result](int r) { result->set_value(r); });
+    return f;
+}
+
+/*
+ * Cheap checks that save a round trip for requests the server is bound to reject
+ */
+static bool valid_user(const char* username) {
+    if (!username) {
+        return false;
+    }
+    size_t user_len = strlen(username);
+    return user_len > 0 && user_len <= FS_MAXUSERNAME && !strchr(username, ' ');
+}
+
+static bool valid_args(const char* username, const char* pathname) {
+    if (!valid_user(username) || !pathname) {
+        return false;
+    }
+    size_t path_len = strlen(pathname);
+    return path_len > 0 && path_len <= FS_MAXPATHNAME && pathname[0] == '/' && !strchr(pathname, ' ');
+}
+
+/*
+ * The handle's id if it looks like one the server handed out, else nullptr
+ */
+static const char* handle_id(const fs_handle* handle) {
+    if (!handle || !memchr(handle->id, '\0', sizeof(handle->id)) || handle->id[0] == '\0'
+            || strchr(handle->id, ' ')) {
+        return nullptr;
+    }
+    return handle->id;
+}
+
+int fs_clientinit(const char* hostname, uint16_t port) {
+    if (!hostname) {
+        return -1;
+    }
+    bool ok = false;
+    std::call_once(init_flag, [&] {
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* res = nullptr;
+        std::string service = std::to_string(port);
+        if (getaddrinfo(hostname, service.c_str(), &hints, &res) != 0 || !res) {
+            return;
+        }
+        sockaddr_storage addr{};
+        memcpy(&addr, res->ai_addr, res->ai_addrlen);
+        socklen_t addr_len = res->ai_addrlen;
+        freeaddrinfo(res);
+
+        auto* list = new std::vector<channel*>();
+        for (size_t i = 0; i < CLIENT_CONNECTIONS; ++i) {
+            list->push_back(new channel(addr, addr_len));
+        }
+        channels = list;
+        ok = true;
+    });
+    return ok ? 0 : -1;
+}
+
+int fs_clientcache(size_t max_blocks) {
+    cache.set_capacity(max_blocks);
+    return 0;
+}
+
+void fs_readblock_async(const char* username, const char* pathname, unsigned int offset, void* buf,
+                        fs_callback done) {
+    if (!valid_args(username, pathname) || !buf || offset >= FS_MAXFILEBLOCKS) {
+        done(-1);
+        return;
+    }
+    if (!cache.enabled()) {
+        submit(make_op(std::string("FS_READBLOCK ") + username + " " + pathname + " " + std::to_string(offset),
+                       nullptr, buf, std::move(done)));
+        return;
+    }
+    std::string key = std::string(username) + " " + pathname;
+    if (cache.lookup(key, offset, buf)) {
+        done(0);
+        return;
+    }
+    auto op = make_op(std::string("FS_READLEASE ") + username + " " + pathname + " " + std::to_string(offset),
+                      nullptr, buf, std::move(done));
+    op->lease = true;
+    op->cache_key = std::move(key);
+    op->block = offset;
+    op->requested = cache_clock::now();
+    submit(std::move(op));
+}
+
+void fs_writeblock_async(const char* username, const char* pathname, unsigned int offset, const void* buf,
+                         fs_callback done) {
+    if (!valid_args(username, pathname) || !buf || offset >= FS_MAXFILEBLOCKS) {
+        done(-1);
+        return;
+    }
+    // a write may be sent again only if it cannot extend the file, which is known when the block is cached
+    bool in_file = false;
+    if (cache.enabled()) {
+        std::string key = std::string(username) + " " + pathname;
+        in_file = cache.holds(key, offset);
+        cache.invalidate(key);
+    }
+    auto op = make_op(std::string("FS_WRITEBLOCK ") + username + " " + pathname + " " + std::to_string(offset),
+                      buf, nullptr, std::move(done));
+    op->retry_safe = in_file;
+    submit(std::move(op));
+}
+
+void fs_create_async(const char* username, const char* pathname, char type, fs_callback done) {
+    if (!valid_args(username, pathname) || (type != 'f' && type != 'd')) {
+        done(-1);
+        return;
+    }
+    submit(make_op(std::string("FS_CREATE ") + username + " " + pathname + " " + type, nullptr, nullptr,
+                   std::move(done)));
+}
+
+void fs_create_batch_async(const char* username, const char* dirname, const char* const* names,
+                           const char* types, size_t count, int* results, fs_callback done) {
+    if (!valid_args(username, dirname) || !names || !types || !results || count == 0
+            || count > FS_MAXCREATEBATCH) {
+        done(-1);
+        return;
+    }
+    auto op = make_op(std::string("FS_CREATE_BATCH ") + username + " " + dirname + " " + std::to_string(count),
+                      nullptr, nullptr, std::move(done));
+    for (size_t i = 0; i < count; ++i) {
+        // the server fails any entry it can't create, but an empty one ends the request early
+        std::string entry = names[i] && names[i][0] ? names[i] : "/";
+        entry += std::string(" ") + (types[i] ? types[i] : '-');
+        op->payload.append(entry.c_str(), entry.size() + 1);
+    }
+    op->strings = count;
+    op->on_strings = [results](std::vector<std::string> &strings) {
+        for (size_t i = 0; i < strings.size(); ++i) {
+            results[i] = strings[i] == "0" ? 0 : -1;
+        }
+    };
+    submit(std::move(op));
+}
+
+void fs_copy_async(const char* username, const char* source, const char* target, fs_callback done) {
+    if (!valid_args(username, source) || !valid_args(username, target)) {
+        done(-1);
+        return;
+    }
+    submit(make_op(std::string("FS_COPY ") + username + " " + source + " " + target, nullptr, nullptr,
+                   std::move(done)));
+}
+
+void fs_delete_async(const char* username, const char* pathname, fs_callback done) {
+    if (!valid_args(username, pathname)) {
+        done(-1);
+        return;
+    }
+    if (cache.enabled()) {
+        cache.invalidate(std::string(username) + " " + pathname);
+    }
+    submit(make_op(std::string("FS_DELETE ") + username + " " + pathname, nullptr, nullptr, std::move(done)));
+}
+
+void fs_delete_tree_async(const char* username, const char* pathname, fs_callback done) {
+    if (!valid_args(username, pathname)) {
+        done(-1);
+        return;
+    }
+    if (cache.enabled()) {
+        cache.invalidate_tree(std::string(username) + " " + pathname);
+    }
+    submit(make_op(std::string("FS_DELETE_TREE ") + username + " " + pathname, nullptr, nullptr,
+                   std::move(done)));
+}
+
+/*
+ * Sends "FS_SNAPSHOT <username> <command> <name>"
+ */
+static void snapshot_async(const char* username, const char* command, const char* name, fs_callback done) {
+    size_t name_len = name ? strlen(name) : 0;
+    if (!valid_user(username) || name_len == 0 || name_len > FS_MAXFILENAME || strpbrk(name, "/ ")) {
+        done(-1);
+        return;
+    }
+    submit(make_op(std::string("FS_SNAPSHOT ") + username + " " + command + " " + name, nullptr, nullptr,
+                   std::move(done)));
+}
+
+void fs_snapshot_async(const char* username, const char* name, fs_callback done) {
+    snapshot_async(username, "create", name, std::move(done));
+}
+
+void fs_snapshot_delete_async(const char* username, const char* name, fs_callback done) {
+    snapshot_async(username, "delete", name, std::move(done));
+}
+
+void fs_open_async(const char* username, const char* pathname, fs_handle* handle, fs_callback done) {
+    if (!valid_args(username, pathname) || !handle) {
+        done(-1);
+        return;
+    }
+    auto op = make_op(std::string("FS_OPEN ") + username + " " + pathname, nullptr, nullptr, std::move(done));
+    op->strings = 1;
+    op->on_strings = [handle](std::vector<std::string> &strings) {
+        strings[0].resize(std::min<size_t>(strings[0].size(), FS_MAXHANDLE));
+        memcpy(handle->id, strings[0].c_str(), strings[0].size() + 1);
+    };
+    submit(std::move(op));
+}
+
+/*
+ * Parses "<type> <size> <owner>" from FS_STAT into info, false for "-"
+ */
+static bool parse_stat(const std::string &text, fs_stat_info* info) {
+    char type = 0;
+    unsigned int size = 0;
+    int owner_at = 0;
+    if (sscanf(text.c_str(), "%c %u %n", &type, &size, &owner_at) < 2 || owner_at == 0
+            || text.size() - owner_at > FS_MAXUSERNAME) {
+        return false;
+    }
+    info->type = type;
+    info->size = size;
+    memcpy(info->owner, text.c_str() + owner_at, text.size() - owner_at + 1);
+    return true;
+}
+
+void fs_stat_async(const char* username, const char* pathname, fs_stat_info* info, fs_callback done) {
+    if (!valid_args(username, pathname) || !info) {
+        done(-1);
+        return;
+    }
+    auto op = make_op(std::string("FS_STAT ") + username + " " + pathname, nullptr, nullptr, nullptr);
+    op->strings = 1;
+    auto ok = std::make_shared<bool>(false);
+    op->on_strings = [info, ok](std::vector<std::string> &strings) { *ok = parse_stat(strings[0], info); };
+    op->done = [ok, done = std::move(done)](int result) { done(result == 0 && *ok ? 0 : -1); };
+    submit(std::move(op));
+}
+
+void fs_statmany_async(const char* username, const char* const* pathnames, size_t count, fs_stat_info* infos,
+                       int* results, fs_callback done) {
+    if (!valid_user(username) || !pathnames || !infos || !results || count == 0 || count > FS_MAXSTATMANY) {
+        done(-1);
+        return;
+    }
+    auto op = make_op(std::string("FS_STATMANY ") + username + " " + std::to_string(count), nullptr, nullptr,
+                      std::move(done));
+    for (size_t i = 0; i < count; ++i) {
+        // the server answers "-" for any path it can't look up, but an empty one ends the request early
+        const char* path = valid_args(username, pathnames[i]) ? pathnames[i] : "-";
+        op->payload.append(path, strlen(path) + 1);
+    }
+    op->strings = count;
+    op->on_strings = [infos, results](std::vector<std::string> &strings) {
+        for (size_t i = 0; i < strings.size(); ++i) {
+            results[i] = parse_stat(strings[i], &infos[i]) ? 0 : -1;
+        }
+    };
+    submit(std::move(op));
+}
+
+/*
+ * Parses "<name>" or "<name> <type> <size>" from FS_READDIR into entry
+ */
+static bool parse_dirent(const std::string &text, bool attrs, fs_dirent* entry) {
+    size_t name_len = attrs ? text.find(' ') : text.size();
+    if (name_len == 0 || name_len == std::string::npos || name_len > FS_MAXFILENAME) {
+        return false;
+    }
+    memcpy(entry->name, text.data(), name_len);
+    entry->name[name_len] = '\0';
+    entry->type = 0;
+    entry->size = 0;
+    return !attrs || sscanf(text.c_str() + name_len, " %c %u", &entry->type, &entry->size) == 2;
+}
+
+void fs_readdir_async(const char* username, const char* pathname, unsigned int* cookie, bool attrs,
+                      fs_dirent* entries, size_t* count, fs_callback done) {
+    if (!valid_args(username, pathname) || !cookie || !entries || !count) {
+        done(-1);
+        return;
+    }
+    auto op = make_op(std::string("FS_READDIR ") + username + " " + pathname + " " + std::to_string(*cookie)
+                          + (attrs ? " attrs" : ""),
+                      nullptr, nullptr, nullptr);
+    // "<next_cookie> <count>", then count entries
+    op->strings = 1;
+    op->more_strings = [](const std::string &chunk_info) {
+        unsigned long next = 0;
+        size_t n = 0;
+        return sscanf(chunk_info.c_str(), "%lu %zu", &next, &n) == 2 ? n : 0;
+    };
+    auto ok = std::make_shared<bool>(false);
+    op->on_strings = [cookie, attrs, entries, count, ok](std::vector<std::string> &strings) {
+        unsigned int next = 0;
+        size_t n = 0;
+        if (sscanf(strings[0].c_str(), "%u %zu", &next, &n) != 2 || n > FS_READDIR_CHUNK) {
+            return;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            if (!parse_dirent(strings[i + 1], attrs, &entries[i])) {
+                return;
+            }
+        }
+        *cookie = next;
+        *count = n;
+        *ok = true;
+    };
+    op->done = [ok, done = std::move(done)](int result) { done(result == 0 && *ok ? 0 : -1); };
+    submit(std::move(op));
+}
+
+void fs_readhandle_async(const char* username, const fs_handle* handle, unsigned int offset, void* buf,
+                         fs_callback done) {
+    const char* id = handle_id(handle);
+    if (!valid_user(username) || !id || !buf || offset >= FS_MAXFILEBLOCKS) {
+        done(-1);
+        return;
+    }
+    submit(make_op(std::string("FS_READHANDLE ") + username + " " + id + " " + std::to_string(offset),
+                   nullptr, buf, std::move(done)));
+}
+
+void fs_writehandle_async(const char* username, const fs_handle* handle, unsigned int offset, const void* buf,
+                          fs_callback done) {
+    const char* id = handle_id(handle);
+    if (!valid_user(username) || !id || !buf || offset >= FS_MAXFILEBLOCKS) {
+        done(-1);
+        return;
+    }
+    bool in_file = false;
+    if (cache.enabled()) {
+        // handles start with the inode block
+        uint32_t inode = static_cast<uint32_t>(strtoul(id, nullptr, 10));
+        in_file = cache.holds_inode(inode, offset);
+        cache.invalidate_inode(inode);
+    }
+    auto op = make_op(std::string("FS_WRITEHANDLE ") + username + " " + id + " " + std::to_string(offset),
+                      buf, nullptr, std::move(done));
+    op->retry_safe = in_file;
+    submit(std::move(op));
+}
+
+std::future<int> fs_readblock_async(const char* username, const char* pathname, unsigned int offset, void* buf) {
+    return as_future([&](fs_callback done) { fs_readblock_async(username, pathname, offset, buf, std::move(done)); });
+}
+
+std::future<int> fs_writeblock_async(const char* username, const char* pathname, unsigned int offset,
+                                     const void* buf) {
+    return as_future([&](fs_callback done) { fs_writeblock_async(username, pathname, offset, buf, std::move(done)); });
+}
+
+std::future<int> fs_create_async(const char* username, const char* pathname, char type) {
+    return as_future([&](fs_callback done) { fs_create_async(username, pathname, type, std::move(done)); });
+}
+
+std::future<int> fs_delete_async(const char* username, const char* pathname) {
+    return as_future([&](fs_callback done) { fs_delete_async(username, pathname, std::move(done)); });
+}
+
+std::future<int> fs_create_batch_async(const char* username, const char* dirname, const char* const* names,
+                                       const char* types, size_t count, int* results) {
+    return as_future([&](fs_callback done) {
+        fs_create_batch_async(username, dirname, names, types, count, results, std::move(done));
+    });
+}
+
+std::future<int> fs_copy_async(const char* username, const char* source, const char* target) {
+    return as_future([&](fs_callback done) { fs_copy_async(username, source, target, std::move(done)); });
+}
+
+std::future<int> fs_delete_tree_async(const char* username, const char* pathname) {
+    return as_future([&](fs_callback done) { fs_delete_tree_async(username, pathname, std::move(done)); });
+}
+
+std::future<int> fs_snapshot_async(const char* username, const char* name) {
+    return as_future([&](fs_callback done) { fs_snapshot_async(username, name, std::move(done)); });
+}
+
+std::future<int> fs_snapshot_delete_async(const char* username, const char* name) {
+    return as_future([&](fs_callback done) { fs_snapshot_delete_async(username, name, std::move(done)); });
+}
+
+std::future<int> fs_open_async(const char* username, const char* pathname, fs_handle* handle) {
+    return as_future([&](fs_callback done) { fs_open_async(username, pathname, handle, std::move(done)); });
+}
+
+std::future<int> fs_stat_async(const char* username, const char* pathname, fs_stat_info* info) {
+    return as_future([&](fs_callback done) { fs_stat_async(username, pathname, info, std::move(done)); });
+}
+
+std::future<int> fs_statmany_async(const char* username, const char* const* pathnames, size_t count,
+                                   fs_stat_info* infos, int* results) {
+    return as_future([&](fs_callback done) {
+        fs_statmany_async(username, pathnames, count, infos, results, std::move(done));
+    });
+}
+
+std::future<int> fs_readdir_async(const char* username, const char* pathname, unsigned int* cookie,
+                                  bool attrs, fs_dirent* entries, size_t* count) {
+    return as_future([&](fs_callback done) {
+        fs_readdir_async(username, pathname, cookie, attrs, entries, count, std::move(done));
+    });
+}
+
+std::future<int> fs_readhandle_async(const char* username, const fs_handle* handle, unsigned int offset,
+                                     void* buf) {
+    return as_future([&](fs_callback done) { fs_readhandle_async(username, handle, offset, buf, std::move(done)); });
+}
+
+std::future<int> fs_writehandle_async(const char* username, const fs_handle* handle, unsigned int offset,
+                                      const void* buf) {
+    return as_future([&](fs_callback done) {
+        fs_writehandle_async(username, handle, offset, buf, std::move(done));
+    });
+}
+
+int fs_readblock(const char* username, const char* pathname, unsigned int offset, void* buf) {
+    return fs_readblock_async(username, pathname, offset, buf).get();
+}
+
+int fs_writeblock(const char* username, const char* pathname, unsigned int offset, const void* buf) {
+    return fs_writeblock_async(username, pathname, offset, buf).get();
+}
+
+int fs_create(const char* username, const char* pathname, char type) {
+    return fs_create_async(username, pathname, type).get();
+}
+
+int fs_delete(const char* username, const char* pathname) {
+    return fs_delete_async(username, pathname).get();
+}
+
+int fs_create_batch(const char* username, const char* dirname, const char* const* names, const char* types,
+                    size_t count, int* results) {
+    return fs_create_batch_async(username, dirname, names, types, count, results).get();
+}
+
+int fs_copy(const char* username, const char* source, const char* target) {
+    return fs_copy_async(username, source, target).get();
+}
+
+int fs_delete_tree(const char* username, const char* pathname) {
+    return fs_delete_tree_async(username, pathname).get();
+}
+
+int fs_snapshot(const char* username, const char* name) {
+    return fs_snapshot_async(username, name).get();
+}
+
+int fs_snapshot_delete(const char* username, const char* name) {
+    return fs_snapshot_delete_async(username, name).get();
+}
+
+int fs_open(const char* username, const char* pathname, fs_handle* handle) {
+    return fs_open_async(username, pathname, handle).get();
+}
+
+int fs_readhandle(const char* username, const fs_handle* handle, unsigned int offset, void* buf) {
+    return fs_readhandle_async(username, handle, offset, buf).get();
+}
+
+int fs_writehandle(const char* username, const fs_handle* handle, unsigned int offset, const void* buf) {
+    return fs_writehandle_async(username, handle, offset, buf).get();
+}
+
+int fs_stat(const char* username, const char* pathname, fs_stat_info* info) {
+    return fs_stat_async(username, pathname, info).get();
+}
+
+int fs_statmany(const char* username, const char* const* pathnames, size_t count, fs_stat_info* infos,
+                int* results) {
+    return fs_statmany_async(username, pathnames, count, infos, results).get();
+}
+
+int fs_readdir(const char* username, const char* pathname, unsigned int* cookie, bool attrs,
+               fs_dirent* entries, size_t* count) {
+    return fs_readdir_async(username, pathname, cookie, attrs, entries, count).get();
+}
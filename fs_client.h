@@ -21,6 +21,11 @@
 #include <sys/types.h>
 #include <netinet/in.h>
 
+#include <atomic>
+#include <coroutine>
+#include <functional>
+#include <future>
+
 #include "fs_param.h"
 
 /*
@@ -83,6 +88,40 @@ int fs_writeblock(const char* username, const char* pathname,
  */
 int fs_create(const char* username, const char* pathname, char type);
 
+/*
+ * fs_create for count entries of the existing directory "dirname" (which may
+ * be "/"): names[i] is a name, not a path, and types[i] its type.  The
+ * directory is scanned and its blocks written once for the whole batch.
+ * results[i] is 0 if names[i] was created and -1 if it failed like fs_create
+ * would (or repeats an earlier name).  count may be up to FS_MAXCREATEBATCH.
+ *
+ * fs_create_batch returns 0 if the request was answered (whatever the
+ * results), -1 on failure.  Possible failures include:
+ *     dirname is invalid, does not exist or is not a directory
+ *     dirname is not owned by username or the root
+ *     username is invalid
+ *
+ * fs_create_batch is thread safe.
+ */
+int fs_create_batch(const char* username, const char* dirname, const char* const* names, const char* types,
+                    size_t count, int* results);
+
+/*
+ * Create the file "target" as a copy of the existing file "source".  The
+ * data is copied inside the server.  It is the data of source at one point
+ * in time, even while other clients write to it.
+ *
+ * fs_copy returns 0 on success, -1 on failure.  Possible failures include:
+ *     source or target is invalid
+ *     source does not exist, is not a file, or is not owned by username
+ *     target could not be created, as with fs_create
+ *     the disk is full
+ *     username is invalid
+ *
+ * fs_copy is thread safe.
+ */
+int fs_copy(const char* username, const char* source, const char* target);
+
 /*
  * Delete the existing file or directory "pathname".
  *
@@ -96,3 +135,261 @@ int fs_create(const char* username, const char* pathname, char type);
  * fs_delete is thread safe.
  */
 int fs_delete(const char* username, const char* pathname);
+
+/*
+ * Delete the file or directory "pathname" and everything under it, in one
+ * request.  Either all of it is deleted or, on failure, none of it.
+ *
+ * fs_delete_tree returns 0 on success, -1 on failure.  Possible failures
+ * include those of fs_delete, except that directories need not be empty, and:
+ *     a file or directory under pathname is not owned by username
+ *
+ * fs_delete_tree is thread safe.
+ */
+int fs_delete_tree(const char* username, const char* pathname);
+
+/*
+ * Take a snapshot of the whole file system called "name", which then reads
+ * as it is now under "/.snapshots/name" (fs_readblock, fs_stat and
+ * fs_readdir, with the usual ownership checks) while writes go on.  Only
+ * username can delete it with fs_snapshot_delete.  Snapshots are kept until
+ * deleted or until the server restarts.
+ *
+ * fs_snapshot and fs_snapshot_delete return 0 on success, -1 on failure.
+ * Possible failures are:
+ *     name is empty, too long, or contains '/' or ' '
+ *     fs_snapshot: a snapshot called name exists, or FS_MAXSNAPSHOTS do
+ *     fs_snapshot_delete: username has no snapshot called name
+ *     username is invalid
+ *
+ * fs_snapshot and fs_snapshot_delete are thread safe.
+ */
+int fs_snapshot(const char* username, const char* name);
+int fs_snapshot_delete(const char* username, const char* name);
+
+/*
+ * An open file, from fs_open.  Opaque; copy it freely.
+ */
+struct fs_handle {
+    char id[FS_MAXHANDLE + 1];
+};
+
+/*
+ * Open the existing file "pathname" for fs_readhandle and fs_writehandle,
+ * which skip resolving the path again.  The path and the file's ownership are
+ * checked here; the handle then works until the file is deleted (or the
+ * server restarts), even if a directory on the path is deleted or changes
+ * owner in the meantime.
+ *
+ * fs_open returns 0 on success, -1 on failure.  Possible failures include:
+ *     pathname is invalid
+ *     pathname does not exist, is not a file, or is not owned by username
+ *     username is invalid
+ *
+ * fs_open is thread safe.
+ */
+int fs_open(const char* username, const char* pathname, fs_handle* handle);
+
+/*
+ * fs_readblock and fs_writeblock for an open file.  They fail like those
+ * do, and also if the file was deleted since it was opened.  Reads by handle
+ * bypass the client cache.
+ *
+ * fs_readhandle and fs_writehandle are thread safe.
+ */
+int fs_readhandle(const char* username, const fs_handle* handle, unsigned int offset, void* buf);
+int fs_writehandle(const char* username, const fs_handle* handle, unsigned int offset, const void* buf);
+
+/*
+ * What fs_stat reports about a file or directory
+ */
+struct fs_stat_info {
+    char type;                              // 'f' or 'd'
+    unsigned int size;                      // blocks in a file, directory entry blocks in a directory
+    char owner[FS_MAXUSERNAME + 1];         // empty for the root directory
+};
+
+/*
+ * Look up the type, size and owner of "pathname" without reading it.
+ * pathname may be "/".
+ *
+ * fs_stat returns 0 on success, -1 on failure.  Possible failures include:
+ *     pathname is invalid
+ *     pathname does not exist
+ *     pathname or a directory on the way is not owned by username (or, for
+ *         directories, by the root)
+ *     username is invalid
+ *
+ * fs_stat is thread safe.
+ */
+int fs_stat(const char* username, const char* pathname, fs_stat_info* info);
+
+/*
+ * fs_stat for count paths in one request, which walks shared path prefixes
+ * once.  results[i] is 0 if infos[i] was filled in and -1 if pathnames[i]
+ * failed like fs_stat would.  count may be up to FS_MAXSTATMANY.
+ *
+ * fs_statmany returns 0 if the request was answered (whatever the results),
+ * -1 on failure.
+ *
+ * fs_statmany is thread safe.
+ */
+int fs_statmany(const char* username, const char* const* pathnames, size_t count,
+                fs_stat_info* infos, int* results);
+
+/*
+ * One entry of a directory listing, from fs_readdir
+ */
+struct fs_dirent {
+    char name[FS_MAXFILENAME + 1];
+    char type;                              // 'f' or 'd' with attrs, else 0; '-' if not owned by username
+    unsigned int size;                      // as in fs_stat_info, with attrs
+};
+
+/*
+ * List the directory "pathname" (which may be "/"), up to FS_READDIR_CHUNK
+ * entries at a time.  Start with *cookie = 0; each call fills in entries,
+ * sets *count and advances *cookie, which is 0 again once the listing is
+ * done.  With attrs, each entry's type and size are filled in as well, except
+ * for children owned by another user, whose type is '-'.
+ *
+ * The directory is only locked while one chunk is listed, so entries created
+ * or deleted during a listing may or may not show up in it (and a delete that
+ * empties a block of directory entries may make it skip or repeat some).
+ *
+ * fs_readdir returns 0 on success, -1 on failure.  Possible failures include:
+ *     pathname is invalid
+ *     pathname does not exist or is not a directory
+ *     pathname or a directory on the way is not owned by username or the root
+ *     username is invalid
+ *
+ * fs_readdir is thread safe.
+ */
+int fs_readdir(const char* username, const char* pathname, unsigned int* cookie, bool attrs,
+               fs_dirent* entries, size_t* count);
+
+/*
+ * Turn on the client cache of file blocks and path -> inode resolutions,
+ * holding up to max_blocks blocks (0 turns it off, the default).
+ *
+ * Reads then ask the server for a read lease on the file and serve repeated
+ * reads from the cache until it expires.  A write to or delete of the file
+ * waits on the server until every lease on it has expired, so a read never
+ * returns data older than the last completed write.
+ *
+ * fs_clientcache returns 0 on success, -1 on failure.
+ */
+int fs_clientcache(size_t max_blocks);
+
+/*
+ * Asynchronous API
+ *
+ * Each call below queues its request and returns at once.  Requests from all
+ * threads share a few persistent connections with many requests in flight on
+ * each, and requests issued close together go out in a single send.  Results
+ * are the same 0 / -1 as the blocking calls, which are wrappers over these.
+ *
+ * buf (and handle, info, infos, results, cookie, entries and count for the calls filling them in)
+ * must stay valid until the request completes; the data passed to fs_writeblock_async and fs_writehandle_async
+ * and the handle passed to the handle calls are copied before they return.  Requests in flight at the
+ * same time may execute in any order.
+ *
+ * The callback variants call done(result) on whichever client thread
+ * completes the request, usually an internal receiver thread but possibly the
+ * calling thread before the call returns.  done must not wait for other
+ * client requests.
+ */
+using fs_callback = std::function<void(int)>;
+
+std::future<int> fs_readblock_async(const char* username, const char* pathname,
+                                    unsigned int offset, void* buf);
+void fs_readblock_async(const char* username, const char* pathname,
+                        unsigned int offset, void* buf, fs_callback done);
+
+std::future<int> fs_writeblock_async(const char* username, const char* pathname,
+                                     unsigned int offset, const void* buf);
+void fs_writeblock_async(const char* username, const char* pathname,
+                         unsigned int offset, const void* buf, fs_callback done);
+
+std::future<int> fs_create_async(const char* username, const char* pathname, char type);
+void fs_create_async(const char* username, const char* pathname, char type, fs_callback done);
+
+std::future<int> fs_create_batch_async(const char* username, const char* dirname, const char* const* names,
+                                       const char* types, size_t count, int* results);
+void fs_create_batch_async(const char* username, const char* dirname, const char* const* names,
+                           const char* types, size_t count, int* results, fs_callback done);
+
+std::future<int> fs_copy_async(const char* username, const char* source, const char* target);
+void fs_copy_async(const char* username, const char* source, const char* target, fs_callback done);
+
+std::future<int> fs_delete_async(const char* username, const char* pathname);
+void fs_delete_async(const char* username, const char* pathname, fs_callback done);
+
+std::future<int> fs_delete_tree_async(const char* username, const char* pathname);
+void fs_delete_tree_async(const char* username, const char* pathname, fs_callback done);
+
+std::future<int> fs_snapshot_async(const char* username, const char* name);
+void fs_snapshot_async(const char* username, const char* name, fs_callback done);
+
+std::future<int> fs_snapshot_delete_async(const char* username, const char* name);
+void fs_snapshot_delete_async(const char* username, const char* name, fs_callback done);
+
+std::future<int> fs_open_async(const char* username, const char* pathname, fs_handle* handle);
+void fs_open_async(const char* username, const char* pathname, fs_handle* handle, fs_callback done);
+
+std::future<int> fs_stat_async(const char* username, const char* pathname, fs_stat_info* info);
+void fs_stat_async(const char* username, const char* pathname, fs_stat_info* info, fs_callback done);
+
+std::future<int> fs_statmany_async(const char* username, const char* const* pathnames, size_t count,
+                                   fs_stat_info* infos, int* results);
+void fs_statmany_async(const char* username, const char* const* pathnames, size_t count,
+                       fs_stat_info* infos, int* results, fs_callback done);
+
+std::future<int> fs_readdir_async(const char* username, const char* pathname, unsigned int* cookie,
+                                  bool attrs, fs_dirent* entries, size_t* count);
+void fs_readdir_async(const char* username, const char* pathname, unsigned int* cookie, bool attrs,
+                      fs_dirent* entries, size_t* count, fs_callback done);
+
+std::future<int> fs_readhandle_async(const char* username, const fs_handle* handle,
+                                     unsigned int offset, void* buf);
+void fs_readhandle_async(const char* username, const fs_handle* handle,
+                         unsigned int offset, void* buf, fs_callback done);
+
+std::future<int> fs_writehandle_async(const char* username, const fs_handle* handle,
+                                      unsigned int offset, const void* buf);
+void fs_writehandle_async(const char* username, const fs_handle* handle,
+                          unsigned int offset, const void* buf, fs_callback done);
+
+/*
+ * Awaitable over any callback variant, for C++20 coroutines:
+ *
+ *     int r = co_await fs_awaitable([&](fs_callback done) {
+ *         fs_readblock_async("user", "/file", 0, buf, std::move(done));
+ *     });
+ *
+ * The coroutine resumes on the receiver thread that completed the request.
+ */
+class fs_awaitable {
+public:
+    explicit fs_awaitable(std::function<void(fs_callback)> start) : start_(std::move(start)) {}
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> h) {
+        start_([this, h](int result) {
+            result_ = result;
+            // whichever of the callback and await_suspend comes second resumes
+            if (done_.exchange(true)) {
+                h.resume();
+            }
+        });
+        return !done_.exchange(true);
+    }
+
+    int await_resume() const noexcept { return result_; }
+
+private:
+    std::function<void(fs_callback)> start_;
+    int result_ = -1;
+    std::atomic<bool> done_{false};
+};
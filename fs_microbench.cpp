@@ -0,0 +1,736 @@
+/***************************************************************************************************
+ *                                          fs_microbench                                          *
+ ***************************************************************************************************/
+/*
+ * Microbenchmarks for the server internals.
+ *
+ * Runs parse_request, split_path_ss, the directory scans (and the page scan
+ * kernel against the per-slot loop it replaced), the free block allocator,
+ * the inode lock table, path_find_impl (alone and under thread contention)
+ * and a whole FS_READBLOCK (through execute_request, and over a loopback
+ * FS_SESSION to a server started in the process) against synthetic trees on
+ * an in-memory disk, and reports ns/op and heap allocations/op as JSON.  This binary provides its
+ * own disk, so it is linked without libfs_server.o.  Add -mavx2 to measure
+ * the AVX2 scan kernel.
+ *
+ * FS_DELETE_TREE is also run against writers in the tree being deleted; the
+ * run exits with 1 if that deadlocks.
+ *
+ * With --check-allocs it exits with 1 if a benchmark of the request hot path
+ * (see ZERO_ALLOC_BENCHES) allocated from the heap.
+ *
+ * Build:
+ *     g++ -std=c++20 -O2 -o fs_microbench fs_microbench.cpp network.cpp request.cpp metrics.cpp lock_profiler.cpp tracer.cpp lease_table.cpp scheduler.cpp admission.cpp dedup.cpp replication.cpp snapshot.cpp defrag.cpp \
+ *         -lboost_thread -lboost_regex -pthread
+ *
+ * Example:
+ *     ./fs_microbench --iters 200000 --threads 8 --filter path_find
+ *     ./fs_microbench --check-allocs
+ */
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <new>
+#include <set>
+#include <stdexcept>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <boost/thread.hpp>
+
+#include "fs_server.h"
+#include "arena.hpp"
+#include "dir_scan.hpp"
+#include "network.hpp"
+#include "request.hpp"
+
+/***************************************************************************************************
+ *                                        In-memory disk                                           *
+ ***************************************************************************************************/
+
+static char mem_disk[FS_DISKSIZE][FS_BLOCKSIZE];
+
+void disk_readblock(unsigned int block, void* buf) {
+    std::memcpy(buf, mem_disk[block], FS_BLOCKSIZE);
+}
+
+void disk_writeblock(unsigned int block, const void* buf) {
+    std::memcpy(mem_disk[block], buf, FS_BLOCKSIZE);
+}
+
+// the port of the server the session benchmark starts
+static std::atomic<unsigned int> server_port{0};
+
+void print_port(unsigned int port_number) {
+    server_port = port_number;
+}
+
+boost::mutex* cout_lock_func() {
+    static boost::mutex m;
+    return &m;
+}
+
+/***************************************************************************************************
+ *                                       Allocation counting                                       *
+ ***************************************************************************************************/
+
+// per thread so the contended benchmarks only count their own thread's allocations
+static thread_local unsigned long alloc_count = 0;
+
+// every thread's, while counting_all_threads is set, for benchmarks that go through the server's threads
+static std::atomic<bool> counting_all_threads{false};
+static std::atomic<unsigned long> all_threads_alloc_count{0};
+
+static void count_alloc() {
+    ++alloc_count;
+    if (counting_all_threads.load(std::memory_order_relaxed)) {
+        all_threads_alloc_count.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(size_t size) {
+    count_alloc();
+    if (void* p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+// std::pmr::new_delete_resource() allocates through these
+void* operator new(size_t size, std::align_val_t align) {
+    count_alloc();
+    size_t a = static_cast<size_t>(align);
+    if (void* p = std::aligned_alloc(a, (std::max<size_t>(size, 1) + a - 1) / a * a)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size, std::align_val_t align) {
+    return operator new(size, align);
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+void operator delete[](void* p, size_t) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, size_t, std::align_val_t) noexcept { std::free(p); }
+
+/***************************************************************************************************
+ *                                            Fixtures                                             *
+ ***************************************************************************************************/
+
+static const char* const BENCH_USER = "bench";
+
+/*
+ * Writes synthetic trees straight onto the in-memory disk.  Blocks are handed
+ * out sequentially, sys_init() then rebuilds the free list from the result.
+ */
+class tree_builder {
+public:
+    tree_builder() {
+        std::memset(mem_disk, 0, sizeof(mem_disk));
+        fs_inode root{};
+        root.type = 'd';
+        disk_writeblock(0, &root);
+    }
+
+    // adds "count" entries named <prefix><i> of the given type under dir_block
+    void fill_dir(uint32_t dir_block, const std::string &prefix, unsigned int count, char type,
+                  std::vector<uint32_t>* children = nullptr) {
+        fs_inode dir;
+        disk_readblock(dir_block, &dir);
+        for (unsigned int i = 0; i < count; ++i) {
+            fs_direntry entries[FS_DIRENTRIES]{};
+            if (i % FS_DIRENTRIES == 0) {
+                if (dir.size >= FS_MAXFILEBLOCKS) {
+                    throw std::runtime_error("directory fixture too large");
+                }
+                dir.blocks[dir.size++] = next_block++;
+            } else {
+                disk_readblock(dir.blocks[dir.size - 1], entries);
+            }
+            uint32_t child = next_block++;
+            fs_inode inode{};
+            inode.type = type;
+            std::strncpy(inode.owner, BENCH_USER, FS_MAXUSERNAME);
+            disk_writeblock(child, &inode);
+
+            fs_direntry &de = entries[i % FS_DIRENTRIES];
+            std::strncpy(de.name, (prefix + std::to_string(i)).c_str(), FS_MAXFILENAME);
+            de.inode_block = child;
+            disk_writeblock(dir.blocks[dir.size - 1], entries);
+            if (children) {
+                children->push_back(child);
+            }
+        }
+        disk_writeblock(dir_block, &dir);
+        if (next_block >= FS_DISKSIZE) {
+            throw std::runtime_error("fixture does not fit on the disk");
+        }
+    }
+
+    // a chain /d0/d1/.../d<depth-1> with "width" siblings at every level, returns the deepest dir
+    uint32_t chain(unsigned int depth, unsigned int width) {
+        uint32_t dir = 0;
+        for (unsigned int level = 0; level < depth; ++level) {
+            std::vector<uint32_t> kids;
+            fill_dir(dir, "d", width, 'd', &kids);
+            dir = kids.back();
+        }
+        return dir;
+    }
+
+private:
+    uint32_t next_block = 1;
+};
+
+static std::string chain_path(unsigned int depth, unsigned int width, const std::string &leaf) {
+    std::string p;
+    for (unsigned int level = 0; level < depth; ++level) {
+        p += "/d" + std::to_string(width - 1);
+    }
+    return p + "/" + leaf;
+}
+
+/***************************************************************************************************
+ *                                             Harness                                             *
+ ***************************************************************************************************/
+
+struct bench_options {
+    unsigned long iters = 100000;
+    unsigned int threads = 4;
+    std::string filter;
+    bool check_allocs = false;
+};
+
+// single threaded benchmarks of what a steady FS_READBLOCK does, which must not touch the heap
+static const std::set<std::string> ZERO_ALLOC_BENCHES = {
+    "parse_request/read/arena",
+    "split_path_ss/depth5/arena",
+    "get_inode_mutex_sp/expired_entry",
+    "path_find_impl/shared/depth6",
+    "execute_request/FS_READBLOCK/depth6",
+    "session/FS_READBLOCK/depth6/pipelined",
+};
+
+struct bench_result {
+    std::string name;
+    unsigned int threads;
+    unsigned long ops;
+    double ns_per_op;
+    double allocs_per_op;
+};
+
+static std::vector<bench_result> results;
+
+// keeps the compiler from dropping a benchmarked computation whose result is unused
+template <typename T>
+static void benchmark_keep(const T &value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+#if defined(__AVX2__)
+#define DIR_SCAN_ISA "avx2"
+#elif defined(__SSE2__)
+#define DIR_SCAN_ISA "sse2"
+#else
+#define DIR_SCAN_ISA "scalar"
+#endif
+
+/*
+ * Runs op "iters" times per thread on "threads" threads.  prepare(i) runs
+ * untimed in front of every batch of BATCH ops so that per-op inputs (e.g. the
+ * path deque path_find consumes) do not show up in the numbers.  With
+ * all_threads the allocations of every thread in the process are counted, not
+ * only the benchmark threads' (so use it with a single benchmark thread).
+ */
+static constexpr unsigned long BATCH = 256;
+
+static void run_bench(const bench_options &opts, const std::string &name, unsigned int threads,
+                      const std::function<void(unsigned int, unsigned long)> &prepare,
+                      const std::function<void(unsigned int, unsigned long)> &op, bool all_threads = false) {
+    if (!opts.filter.empty() && name.find(opts.filter) == std::string::npos) {
+        return;
+    }
+    counting_all_threads = all_threads;
+    std::atomic<long long> total_ns{0};
+    std::atomic<unsigned long> total_allocs{0};
+    boost::barrier start(threads);
+
+    auto worker = [&](unsigned int t) {
+        start.wait();
+        long long ns = 0;
+        unsigned long allocs = 0;
+        for (unsigned long done = 0; done < opts.iters; done += BATCH) {
+            unsigned long n = std::min(BATCH, opts.iters - done);
+            if (prepare) {
+                for (unsigned long i = 0; i < n; ++i) {
+                    prepare(t, i);
+                }
+            }
+            unsigned long a0 = all_threads ? all_threads_alloc_count.load() : alloc_count;
+            auto t0 = std::chrono::steady_clock::now();
+            for (unsigned long i = 0; i < n; ++i) {
+                op(t, i);
+            }
+            ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count();
+            allocs += (all_threads ? all_threads_alloc_count.load() : alloc_count) - a0;
+        }
+        total_ns += ns;
+        total_allocs += allocs;
+    };
+
+    boost::thread_group group;
+    for (unsigned int t = 1; t < threads; ++t) {
+        group.create_thread([&, t]() { worker(t); });
+    }
+    worker(0);
+    group.join_all();
+    counting_all_threads = false;
+
+    unsigned long ops = opts.iters * threads;
+    results.push_back({name, threads, ops, static_cast<double>(total_ns) / ops,
+                       static_cast<double>(total_allocs) / ops});
+}
+
+/***************************************************************************************************
+ *                                        Loopback session                                         *
+ ***************************************************************************************************/
+
+static void send_exact(int sock, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(sock, buf, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            throw std::runtime_error("session send() failed");
+        }
+        buf += n;
+        len -= static_cast<size_t>(n);
+    }
+}
+
+static void recv_exact(int sock, char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = recv(sock, buf, len, 0);
+        if (n <= 0) {
+            throw std::runtime_error("session recv() failed or timed out");
+        }
+        buf += n;
+        len -= static_cast<size_t>(n);
+    }
+}
+
+/*
+ * Connects to the server on port and starts an FS_SESSION.  A reply that
+ * does not come within a few seconds (e.g. an FS_ERROR shorter than the
+ * expected reply) fails the benchmark instead of hanging it.
+ */
+static int open_session(unsigned int port) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(static_cast<uint16_t>(port));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (sock < 0 || connect(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        throw std::runtime_error("cannot connect to the benchmark server");
+    }
+    int yesval = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &yesval, sizeof(yesval));
+    timeval timeout{5, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    static const char session[] = "FS_SESSION";
+    send_exact(sock, session, sizeof(session));
+    char reply[sizeof(session)];
+    recv_exact(sock, reply, sizeof(reply));
+    if (std::memcmp(reply, session, sizeof(session)) != 0) {
+        throw std::runtime_error("FS_SESSION refused");
+    }
+    return sock;
+}
+
+/*
+ * Friend of Network so the benchmarks can reach the private internals.
+ */
+struct network_microbench {
+    static void run(const bench_options &opts) {
+        Network net(server_config{});
+
+        /*
+         * Request parsing
+         */
+        {
+            std::string header = "FS_READBLOCK bench /d3/d3/d3/file7 12";
+            run_bench(opts, "parse_request/read", 1, nullptr, [&](unsigned int, unsigned long) {
+                request r;
+                parse_request(header, r);
+            });
+            // as the server does it, in a connection's arena
+            request_arena arena;
+            run_bench(opts, "parse_request/read/arena", 1, nullptr, [&](unsigned int, unsigned long) {
+                arena.reset();
+                request r(arena.get());
+                parse_request(header, r);
+            });
+            std::string path = "/dir0/dir1/dir2/dir3/file";
+            run_bench(opts, "split_path_ss/depth5", 1, nullptr, [&](unsigned int, unsigned long) {
+                auto d = split_path_ss(path);
+                (void)d;
+            });
+            run_bench(opts, "split_path_ss/depth5/arena", 1, nullptr, [&](unsigned int, unsigned long) {
+                arena.reset();
+                auto d = split_path_ss(path, arena.get());
+                (void)d;
+            });
+        }
+
+        /*
+         * Directory scans over a single directory with 512 entries, target in the last page
+         */
+        {
+            tree_builder tree;
+            tree.fill_dir(0, "file", 512, 'f');
+            net.sys_init();
+            fs_inode root;
+            net.read_inode_block(0, root);
+            std::string last = "file511";
+            std::string missing = "nosuchfile";
+
+            run_bench(opts, "find_child/512_entries", 1, nullptr, [&](unsigned int, unsigned long) {
+                net.find_child(root, last);
+            });
+            run_bench(opts, "scan_directory_for_create/512_entries", 1, nullptr, [&](unsigned int, unsigned long) {
+                net.scan_directory_for_create(root, missing);
+            });
+            run_bench(opts, "scan_directory_for_delete/512_entries", 1, nullptr, [&](unsigned int, unsigned long) {
+                net.scan_directory_for_delete(root, last);
+            });
+
+            /*
+             * The page kernel alone against the per-slot std::string loop it replaced,
+             * over the directory's 64 pages already in memory
+             */
+            const fs_direntry* pages[FS_MAXFILEBLOCKS];
+            for (uint32_t i = 0; i < root.size; ++i) {
+                pages[i] = reinterpret_cast<const fs_direntry*>(mem_disk[root.blocks[i]]);
+            }
+            run_bench(opts, "dir_page_scan/string_loop/512_entries", 1, nullptr, [&](unsigned int, unsigned long) {
+                int found = -1;
+                for (uint32_t i = 0; i < root.size && found == -1; ++i) {
+                    for (size_t j = 0; j < FS_DIRENTRIES; ++j) {
+                        const fs_direntry &de = pages[i][j];
+                        if (de.inode_block == 0) continue;
+                        if (std::string(de.name) == last) {
+                            found = static_cast<int>(de.inode_block);
+                            break;
+                        }
+                    }
+                }
+                benchmark_keep(found);
+            });
+            run_bench(opts, "dir_page_scan/" DIR_SCAN_ISA "/512_entries", 1, nullptr, [&](unsigned int, unsigned long) {
+                int found = -1;
+                dir_scan_key key(last);
+                for (uint32_t i = 0; i < root.size && found == -1; ++i) {
+                    dir_page_scan page = scan_dir_page(pages[i], key);
+                    if (page.match != -1) {
+                        found = static_cast<int>(pages[i][page.match].inode_block);
+                    }
+                }
+                benchmark_keep(found);
+            });
+
+            run_bench(opts, "get_new_block/alloc_free", 1, nullptr, [&](unsigned int, unsigned long) {
+                int b = net.get_new_block();
+                boost::lock_guard<boost::mutex> g(net.free_disk_mutex);
+                net.free_disk_blocks.insert(static_cast<uint32_t>(b));
+            });
+            run_bench(opts, "get_new_block/alloc_free", opts.threads, nullptr, [&](unsigned int, unsigned long) {
+                int b = net.get_new_block();
+                boost::lock_guard<boost::mutex> g(net.free_disk_mutex);
+                net.free_disk_blocks.insert(static_cast<uint32_t>(b));
+            });
+        }
+
+        /*
+         * Inode lock table
+         */
+        {
+            auto held = net.get_inode_mutex_sp(7);
+            run_bench(opts, "get_inode_mutex_sp/live_entry", 1, nullptr, [&](unsigned int, unsigned long) {
+                auto sp = net.get_inode_mutex_sp(7);
+            });
+            // the first lookup of a block adds its table entry
+            for (uint32_t i = 0; i < 64; ++i) {
+                net.get_inode_mutex_sp(100 + i);
+            }
+            run_bench(opts, "get_inode_mutex_sp/expired_entry", 1, nullptr, [&](unsigned int, unsigned long i) {
+                auto sp = net.get_inode_mutex_sp(100 + static_cast<uint32_t>(i % 64));
+            });
+            run_bench(opts, "get_inode_mutex_sp/live_entry", opts.threads, nullptr, [&](unsigned int, unsigned long) {
+                auto sp = net.get_inode_mutex_sp(7);
+            });
+        }
+
+        /*
+         * FS_DELETE_TREE of a small tree while the other threads write and create in it, which used to
+         * deadlock the server.  A watchdog fails the run if no request finishes for DEADLOCK_SECONDS.
+         */
+        if (opts.filter.empty() || std::string("execute_request/FS_DELETE_TREE/vs_writers").find(opts.filter) !=
+                                       std::string::npos) {
+            constexpr int DEADLOCK_SECONDS = 5;
+            tree_builder tree;
+            net.sys_init();
+
+            std::string user = BENCH_USER;
+            const std::vector<std::string> rebuild = {
+                "FS_CREATE " + user + " /t d", "FS_CREATE " + user + " /t/f f",
+                "FS_CREATE " + user + " /t/s d", "FS_CREATE " + user + " /t/s/g f",
+            };
+            const std::vector<std::string> writes = {
+                "FS_WRITEBLOCK " + user + " /t/f 0", "FS_WRITEBLOCK " + user + " /t/s/g 0",
+                "FS_CREATE " + user + " /t/s/h f",
+            };
+            std::string delete_tree = "FS_DELETE_TREE " + user + " /t";
+            std::atomic<unsigned long> finished{0};
+            auto execute = [&](const std::string &header) {
+                request r;
+                std::string response;
+                parse_request(header, r);
+                std::memset(r.buf, 'w', FS_BLOCKSIZE);
+                benchmark_keep(net.execute_request(r, response));
+                finished.fetch_add(1, std::memory_order_relaxed);
+            };
+            // thread 0 rebuilds and deletes the tree, the others write into it, most of them failing
+            auto race = [&](unsigned int t, unsigned long i) {
+                if (t == 0) {
+                    for (const std::string &header : rebuild) {
+                        execute(header);
+                    }
+                    execute(delete_tree);
+                } else {
+                    execute(writes[(t + i) % writes.size()]);
+                }
+            };
+
+            std::atomic<bool> done{false};
+            boost::thread watchdog([&]() {
+                unsigned long seen = finished;
+                int idle = 0;
+                while (!done) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                    unsigned long now = finished;
+                    idle = now == seen ? idle + 1 : 0;
+                    seen = now;
+                    if (idle == DEADLOCK_SECONDS * 10) {
+                        std::cerr << "execute_request/FS_DELETE_TREE/vs_writers: no request finished for "
+                                  << DEADLOCK_SECONDS << " s, deadlocked\n";
+                        std::_Exit(1);
+                    }
+                }
+            });
+            bench_options race_opts = opts;
+            race_opts.iters = std::min(opts.iters, 10000UL);
+            run_bench(race_opts, "execute_request/FS_DELETE_TREE/vs_writers", std::max(opts.threads, 2U), nullptr,
+                      race);
+            done = true;
+            watchdog.join();
+        }
+
+        /*
+         * Path resolution: depth 6, 32 siblings per level, 64 files in the leaf
+         */
+        {
+            const unsigned int depth = 6, width = 32;
+            tree_builder tree;
+            uint32_t leaf = tree.chain(depth, width);
+            tree.fill_dir(leaf, "file", 64, 'f');
+            net.sys_init();
+
+            std::string user = BENCH_USER;
+            std::vector<std::string> targets;
+            for (unsigned int t = 0; t < opts.threads; ++t) {
+                targets.push_back(chain_path(depth, width, "file" + std::to_string(t % 64)));
+            }
+            std::string shared_target = chain_path(depth, width, "file63");
+            std::vector<std::vector<path_t>> paths(opts.threads, std::vector<path_t>(BATCH));
+
+            auto prep_shared = [&](unsigned int t, unsigned long i) { paths[t][i] = split_path_ss(shared_target); };
+            auto prep_private = [&](unsigned int t, unsigned long i) { paths[t][i] = split_path_ss(targets[t]); };
+            auto find_shared = [&](unsigned int t, unsigned long i) {
+                Network::path_find_info<shared_lock> info;
+                net.path_find(paths[t][i], user, &info);
+            };
+            auto find_upgrade = [&](unsigned int t, unsigned long i) {
+                Network::path_find_info<upgrade_lock> info;
+                net.path_find_upgrade(paths[t][i], user, &info);
+            };
+
+            // the first walk adds the tree's inodes to the lock table
+            prep_shared(0, 0);
+            find_shared(0, 0);
+            run_bench(opts, "path_find_impl/shared/depth6", 1, prep_shared, find_shared);
+            run_bench(opts, "path_find_impl/shared/depth6/same_file", opts.threads, prep_shared, find_shared);
+            run_bench(opts, "path_find_impl/shared/depth6/distinct_files", opts.threads, prep_private, find_shared);
+            run_bench(opts, "path_find_impl/upgrade/depth6/same_file", opts.threads, prep_shared, find_upgrade);
+            run_bench(opts, "path_find_impl/upgrade/depth6/distinct_files", opts.threads, prep_private, find_upgrade);
+
+            /*
+             * A whole FS_READBLOCK of a block on disk, from the header to the response, per thread
+             * arena and response buffer like a connection's
+             */
+            std::string write_header = "FS_WRITEBLOCK " + user + " " + shared_target + " 0";
+            std::string read_header = "FS_READBLOCK " + user + " " + shared_target + " 0";
+            {
+                request w;
+                std::string response;
+                parse_request(write_header, w);
+                std::memset(w.buf, 'x', FS_BLOCKSIZE);
+                if (!net.execute_request(w, response)) {
+                    throw std::runtime_error("FS_WRITEBLOCK fixture failed");
+                }
+            }
+            std::unique_ptr<request_arena[]> arenas(new request_arena[opts.threads]);
+            std::vector<std::string> responses(opts.threads);
+            auto read_request = [&](unsigned int t, unsigned long) {
+                arenas[t].reset();
+                request r(arenas[t].get());
+                parse_request(read_header, r);
+                responses[t].clear();
+                benchmark_keep(net.execute_request(r, responses[t]));
+            };
+            // grows the response buffers
+            for (unsigned int t = 0; t < opts.threads; ++t) {
+                read_request(t, 0);
+            }
+            run_bench(opts, "execute_request/FS_READBLOCK/depth6", 1, nullptr, read_request);
+            run_bench(opts, "execute_request/FS_READBLOCK/depth6", opts.threads, nullptr, read_request);
+
+            /*
+             * The same read over a loopback FS_SESSION, SESSION_PIPELINE requests in flight, so the
+             * connection coroutine, its receive and send frames, admission, the fair queue and the workers
+             * are measured too.  Allocations are counted on every thread.
+             */
+            if (opts.filter.empty() || std::string("session/FS_READBLOCK/depth6/pipelined").find(opts.filter) !=
+                                           std::string::npos) {
+                constexpr unsigned long SESSION_PIPELINE = 8;
+                server_config session_config;
+                session_config.loops = 1;
+                session_config.workers = 2;
+                // serves until the process exits, so it is never destroyed
+                Network* server = new Network(session_config);
+                boost::thread([server]() { server->start_server(); }).detach();
+                while (server_port == 0) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+                int sock = open_session(server_port);
+
+                std::string framed = read_header;
+                framed.push_back('\0');
+                std::vector<char> reply(framed.size() + FS_BLOCKSIZE);
+                unsigned long in_flight = 0;
+                auto session_read = [&](unsigned int, unsigned long) {
+                    send_exact(sock, framed.data(), framed.size());
+                    if (++in_flight == SESSION_PIPELINE) {
+                        recv_exact(sock, reply.data(), reply.size());
+                        --in_flight;
+                    }
+                };
+                // one request alone first, so a failing read stops here rather than inside the pipeline
+                send_exact(sock, framed.data(), framed.size());
+                recv_exact(sock, reply.data(), framed.size());
+                if (std::memcmp(reply.data(), framed.data(), framed.size()) != 0) {
+                    throw std::runtime_error("session FS_READBLOCK failed");
+                }
+                recv_exact(sock, reply.data(), FS_BLOCKSIZE);
+                // warms the frame caches, the pools and the connection's response buffer
+                for (unsigned long i = 0; i < 4 * BATCH; ++i) {
+                    session_read(0, i);
+                }
+                run_bench(opts, "session/FS_READBLOCK/depth6/pipelined", 1, nullptr, session_read, true);
+                for (; in_flight > 0; --in_flight) {
+                    recv_exact(sock, reply.data(), reply.size());
+                }
+                close(sock);
+            }
+        }
+    }
+};
+
+static void usage() {
+    std::cerr <<
+        "./fs_microbench [options]\n"
+        "  --iters N      iterations per thread (100000)\n"
+        "  --threads N    threads for the contended variants (4)\n"
+        "  --filter STR   only run benchmarks whose name contains STR\n"
+        "  --check-allocs fail if the request hot path allocates from the heap\n";
+}
+
+int main(int argc, char* argv[]) {
+    bench_options opts;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--iters" && i + 1 < argc) {
+            opts.iters = std::stoul(argv[++i]);
+        } else if (arg == "--threads" && i + 1 < argc) {
+            opts.threads = std::stoul(argv[++i]);
+        } else if (arg == "--filter" && i + 1 < argc) {
+            opts.filter = argv[++i];
+        } else if (arg == "--check-allocs") {
+            opts.check_allocs = true;
+        } else {
+            usage();
+            return -1;
+        }
+    }
+    if (opts.iters == 0 || opts.threads == 0) {
+        usage();
+        return -1;
+    }
+
+    network_microbench::run(opts);
+
+    std::cout << "{\n  \"benchmarks\": [\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const bench_result &r = results[i];
+        std::cout << "    {\"name\": \"" << r.name << "\", \"threads\": " << r.threads << ", \"ops\": " << r.ops
+                  << ", \"ns_per_op\": " << r.ns_per_op << ", \"allocs_per_op\": " << r.allocs_per_op << "}"
+                  << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    std::cout << "  ]\n}\n";
+
+    if (opts.check_allocs) {
+        bool clean = true;
+        for (const bench_result &r : results) {
+            if (r.threads == 1 && ZERO_ALLOC_BENCHES.count(r.name) && r.allocs_per_op > 0) {
+                std::cerr << r.name << ": " << r.allocs_per_op << " allocations per op, expected none\n";
+                clean = false;
+            }
+        }
+        return clean ? 0 : 1;
+    }
+    return 0;
+} // main()
@@ -35,3 +35,52 @@ static constexpr unsigned int FS_MAXPATHNAME = 128;
  * Maximum length of a user name, not including the null terminator
  */
 static constexpr unsigned int FS_MAXUSERNAME = 10;
+
+/*
+ * Protocol
+ */
+
+/*
+ * Reply sent on a session connection (one opened with FS_SESSION) when a
+ * request fails.  Connections without a session are closed instead.
+ */
+static constexpr char FS_ERROR_REPLY[] = "FS_ERROR";
+
+/*
+ * Reply sent instead of serving a request when the server is overloaded.
+ * The request had no effect and may be retried.  Connections without a
+ * session are closed after it.
+ */
+static constexpr char FS_BUSY_REPLY[] = "FS_BUSY";
+
+/*
+ * Maximum length of a file handle returned by FS_OPEN, not including the
+ * null terminator
+ */
+static constexpr unsigned int FS_MAXHANDLE = 31;
+
+/*
+ * Maximum number of paths in one FS_STATMANY request
+ */
+static constexpr unsigned int FS_MAXSTATMANY = 1024;
+
+/*
+ * Maximum number of entries in one FS_CREATE_BATCH request
+ */
+static constexpr unsigned int FS_MAXCREATEBATCH = 1024;
+
+/*
+ * Maximum number of directory entries in one FS_READDIR response
+ */
+static constexpr unsigned int FS_READDIR_CHUNK = 128;
+
+/*
+ * Snapshots taken with FS_SNAPSHOT are read under "/.snapshots/<name>".  The
+ * name is reserved in the root directory.
+ */
+static constexpr char FS_SNAPSHOT_DIR[] = ".snapshots";
+
+/*
+ * Maximum number of snapshots kept at once
+ */
+static constexpr unsigned int FS_MAXSNAPSHOTS = 16;
@@ -0,0 +1,61 @@
+#include <algorithm>
+#include <thread>
+
+#include "lease_table.hpp"
+
+/***************************************************************************************************
+ *                                           LeaseTable                                            *
+ ***************************************************************************************************/
+
+/* function docs are in the header file */
+
+// grants between sweeps of expired entries
+static constexpr unsigned int LEASE_SWEEP_INTERVAL = 1024;
+
+std::chrono::milliseconds LeaseTable::grant(uint32_t block) {
+    if (duration.count() == 0) {
+        return duration;
+    }
+    clock::time_point now = clock::now();
+    boost::lock_guard<boost::mutex> g(m);
+    if (++grants_since_sweep >= LEASE_SWEEP_INTERVAL) {
+        grants_since_sweep = 0;
+        std::erase_if(entries, [now](const auto &kv) {
+            return kv.second.recalls == 0 && kv.second.expires <= now;
+        });
+    }
+    entry &e = entries[block];
+    if (e.recalls != 0) {
+        return std::chrono::milliseconds(0);
+    }
+    e.expires = std::max(e.expires, now + duration);
+    return duration;
+}
+
+LeaseTable::recall_guard LeaseTable::recall(uint32_t block) {
+    if (duration.count() == 0) {
+        return recall_guard();
+    }
+    clock::time_point expires;
+    {
+        boost::lock_guard<boost::mutex> g(m);
+        auto it = entries.find(block);
+        if (it == entries.end()) {
+            // never leased, nothing to wait for but grants still have to stop
+            it = entries.emplace(block, entry{}).first;
+        }
+        ++it->second.recalls;
+        expires = it->second.expires;
+    }
+    // no lease can be granted or extended from here on
+    std::this_thread::sleep_until(expires);
+    return recall_guard(this, block);
+}
+
+void LeaseTable::end_recall(uint32_t block) {
+    boost::lock_guard<boost::mutex> g(m);
+    auto it = entries.find(block);
+    if (it != entries.end() && --it->second.recalls == 0 && it->second.expires <= clock::now()) {
+        entries.erase(it);
+    }
+}
@@ -0,0 +1,90 @@
+/***************************************************************************************************
+ *                                           LeaseTable                                            *
+ ***************************************************************************************************/
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <unordered_map>
+
+#include <boost/thread.hpp>
+
+/*
+ * Read leases for client-side caching.
+ *
+ * An FS_READLEASE grants its client the right to serve reads of one file from
+ * its cache until the lease expires.  Anything that would change what those
+ * reads return (overwriting a block, deleting the file) first recalls the
+ * inode: no new leases are granted on it, and the writer waits until every
+ * lease already granted has expired.  Leases are only granted to readers that
+ * hold the inode's shared lock before they read the data, and writers recall
+ * before they take the unique lock, so a lease never covers data a writer has
+ * already changed.
+ *
+ * With a duration of 0 nothing is granted and recalls cost nothing.
+ */
+class LeaseTable {
+public:
+    using clock = std::chrono::steady_clock;
+
+    explicit LeaseTable(std::chrono::milliseconds duration) : duration(duration) {}
+
+    /*
+     * Keeps new leases off an inode while alive, see recall()
+     */
+    class recall_guard {
+    public:
+        recall_guard() = default;
+        recall_guard(LeaseTable* table, uint32_t block) : table_(table), block_(block) {}
+        recall_guard(recall_guard &&other) noexcept : table_(other.table_), block_(other.block_) {
+            other.table_ = nullptr;
+        }
+        recall_guard(const recall_guard&) = delete;
+        recall_guard& operator=(const recall_guard&) = delete;
+        recall_guard& operator=(recall_guard&&) = delete;
+        ~recall_guard() {
+            if (table_) {
+                table_->end_recall(block_);
+            }
+        }
+
+    private:
+        LeaseTable* table_ = nullptr;
+        uint32_t block_ = 0;
+    };
+
+    /*
+     * grant
+     *
+     * Grants a lease on the inode stored in block and returns its length, or 0
+     * if leases are off or a writer is recalling the inode.  The caller must
+     * hold the inode's shared lock and not have read the data yet.
+     */
+    std::chrono::milliseconds grant(uint32_t block);
+
+    /*
+     * recall
+     *
+     * Stops new leases on the inode stored in block and waits until every
+     * granted lease on it has expired.  Keep the returned guard until the
+     * change is on disk.  The caller must not hold the inode's unique lock.
+     * Blocks the calling worker thread for up to one lease length.
+     */
+    recall_guard recall(uint32_t block);
+
+    std::chrono::milliseconds lease_duration() const { return duration; }
+
+private:
+    struct entry {
+        clock::time_point expires{};
+        unsigned int recalls = 0;       // writers waiting on or changing the inode
+    };
+
+    void end_recall(uint32_t block);
+
+    const std::chrono::milliseconds duration;
+
+    boost::mutex m;
+    std::unordered_map<uint32_t, entry> entries;
+    unsigned int grants_since_sweep = 0;
+};
@@ -0,0 +1,75 @@
+#include <algorithm>
+#include <vector>
+
+#include "lock_profiler.hpp"
+
+/***************************************************************************************************
+ *                                          LockProfiler                                           *
+ ***************************************************************************************************/
+
+/* function docs are in the header file */
+
+LockProfiler& LockProfiler::instance() {
+    static LockProfiler profiler;
+    return profiler;
+}
+
+bool LockProfiler::sample() {
+    static thread_local unsigned int countdown = 0;
+    unsigned int rate = sample_rate();
+    if (rate == 0) {
+        return false;
+    }
+    // a lowered rate takes effect now, not after the old countdown runs out
+    if (countdown == 0 || countdown > rate) {
+        countdown = rate;
+    }
+    return --countdown == 0;
+}
+
+void LockProfiler::record(uint32_t block, metrics_clock::duration wait, std::string_view path) {
+    if (block >= FS_DISKSIZE) {
+        return;
+    }
+    uint64_t ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(wait).count());
+    boost::lock_guard<boost::mutex> g(stats_mutex);
+    inode_stats &s = stats[block];
+    ++s.samples;
+    s.total_ns += ns;
+    s.max_ns = std::max(s.max_ns, ns);
+    if (s.path != path) {
+        s.path = path;
+    }
+}
+
+void LockProfiler::render(std::ostream &os, size_t top_n) {
+    std::vector<std::pair<uint32_t, inode_stats>> hot;
+    {
+        boost::lock_guard<boost::mutex> g(stats_mutex);
+        for (uint32_t b = 0; b < FS_DISKSIZE; ++b) {
+            if (stats[b].samples != 0) {
+                hot.emplace_back(b, stats[b]);
+            }
+        }
+    }
+    std::sort(hot.begin(), hot.end(), [](const auto &a, const auto &b) {
+        return a.second.total_ns > b.second.total_ns;
+    });
+    if (hot.size() > top_n) {
+        hot.resize(top_n);
+    }
+
+    os << "# sample_rate " << sample_rate() << "\n";
+    os << "# inode_block samples mean_wait_us max_wait_us path\n";
+    for (const auto &[block, s] : hot) {
+        os << block << " " << s.samples << " " << (s.total_ns / 1000.0) / s.samples << " "
+           << s.max_ns / 1000.0 << " " << (s.path.empty() ? "/" : s.path) << "\n";
+    }
+} // LockProfiler::render()
+
+void LockProfiler::reset() {
+    boost::lock_guard<boost::mutex> g(stats_mutex);
+    for (inode_stats &s : stats) {
+        s = inode_stats{};
+    }
+}
@@ -0,0 +1,160 @@
+#include <algorithm>
+#include <bit>
+#include <string>
+
+#include "metrics.hpp"
+
+/***************************************************************************************************
+ *                                             Metrics                                             *
+ ***************************************************************************************************/
+
+/* function docs are in the header file */
+
+thread_local unsigned int Metrics::current_type = FS_REQUEST_TYPES;
+
+/*
+ * Owns the calling thread's shard and returns it to the free list when the
+ * thread exits.
+ */
+struct shard_lease {
+    Metrics::shard* s = nullptr;
+
+    ~shard_lease() {
+        if (s) {
+            Metrics &m = Metrics::instance();
+            boost::lock_guard<boost::mutex> g(m.shards_mutex);
+            m.free_shards.push_back(s);
+        }
+    }
+};
+
+Metrics& Metrics::instance() {
+    // never destroyed so thread exit handlers can still return their shards
+    static Metrics* m = new Metrics();
+    return *m;
+}
+
+Metrics::shard& Metrics::local() {
+    static thread_local shard_lease lease;
+    if (!lease.s) {
+        boost::lock_guard<boost::mutex> g(shards_mutex);
+        if (!free_shards.empty()) {
+            lease.s = free_shards.back();
+            free_shards.pop_back();
+        } else {
+            shards.push_back(std::make_unique<shard>());
+            lease.s = shards.back().get();
+        }
+    }
+    return *lease.s;
+}
+
+void Metrics::observe(histogram &h, metrics_clock::duration d) {
+    uint64_t ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count());
+    unsigned int b = std::min<unsigned int>(std::bit_width(ns), METRICS_BUCKETS - 1);
+    bump(h.buckets[b]);
+    h.sum_ns.store(h.sum_ns.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+}
+
+void Metrics::record_request(request_t type, bool ok, metrics_clock::duration latency) {
+    shard &s = local();
+    bump(s.requests[type][ok]);
+    observe(s.request_latency[type], latency);
+}
+
+void Metrics::record_malformed() {
+    bump(local().malformed);
+}
+
+/*
+ * Sums a histogram across shards into plain counts.
+ */
+static void merge(const Metrics::histogram &h, uint64_t (&buckets)[METRICS_BUCKETS], uint64_t &sum_ns) {
+    for (unsigned int b = 0; b < METRICS_BUCKETS; ++b) {
+        buckets[b] += h.buckets[b].load(std::memory_order_relaxed);
+    }
+    sum_ns += h.sum_ns.load(std::memory_order_relaxed);
+}
+
+static void render_histogram(std::ostream &os, const std::string &name, const std::string &labels,
+                             const uint64_t (&buckets)[METRICS_BUCKETS], uint64_t sum_ns) {
+    std::string sep = labels.empty() ? "" : ",";
+    uint64_t cumulative = 0;
+    for (unsigned int b = 0; b + 1 < METRICS_BUCKETS; ++b) {
+        cumulative += buckets[b];
+        os << name << "_bucket{" << labels << sep << "le=\"" << static_cast<double>(uint64_t{1} << b) * 1e-9
+           << "\"} " << cumulative << "\n";
+    }
+    cumulative += buckets[METRICS_BUCKETS - 1];
+    os << name << "_bucket{" << labels << sep << "le=\"+Inf\"} " << cumulative << "\n";
+    os << name << "_sum" << (labels.empty() ? "" : "{" + labels + "}") << " " << sum_ns * 1e-9 << "\n";
+    os << name << "_count" << (labels.empty() ? "" : "{" + labels + "}") << " " << cumulative << "\n";
+}
+
+void Metrics::render(std::ostream &os, size_t free_blocks) {
+    uint64_t requests[FS_REQUEST_TYPES][2]{};
+    uint64_t shed[FS_REQUEST_TYPES]{};
+    uint64_t malformed = 0;
+    uint64_t reads[METRICS_TYPES]{};
+    uint64_t writes[METRICS_TYPES]{};
+    uint64_t latency[FS_REQUEST_TYPES][METRICS_BUCKETS]{};
+    uint64_t latency_sum[FS_REQUEST_TYPES]{};
+    uint64_t wait[METRICS_BUCKETS]{}, hold[METRICS_BUCKETS]{};
+    uint64_t wait_sum = 0, hold_sum = 0;
+
+    {
+        boost::lock_guard<boost::mutex> g(shards_mutex);
+        for (const auto &s : shards) {
+            for (unsigned int t = 0; t < FS_REQUEST_TYPES; ++t) {
+                requests[t][0] += s->requests[t][0].load(std::memory_order_relaxed);
+                requests[t][1] += s->requests[t][1].load(std::memory_order_relaxed);
+                shed[t] += s->shed[t].load(std::memory_order_relaxed);
+                merge(s->request_latency[t], latency[t], latency_sum[t]);
+            }
+            for (unsigned int t = 0; t < METRICS_TYPES; ++t) {
+                reads[t]  += s->disk_reads[t].load(std::memory_order_relaxed);
+                writes[t] += s->disk_writes[t].load(std::memory_order_relaxed);
+            }
+            malformed += s->malformed.load(std::memory_order_relaxed);
+            merge(s->lock_wait, wait, wait_sum);
+            merge(s->lock_hold, hold, hold_sum);
+        }
+    }
+
+    auto type_label = [](unsigned int t) {
+        return std::string("type=\"") + (t < FS_REQUEST_TYPES ? request_name(static_cast<request_t>(t)) : "none")
+               + "\"";
+    };
+
+    os << "# TYPE fs_requests_total counter\n";
+    for (unsigned int t = 0; t < FS_REQUEST_TYPES; ++t) {
+        os << "fs_requests_total{" << type_label(t) << ",outcome=\"ok\"} " << requests[t][1] << "\n";
+        os << "fs_requests_total{" << type_label(t) << ",outcome=\"failed\"} " << requests[t][0] << "\n";
+        os << "fs_requests_total{" << type_label(t) << ",outcome=\"shed\"} " << shed[t] << "\n";
+    }
+    os << "# TYPE fs_malformed_requests_total counter\n";
+    os << "fs_malformed_requests_total " << malformed << "\n";
+
+    os << "# TYPE fs_disk_reads_total counter\n";
+    for (unsigned int t = 0; t < METRICS_TYPES; ++t) {
+        os << "fs_disk_reads_total{" << type_label(t) << "} " << reads[t] << "\n";
+    }
+    os << "# TYPE fs_disk_writes_total counter\n";
+    for (unsigned int t = 0; t < METRICS_TYPES; ++t) {
+        os << "fs_disk_writes_total{" << type_label(t) << "} " << writes[t] << "\n";
+    }
+
+    os << "# TYPE fs_request_duration_seconds histogram\n";
+    for (unsigned int t = 0; t < FS_REQUEST_TYPES; ++t) {
+        render_histogram(os, "fs_request_duration_seconds", type_label(t), latency[t], latency_sum[t]);
+    }
+    os << "# TYPE fs_lock_wait_seconds histogram\n";
+    render_histogram(os, "fs_lock_wait_seconds", "", wait, wait_sum);
+    os << "# TYPE fs_lock_hold_seconds histogram\n";
+    render_histogram(os, "fs_lock_hold_seconds", "", hold, hold_sum);
+
+    os << "# TYPE fs_free_blocks gauge\n";
+    os << "fs_free_blocks " << free_blocks << "\n";
+    os << "# TYPE fs_active_connections gauge\n";
+    os << "fs_active_connections " << active_connections.load(std::memory_order_relaxed) << "\n";
+} // Metrics::render()
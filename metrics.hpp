@@ -0,0 +1,153 @@
+/***************************************************************************************************
+ *                                             Metrics                                             *
+ ***************************************************************************************************/
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <vector>
+
+#include <boost/thread.hpp>
+
+#include "request.hpp"
+
+/*
+ * Server instrumentation.
+ *
+ * Every thread records into its own shard with plain relaxed loads/stores
+ * (one writer per shard, no lock prefix on the hot path); readers sum all
+ * shards when the metrics are dumped.  Shards of exited threads go back on a
+ * free list with their counts intact, so nothing is lost and the number of
+ * shards stays bounded by the peak number of live threads.
+ */
+
+using metrics_clock = std::chrono::steady_clock;
+
+// log2 buckets of nanoseconds, bucket i holds values < 2^i ns (the last one is +Inf)
+static constexpr unsigned int METRICS_BUCKETS = 36;
+
+// request types plus one slot for disk accesses made outside a request (sys_init)
+static constexpr unsigned int METRICS_TYPES = FS_REQUEST_TYPES + 1;
+
+class Metrics {
+public:
+    struct histogram {
+        std::atomic<uint64_t> buckets[METRICS_BUCKETS]{};
+        std::atomic<uint64_t> sum_ns{0};
+    };
+
+    struct shard {
+        std::atomic<uint64_t> requests[FS_REQUEST_TYPES][2]{};   // [type][ok]
+        std::atomic<uint64_t> shed[FS_REQUEST_TYPES]{};          // refused by admission control
+        std::atomic<uint64_t> malformed{0};
+        std::atomic<uint64_t> disk_reads[METRICS_TYPES]{};
+        std::atomic<uint64_t> disk_writes[METRICS_TYPES]{};
+        histogram request_latency[FS_REQUEST_TYPES];
+        histogram lock_wait;
+        histogram lock_hold;
+    };
+
+    static Metrics& instance();
+
+    /*
+     * Tags the calling thread's disk accesses with the request it is serving.
+     */
+    static void set_request_type(request_t type) { current_type = type; }
+    static void clear_request_type() { current_type = FS_REQUEST_TYPES; }
+
+    void record_request(request_t type, bool ok, metrics_clock::duration latency);
+    void record_shed(request_t type) { bump(local().shed[type]); }
+    void record_malformed();
+    void record_disk_read()  { bump(local().disk_reads[current_type]); }
+    void record_disk_write() { bump(local().disk_writes[current_type]); }
+    void record_lock_wait(metrics_clock::duration d) { observe(local().lock_wait, d); }
+    void record_lock_hold(metrics_clock::duration d) { observe(local().lock_hold, d); }
+
+    void connection_opened() { active_connections.fetch_add(1, std::memory_order_relaxed); }
+    void connection_closed() { active_connections.fetch_sub(1, std::memory_order_relaxed); }
+
+    /*
+     * render
+     *
+     * Writes all metrics in the Prometheus text exposition format.  Gauges
+     * owned by the caller (free block count) are passed in.
+     */
+    void render(std::ostream &os, size_t free_blocks);
+
+private:
+    Metrics() = default;
+
+    shard& local();
+
+    static void bump(std::atomic<uint64_t> &c) {
+        c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+    static void observe(histogram &h, metrics_clock::duration d);
+
+    static thread_local unsigned int current_type;
+
+    std::atomic<int64_t> active_connections{0};
+
+    boost::mutex shards_mutex;
+    std::vector<std::unique_ptr<shard>> shards;     // every shard ever handed out
+    std::vector<shard*> free_shards;                 // shards of exited threads
+
+    friend struct shard_lease;
+};
+
+/*
+ * Times how long acquiring a lock blocks and how long it is held.  The hold
+ * time runs from the first acquisition until released() (or destruction), so
+ * upgrading a lock through the same timer extends its hold instead of
+ * restarting it.
+ */
+class lock_timer {
+public:
+    lock_timer() = default;
+    lock_timer(lock_timer &&other) noexcept : since_(other.since_) { other.since_ = {}; }
+    lock_timer& operator=(lock_timer &&other) noexcept {
+        if (this != &other) {
+            released();
+            since_ = other.since_;
+            other.since_ = {};
+        }
+        return *this;
+    }
+    lock_timer(const lock_timer&) = delete;
+    lock_timer& operator=(const lock_timer&) = delete;
+
+    ~lock_timer() { released(); }
+
+    void acquired(metrics_clock::time_point wait_start) {
+        metrics_clock::time_point now = metrics_clock::now();
+        Metrics::instance().record_lock_wait(now - wait_start);
+        if (since_ == metrics_clock::time_point{}) {
+            since_ = now;
+        }
+    }
+
+    void released() {
+        if (since_ != metrics_clock::time_point{}) {
+            Metrics::instance().record_lock_hold(metrics_clock::now() - since_);
+            since_ = {};
+        }
+    }
+
+private:
+    metrics_clock::time_point since_{};
+};
+
+/*
+ * Constructs Lock from arg (a mutex, or a lock to upgrade) and records the
+ * wait on timer.
+ */
+template <typename Lock, typename Arg>
+Lock acquire_timed(Arg &&arg, lock_timer &timer) {
+    metrics_clock::time_point start = metrics_clock::now();
+    Lock lock(std::forward<Arg>(arg));
+    timer.acquired(start);
+    return lock;
+}
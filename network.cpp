@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <array>
 #include <iostream>
 #include <cstring>
 #include <stdexcept>
@@ -8,13 +10,23 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/tcp.h>
 #include <cstdlib> 
 #include <optional>
 #include <memory>
 #include <unordered_map>
+#include <sstream>
+#include <string_view>
+#include <random>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "network.hpp"
 #include "request.hpp"
+#include "dir_scan.hpp"
+#include "metrics.hpp"
 #include "fs_server.h"
 
 /***************************************************************************************************
@@ -23,95 +35,302 @@
 
 /* function docs are in the header file */
 
-Network::Network(int port_in) : portnum(port_in) {}
+// what a hole in a sparse file reads as
+static const char zero_block[FS_BLOCKSIZE] = {};
+
+// true if the FS_BLOCKSIZE bytes at data are all zero; checked on every write to find holes
+static bool is_zero_block(const void* data) {
+#if defined(__SSE2__)
+    const __m128i* p = static_cast<const __m128i*>(data);
+    __m128i any = _mm_setzero_si128();
+    for (size_t i = 0; i < FS_BLOCKSIZE / sizeof(__m128i); ++i) {
+        any = _mm_or_si128(any, _mm_loadu_si128(p + i));
+    }
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) == 0xFFFF;
+#else
+    uint64_t any = 0;
+    for (size_t i = 0; i < FS_BLOCKSIZE; i += sizeof(uint64_t)) {
+        uint64_t word;
+        std::memcpy(&word, static_cast<const char*>(data) + i, sizeof(word));
+        any |= word;
+    }
+    return any == 0;
+#endif
+}
+
+// "/a/b/c" -> "/a/b", used to label parent directories in the contention profiler
+static std::string_view parent_of(std::string_view pathname) {
+    return pathname.substr(0, pathname.rfind('/'));
+}
+
+Network::Network(const server_config &config)
+    : portnum(config.port), config(config), leases(std::chrono::milliseconds(config.lease_ms)),
+      dedup(config.dedup ? std::make_unique<DedupIndex>() : nullptr),
+      snapshots([this]() { return blocks_in_use(); },
+                [this](const std::function<bool(uint32_t)> &usable) { return get_new_block_where(usable); },
+                [this](const std::vector<uint32_t> &blocks) { free_blocks(blocks); }) {}
 
 
 void Network::start_server() {
     sys_init();
 
-    sockfd = socket(PF_INET, SOCK_STREAM, IPPROTO_IP);
-    if (sockfd < 0) {
-        throw std::runtime_error("socket() failed");
+    if (!config.replica_socket.empty()) {
+        replication = std::make_unique<ReplicationSource>(config.replica_socket, [this]() {
+            std::bitset<FS_DISKSIZE> in_use = blocks_in_use();
+            std::vector<uint32_t> used;
+            for (uint32_t block = 0; block < FS_DISKSIZE; ++block) {
+                if (in_use.test(block)) {
+                    used.push_back(block);
+                }
+            }
+            return used;
+        });
     }
-    // configure the socket to reuse local addresses
-    int yesval = 1;
-    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yesval, sizeof(yesval)) < 0) {
-        throw std::runtime_error("setsockopt() failed");
+    if (!config.follow.empty()) {
+        replica = std::make_unique<ReplicaSink>(config.follow, std::chrono::milliseconds(config.max_staleness_ms));
     }
-
-    // socket is created and configured, bind the socket
-    addr.sin_family         = AF_INET; // Address Family Internet (IPV4)
-    addr.sin_addr.s_addr    = htonl(INADDR_ANY);
-    addr.sin_port           = htons(portnum);
-
-    if (bind(sockfd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
-        throw std::runtime_error("bind() failed");
+    // moving a block shared by several files would need all of their inodes
+    if (config.defrag && dedup) {
+        std::cerr << "Defragmentation is off in dedup mode\n";
+    } else if (config.defrag) {
+        defrag = std::make_unique<Defragmenter>(
+            [this]() { return defrag_scan(); },
+            [this](const Defragmenter::candidate &c, const std::function<bool()> &busy) { return defrag_move(c, busy); });
     }
 
-    // check to see if OS needs to choose the portnumber 
-    get_port_number(sockfd);
-
-    if (listen(sockfd, BACKLOG) < 0) {
-        throw std::runtime_error("syscall to listen() failed");
+    unsigned int listeners = std::max(1u, config.listeners);
+    for (unsigned int i = 0; i < listeners; ++i) {
+        listen_socks.push_back(open_listener(listeners > 1));
     }
 
-    print_port(portnum);
-    // Handle all requests from clients
-    while (true) {
-        // accept a connection to the server socket
-        int connection_sock = accept(sockfd, nullptr, nullptr);
-        if (connection_sock < 0) {
-            throw std::runtime_error("syscall to accept() failed");
-        }
+    admission = std::make_unique<AdmissionControl>(config.max_queue, std::chrono::milliseconds(config.target_ms),
+                                                   std::chrono::milliseconds(CODEL_INTERVAL_MS));
+    scheduler = std::make_unique<Scheduler>(config.loops, config.workers, admission.get(),
+                                            [this](const std::string &user) {
+                                                auto it = config.weights.find(user);
+                                                return it == config.weights.end() ? 1u : it->second;
+                                            },
+                                            listeners > 1 ? listeners : 0);
 
-        boost::thread t(&Network::handle_request, this, connection_sock);
+    print_port(portnum);
+    // Handle all requests from clients, the first listener on this thread
+    for (unsigned int i = 1; i < listeners; ++i) {
+        boost::thread t([this, i]() {
+            try {
+                accept_loop(listen_socks[i], i);
+            } catch (const std::runtime_error &e) {
+                // as if start_server() had thrown it
+                std::cout << e.what() << std::endl;
+                std::exit(-1);
+            }
+        });
         t.detach();
     }
+    accept_loop(listen_socks[0], 0);
 
 } // Network::start_server()
 
-void Network::handle_request(int connection_sock) {
+task<> Network::serve_connection(int connection_sock, event_loop &loop, metrics_clock::time_point accepted) {
+    Metrics &metrics = Metrics::instance();
+    Tracer &tracer = Tracer::instance();
+    metrics.connection_opened();
+    socket_io io{connection_sock, &loop};
+    // after FS_SESSION the connection stays open for further requests
+    bool session = false;
+    receive_buffer rb;
+    // the header and parsed request of the current request, see arena.hpp
+    request_arena arena;
+    // reused, so a response costs no allocation once the buffer has grown to fit
+    std::string response;
     try {
-        std::string header = receive_data(connection_sock);
-
-        request request;
-        if(!parse_request(header, request)){
-            // Malformed request
-            close(connection_sock);
-            return;
-        };
-        // Handle the data correctly
-        switch (request.type) {
-            case FS_READBLOCK:
-                read_block(request, connection_sock);
+        do {
+            // the last request's objects are gone by now
+            arena.reset();
+            tracer.begin_request();
+            if (!session) {
+                tracer.record("accept", accepted, metrics_clock::now());
+            }
+            std::pmr::string header(arena.get());
+            {
+                trace_span span("receive_header");
+                header = co_await receive_data(io, rb, arena.get());
+            }
+            // the client closed its session
+            if (header.empty() && session) {
+                break;
+            }
+
+            request request(arena.get());
+            bool parsed = false;
+            {
+                trace_span span("parse");
+                parsed = parse_request(header, request);
+            }
+            if(!parsed){
+                // Malformed request, we cannot tell if a payload follows so drop the connection
+                metrics.record_malformed();
                 break;
-            case FS_WRITEBLOCK: {
+            };
+            if (request.type == FS_SESSION) {
+                if (session) {
+                    break;
+                }
+                session = true;
+                // pipelined responses should not wait for the client's ACKs
+                int yesval = 1;
+                setsockopt(connection_sock, IPPROTO_TCP, TCP_NODELAY, &yesval, sizeof(yesval));
+            }
+
+            metrics_clock::time_point start = metrics_clock::now();
+            trace_span request_span(request_name(request.type));
+            bool ok = false;
+            bool in_sync = true;    // false if the connection can't carry another request
+            if (request.type == FS_WRITEBLOCK || request.type == FS_WRITEHANDLE) {
                 // need to recieve the data to write
-                ssize_t n = recv(connection_sock, request.buf, FS_BLOCKSIZE, MSG_WAITALL); 
-                // MSG_WAITALL will gauruntee we get enough byte unless the client does not send that much or 
-                // closes the connection 
-                if (n != FS_BLOCKSIZE) {
-                    close(connection_sock);
-                    return; // did not recieve the right amount
+                trace_span payload_span("receive_payload");
+                in_sync = co_await receive_payload(io, rb, request.buf, FS_BLOCKSIZE);
+            }
+            if (request.type == FS_STATMANY || request.type == FS_CREATE_BATCH) {
+                // the paths to look up or entries to create, an empty one means the connection closed
+                trace_span payload_span("receive_payload");
+                for (unsigned long i = 0; i < request.arg && in_sync; ++i) {
+                    std::pmr::string path = co_await receive_data(io, rb, arena.get());
+                    in_sync = !path.empty();
+                    request.paths.push_back(std::move(path));
                 }
-                write_block(request, connection_sock);
+            }
+            // a block and its header fit, the buffer of a big listing is not kept around
+            if (response.capacity() > 2 * FS_BLOCKSIZE) {
+                response = std::string();
+            }
+            response.clear();
+            auto handler = [this, &request, &response]() {
+                Metrics::set_request_type(request.type);
+                if (defrag) {
+                    defrag->request_began();
+                }
+                bool result = execute_request(request, response);
+                if (defrag) {
+                    defrag->request_ended();
+                }
+                Metrics::clear_request_type();
+                return result;
+            };
+            if (in_sync) {
+                // session setup and the observability requests must get through an overloaded server
+                bool exempt = request.type == FS_SESSION || request.type == FS_STATS ||
+                              request.type == FS_LOCKPROF || request.type == FS_TRACE;
+                std::optional<bool> result;
+                if (exempt) {
+                    result = co_await scheduler->offload(loop, handler);
+                } else {
+                    result = co_await scheduler->try_offload(loop, request.username, handler);
+                }
+                if (!result) {
+                    metrics.record_shed(request.type);
+                    co_await send_all(io, FS_BUSY_REPLY, sizeof(FS_BUSY_REPLY));
+                    continue;
+                }
+                ok = *result;
+            }
+            metrics.record_request(request.type, ok, metrics_clock::now() - start);
+
+            if (!in_sync) {
                 break;
             }
-            case FS_CREATE:
-                sys_create(request, connection_sock);
+            if (ok) {
+                co_await send_all(io, response.data(), response.size());
+            } else if (session) {
+                co_await send_all(io, FS_ERROR_REPLY, sizeof(FS_ERROR_REPLY));
+            } else {
                 break;
-            case FS_DELETE:
-                sys_delete(request, connection_sock);
+            }
+        } while (session);
+    } catch (...) {
+    }
+    // All done, close the connection with client
+    close(connection_sock);
+    tracer.end_request();
+    metrics.connection_closed();
+} // Network::serve_connection
+
+bool Network::execute_request(request &request, std::string &response) {
+    ReplicaSink::read_view replica_view;
+    if (replica) {
+        switch (request.type) {
+            case FS_READBLOCK:
+            case FS_READLEASE:
+            case FS_STAT:
+            case FS_STATMANY:
+            case FS_READDIR:
+                replica_view = replica->begin_read();
+                if (!replica_view.owns_lock()) {
+                    return false;
+                }
+                break;
+            case FS_STATS:
+            case FS_LOCKPROF:
+            case FS_TRACE:
+            case FS_SESSION:
                 break;
+            default:
+                // read-only, and handles need generations the write stream does not carry
+                return false;
         }
+    }
 
-        // All went well, close the connection with client
-        close(connection_sock);
+    // "/.snapshots" is reserved for reading the snapshots
+    if (names_snapshot_dir(request)) {
+        switch (request.type) {
+            case FS_READBLOCK:
+            case FS_READLEASE:
+            case FS_STAT:
+            case FS_READDIR:
+                return snapshot_read(request, response);
+            default:
+                return false;
+        }
+    }
 
-    } catch (...) {
-        close(connection_sock);
+    switch (request.type) {
+        case FS_READBLOCK:
+        case FS_READLEASE:
+        case FS_READHANDLE:
+            return read_block(request, response);
+        case FS_WRITEBLOCK:
+        case FS_WRITEHANDLE:
+            return write_block(request, response);
+        case FS_OPEN:
+            return sys_open(request, response);
+        case FS_STAT:
+        case FS_STATMANY:
+            return sys_stat(request, response);
+        case FS_READDIR:
+            return sys_readdir(request, response);
+        case FS_CREATE:
+            return sys_create(request, response);
+        case FS_COPY:
+            return sys_copy(request, response);
+        case FS_SNAPSHOT:
+            return sys_snapshot(request, response);
+        case FS_CREATE_BATCH:
+            return sys_create_batch(request, response);
+        case FS_DELETE:
+            return sys_delete(request, response);
+        case FS_DELETE_TREE:
+            return sys_delete_tree(request, response);
+        case FS_STATS:
+            return sys_stats(request, response);
+        case FS_LOCKPROF:
+            return sys_lockprof(request, response);
+        case FS_TRACE:
+            return sys_trace(request, response);
+        case FS_SESSION:
+            response.append(request.header.data(), request.header.size() + 1);
+            return true;
     }
-} // Network::handle_request
+    return false;
+} // Network::execute_request
 
 void Network::sys_init() {
     // fill free disk blocks
@@ -122,6 +341,8 @@ void Network::sys_init() {
     std::deque<uint32_t> d;
     // always start at the root
     d.push_back(0);
+    // one entry per reference to a file block
+    std::vector<uint32_t> file_blocks;
 
     // dfs to attempt to reduce worst case space complexity
     while(!d.empty()){
@@ -131,6 +352,7 @@ void Network::sys_init() {
         fs_inode curr_inode;
         read_inode_block(curr_block, curr_inode);
         free_disk_blocks.erase(curr_block);
+        inode_generation[curr_block].store(new_generation(), std::memory_order_relaxed);
 
         // this inode is a directory
         if (curr_inode.type == 'd') {
@@ -142,7 +364,7 @@ void Network::sys_init() {
                 }
                 free_disk_blocks.erase(data_block);
                 fs_direntry entries[FS_DIRENTRIES];
-                disk_readblock(data_block , entries);
+                read_disk_block(data_block , entries);
                 for (size_t j = 0; j < FS_DIRENTRIES; ++j) {
                     uint32_t child_block = entries[j].inode_block;
                     // unused block
@@ -154,21 +376,41 @@ void Network::sys_init() {
             }
         } else if (curr_inode.type == 'f') {
             for(size_t i = 0; i < curr_inode.size; ++i) { 
-                // this block is being used
-                free_disk_blocks.erase(curr_inode.blocks[i]);
+                // this block is being used, unless it is a hole
+                if (curr_inode.blocks[i] != 0) {
+                    free_disk_blocks.erase(curr_inode.blocks[i]);
+                    file_blocks.push_back(curr_inode.blocks[i]);
+                }
+            }
+        }
+    }
+
+    std::sort(file_blocks.begin(), file_blocks.end());
+    if (!dedup && std::adjacent_find(file_blocks.begin(), file_blocks.end()) != file_blocks.end()) {
+        std::cerr << "The disk has blocks shared by several files, turning on dedup mode\n";
+        dedup = std::make_unique<DedupIndex>();
+    }
+    if (dedup) {
+        char data[FS_BLOCKSIZE];
+        for (size_t i = 0; i < file_blocks.size(); ++i) {
+            dedup->ref(file_blocks[i]);
+            if (i == 0 || file_blocks[i] != file_blocks[i - 1]) {
+                read_disk_block(file_blocks[i], data);
+                dedup->reindex(DedupIndex::fingerprint(data), file_blocks[i]);
             }
         }
     }
 }
 
-void Network::read_block(request &request, int socket) {
+bool Network::read_block(request &request, std::string &response) {
 
     // traverse the path and find if it exists, check if the username checks out, send message w data
     path_find_info<shared_lock> lock_info;
-    int target_inode_block = path_find(request.path, request.username, &lock_info);
+    int target_inode_block = request.type == FS_READHANDLE ? handle_find(request, &lock_info)
+                                                           : path_find(request.path, request.username, &lock_info);
     // file does not exist
     if (target_inode_block == -1) {
-        return;
+        return false;
     } 
 
     fs_inode target_inode;
@@ -176,32 +418,48 @@ void Network::read_block(request &request, int socket) {
 
     // we cant read a directory block and must be proper owner
     if(target_inode.type != 'f' 
-        || std::string(target_inode.owner) != request.username){ 
-        return;
+        || std::string_view(target_inode.owner) != request.username){ 
+        return false;
     }
     // file does not have that many blocks
-    if (request.block >= static_cast<int>(target_inode.size) || target_inode.blocks[request.block] == 0) {
-        return;
+    if (request.block >= static_cast<int>(target_inode.size)) {
+        return false;
     }
 
-    // success read the block and send a response
-    char data[FS_BLOCKSIZE];
+    // the lease has to be granted before the data is read, a writer recalling it may already be waiting
+    std::string lease_info;
+    if (request.type == FS_READLEASE) {
+        lease_info = std::to_string(target_inode_block) + " " + std::to_string(leases.grant(target_inode_block).count());
+    }
 
-    disk_readblock(target_inode.blocks[request.block], data);
+    // success read the block and send a response, a hole is all zeros and never on disk
+    char data[FS_BLOCKSIZE];
+    const char* block_data = zero_block;
+    if (target_inode.blocks[request.block] != 0) {
+        read_disk_block(target_inode.blocks[request.block], data);
+        block_data = data;
+    }
 
     lock_info.lock.unlock();
+    lock_info.timer.released();
 
-    send_all(socket, request.header.data(), request.header.size() + 1);
-    send_all(socket, data, FS_BLOCKSIZE);
+    response.append(request.header.data(), request.header.size() + 1);
+    if (request.type == FS_READLEASE) {
+        response.append(lease_info.data(), lease_info.size() + 1);
+    }
+    response.append(block_data, FS_BLOCKSIZE);
+    return true;
 }
 
-void Network::write_block(request &request, int socket) {
+bool Network::write_block(request &request, std::string &response) {
 
     path_find_info<upgrade_lock> lock_info;
-    int target_inode_block = path_find_upgrade(request.path, request.username, &lock_info);
+    int target_inode_block = request.type == FS_WRITEHANDLE
+                                 ? handle_find(request, &lock_info)
+                                 : path_find_upgrade(request.path, request.username, &lock_info);
     
     if (target_inode_block == -1) {
-        return;
+        return false;
     }
 
     fs_inode target_inode;
@@ -209,65 +467,549 @@ void Network::write_block(request &request, int socket) {
 
     // not allowed to write more than 1 block past size
     if (request.block > static_cast<int>(target_inode.size)) {
-        return;
+        return false;
     }
 
     // cant write to a file not the owner and not the root
-    if (target_inode.type != 'f' || (std::string(target_inode.owner) != request.username)) {
-        return;
+    if (target_inode.type != 'f' || (std::string_view(target_inode.owner) != request.username)) {
+        return false;
     }
 
+    auto target_path = [&request]() { return std::string_view(request.pathname); };
     bool extends_file = (request.block == static_cast<int>(target_inode.size));
+    // all zero blocks are stored as holes, blocks[i] == 0, with no disk block behind them
+    bool zeros = is_zero_block(request.buf);
+    uint32_t old_block = extends_file ? 0 : target_inode.blocks[request.block];
     
-    if (!extends_file) {
-        unique_lock write_lock(std::move(lock_info.lock));
-        disk_writeblock(target_inode.blocks[request.block], request.buf);
-    } else {           
-        if (target_inode.size >= FS_MAXFILEBLOCKS) {
-            return;
+    if (extends_file && target_inode.size >= FS_MAXFILEBLOCKS) {
+        return false;
+    }
+    if (!extends_file && zeros && old_block == 0) {
+        // already a hole, nothing changes
+    } else if (dedup && !zeros) {
+        if (!write_block_dedup(request, target_inode_block, target_inode, lock_info)) {
+            return false;
+        }
+    } else if (!extends_file && !zeros && old_block != 0) {
+        // cached copies of the block must expire before it changes, appending leaves them valid
+        LeaseTable::recall_guard recall = leases.recall(static_cast<uint32_t>(target_inode_block));
+        unique_lock write_lock = acquire_profiled<unique_lock>(std::move(lock_info.lock), lock_info.timer,
+                                                               target_inode_block, target_path);
+        write_disk_block(old_block, request.buf);
+    } else {
+        // the inode changes: a block or hole is appended, a hole filled in, or a block punched out
+        uint32_t new_block = 0;
+        if (!zeros) {
+            int b = get_new_block();
+            if (b == -1){
+                return false; 
+            }
+            new_block = static_cast<uint32_t>(b);
+            // data first
+            write_disk_block(new_block, request.buf);
+        }
+        target_inode.blocks[request.block] = new_block;
+        if (extends_file) {
+            target_inode.size++;
         }
+
+        LeaseTable::recall_guard recall = extends_file ? LeaseTable::recall_guard{}
+                                                       : leases.recall(static_cast<uint32_t>(target_inode_block));
+        unique_lock write_lock = acquire_profiled<unique_lock>(std::move(lock_info.lock), lock_info.timer,
+                                                               target_inode_block, target_path);
+        // Then inode -- We just changed this inode, we have to now write it back
+        write_disk_block(target_inode_block, &target_inode);
+        // the punched out block is only free once the inode no longer points at it
+        if (old_block != 0 && (!dedup || dedup->release(old_block))) {
+            boost::lock_guard<boost::mutex> g(free_disk_mutex);
+            free_disk_blocks.insert(old_block);
+        }
+    }
+    response.append(request.header.data(), request.header.size() + 1);
+    return true;
+}
+
+bool Network::write_block_dedup(request &request, int target_inode_block, fs_inode &target_inode,
+                                path_find_info<upgrade_lock> &lock_info) {
+    auto target_path = [&request]() { return std::string_view(request.pathname); };
+    bool extends_file = (request.block == static_cast<int>(target_inode.size));
+    uint32_t old_block = extends_file ? 0 : target_inode.blocks[request.block];
+
+    uint64_t fp = DedupIndex::fingerprint(request.buf);
+    char existing[FS_BLOCKSIZE];
+    uint32_t new_block = dedup->share(fp);
+    if (new_block != 0) {
+        // our reference keeps the candidate as it is while it is compared
+        read_disk_block(new_block, existing);
+        if (std::memcmp(existing, request.buf, FS_BLOCKSIZE) != 0) {
+            if (dedup->release(new_block)) {
+                boost::lock_guard<boost::mutex> g(free_disk_mutex);
+                free_disk_blocks.insert(new_block);
+            }
+            new_block = 0;
+        }
+    }
+    if (new_block != 0 && new_block == old_block) {
+        // the block already holds this data
+        dedup->release(new_block);
+        return true;
+    }
+
+    // cached copies of the block must expire before it changes, appending leaves them valid
+    LeaseTable::recall_guard recall = extends_file ? LeaseTable::recall_guard{}
+                                                   : leases.recall(static_cast<uint32_t>(target_inode_block));
+    // copies take their references under the shared lock, so with the unique lock a count of one stays one
+    unique_lock write_lock = acquire_profiled<unique_lock>(std::move(lock_info.lock), lock_info.timer,
+                                                           target_inode_block, target_path);
+    if (new_block == 0 && old_block != 0 && dedup->claim(old_block)) {
+        write_disk_block(old_block, request.buf);
+        dedup->reindex(fp, old_block);
+        return true;
+    }
+    if (new_block == 0) {
         int b = get_new_block();
-        if (b == -1){
-            return; 
+        if (b == -1) {
+            return false;
         }
-        uint32_t next_block = static_cast<uint32_t>(b);
-        // trying to write to the next block
-        target_inode.blocks[target_inode.size] = next_block;
-        target_inode.size++;
+        new_block = static_cast<uint32_t>(b);
         // data first
-        disk_writeblock(next_block, request.buf);
+        write_disk_block(new_block, request.buf);
+        dedup->add(fp, new_block);
+    }
+    target_inode.blocks[request.block] = new_block;
+    if (extends_file) {
+        target_inode.size++;
+    }
+    write_disk_block(target_inode_block, &target_inode);
+    if (old_block != 0 && dedup->release(old_block)) {
+        boost::lock_guard<boost::mutex> g(free_disk_mutex);
+        free_disk_blocks.insert(old_block);
+    }
+    return true;
+} // Network::write_block_dedup()
+
+void Network::release_file_blocks(const fs_inode &inode, std::vector<uint32_t> &freed) {
+    for (uint32_t i = 0; i < inode.size; ++i) {
+        uint32_t b = inode.blocks[i];
+        if (b != 0 && (!dedup || dedup->release(b))) {
+            freed.push_back(b);
+        }
+    }
+}
 
-        unique_lock write_lock(std::move(lock_info.lock));
-        // Then inode -- We just changed this inode, we have to now write it back
-        disk_writeblock(target_inode_block, &target_inode);
+bool Network::sys_open(request &request, std::string &response) {
+    path_find_info<shared_lock> lock_info;
+    int target_inode_block = path_find(request.path, request.username, &lock_info);
+    if (target_inode_block == -1) {
+        return false;
     }
-    send_all(socket, request.header.data(), request.header.size() + 1);
+
+    fs_inode target_inode;
+    read_inode_block(target_inode_block, target_inode);
+
+    // handles are for reading and writing, so only files, and only the owner's
+    if (target_inode.type != 'f' || std::string_view(target_inode.owner) != request.username) {
+        return false;
+    }
+    std::string handle = handle_of(static_cast<uint32_t>(target_inode_block));
+
+    lock_info.lock.unlock();
+    lock_info.timer.released();
+
+    response.append(request.header.data(), request.header.size() + 1);
+    response.append(handle.data(), handle.size() + 1);
+    return true;
 }
 
-void Network::sys_create(request &request, int socket) {
+bool Network::sys_stat(request &request, std::string &response) {
+    // merge the paths into a trie, so common prefixes are walked once
+    std::vector<std::string> results(request.paths.size(), "-");
+    stat_node root;
+    for (size_t i = 0; i < request.paths.size(); ++i) {
+        path_t path = split_path_ss(request.paths[i], request.paths.get_allocator().resource());
+        if (path.empty() && request.paths[i] != "/") {
+            continue;
+        }
+        stat_node* node = &root;
+        for (const std::pmr::string &name : path) {
+            node = &node->children[std::string(name)];
+        }
+        node->wanted.push_back(i);
+    }
+
+    auto root_mtx = get_inode_mutex_sp(0);
+    lock_timer root_timer;
+    shared_lock root_lock = acquire_profiled<shared_lock>(*root_mtx, root_timer, 0,
+                                                          []() { return std::string_view("/"); });
+    stat_walk(root, 0, request.username, results);
+    root_lock.unlock();
+    root_timer.released();
+
+    if (request.type == FS_STAT && results[0] == "-") {
+        return false;
+    }
+    response.append(request.header.data(), request.header.size() + 1);
+    for (const std::string &result : results) {
+        response.append(result.data(), result.size() + 1);
+    }
+    return true;
+}
+
+void Network::stat_walk(const stat_node &node, uint32_t block, const std::string &user,
+                        std::vector<std::string> &results) {
+    fs_inode inode;
+    read_inode_block(static_cast<int>(block), inode);
+
+    // the same inodes a path walk may pass through, or that the user could read
+    std::string owner(inode.owner);
+    if (owner != user && !owner.empty()) {
+        return;
+    }
+    for (size_t i : node.wanted) {
+        results[i] = std::string(1, inode.type) + " " + std::to_string(inode.size) + " " + owner;
+    }
+    if (node.children.empty() || inode.type != 'd') {
+        return;
+    }
+
+    // one pass over the directory finds every child wanted from it
+    trace_span lookup_span("lookup");
+    lookup_span.set_arg(block);
+    std::vector<std::pair<const std::string*, uint32_t>> found;
+    for (size_t i = 0; i < inode.size && found.size() < node.children.size(); ++i) {
+        fs_direntry entries[FS_DIRENTRIES];
+        read_disk_block(inode.blocks[i], entries);
+        for (const fs_direntry &entry : entries) {
+            if (entry.inode_block == 0) {
+                continue;
+            }
+            auto it = node.children.find(std::string_view(entry.name));
+            if (it != node.children.end()) {
+                found.emplace_back(&it->first, entry.inode_block);
+            }
+        }
+    }
+
+    // children are locked after their parent, like in a path walk
+    for (const auto &[name, child_block] : found) {
+        auto child_mtx = get_inode_mutex_sp(child_block);
+        lock_timer child_timer;
+        shared_lock child_lock = acquire_profiled<shared_lock>(*child_mtx, child_timer, child_block,
+                                                               [name]() { return std::string_view(*name); });
+        stat_walk(node.children.find(*name)->second, child_block, user, results);
+        child_lock.unlock();
+        child_timer.released();
+    }
+} // Network::stat_walk()
+
+bool Network::sys_readdir(request &request, std::string &response) {
+    path_find_info<shared_lock> lock_info;
+    int dir_block = path_find(request.path, request.username, &lock_info);
+    if (dir_block == -1) {
+        return false;
+    }
+
+    fs_inode dir_inode;
+    read_inode_block(dir_block, dir_inode);
+
+    // the same directories a path walk may pass through
+    if (dir_inode.type != 'd' || (std::string_view(dir_inode.owner) != request.username &&
+        std::string_view(dir_inode.owner) != "")) {
+        return false;
+    }
+
+    bool ok = list_directory(dir_inode, request,
+        [this](uint32_t block, fs_direntry* page) {
+            read_disk_block(block, page);
+            return true;
+        },
+        [this, &request](uint32_t child_block, fs_inode &child) {
+            // children are locked after their parent, like in a path walk
+            auto child_mtx = get_inode_mutex_sp(child_block);
+            lock_timer child_timer;
+            shared_lock child_lock = acquire_profiled<shared_lock>(
+                *child_mtx, child_timer, child_block, [&request]() { return std::string_view(request.pathname); });
+            read_inode_block(static_cast<int>(child_block), child);
+            child_lock.unlock();
+            child_timer.released();
+            return true;
+        },
+        response);
+
+    lock_info.lock.unlock();
+    lock_info.timer.released();
+    return ok;
+} // Network::sys_readdir()
+
+template <typename ReadPage, typename ReadChild>
+bool Network::list_directory(const fs_inode &dir_inode, const request &request, ReadPage read_page,
+                             ReadChild read_child, std::string &response) {
+    bool attrs = request.command == "attrs";
+    size_t first_block = request.arg / FS_DIRENTRIES;
+    size_t first_slot  = request.arg % FS_DIRENTRIES;
+    std::string entries;
+    unsigned int count = 0;
+    unsigned long next_cookie = 0;
+    for (size_t i = first_block; i < dir_inode.size && next_cookie == 0; ++i) {
+        fs_direntry page[FS_DIRENTRIES];
+        if (!read_page(dir_inode.blocks[i], page)) {
+            return false;
+        }
+        for (size_t j = (i == first_block ? first_slot : 0); j < FS_DIRENTRIES; ++j) {
+            if (page[j].inode_block == 0) {
+                continue;
+            }
+            // the chunk is full and another entry follows, the next chunk starts there
+            if (count == FS_READDIR_CHUNK) {
+                next_cookie = i * FS_DIRENTRIES + j;
+                break;
+            }
+            std::string entry(page[j].name);
+            if (attrs) {
+                fs_inode child;
+                if (!read_child(page[j].inode_block, child)) {
+                    return false;
+                }
+                std::string owner(child.owner);
+                if (owner == request.username || owner.empty()) {
+                    entry += std::string(" ") + child.type + " " + std::to_string(child.size);
+                } else {
+                    entry += " - 0";
+                }
+            }
+            entries.append(entry.data(), entry.size() + 1);
+            ++count;
+        }
+    }
+
+    std::string chunk_info = std::to_string(next_cookie) + " " + std::to_string(count);
+    response.append(request.header.data(), request.header.size() + 1);
+    response.append(chunk_info.data(), chunk_info.size() + 1);
+    response.append(entries);
+    return true;
+} // Network::list_directory()
+
+bool Network::sys_snapshot(request &request, std::string &response) {
+    std::string name(request.target);
+    bool ok = request.command == "create" ? snapshots.create(name, request.username)
+                                          : snapshots.remove(name, request.username);
+    if (!ok) {
+        return false;
+    }
+    response.append(request.header.data(), request.header.size() + 1);
+    return true;
+}
+
+bool Network::names_snapshot_dir(const request &request) {
+    auto reserved = [](const path_t &path) {
+        return !path.empty() && path.front() == FS_SNAPSHOT_DIR;
+    };
+    if (reserved(request.path) || reserved(request.target_path)) {
+        return true;
+    }
+    if (request.type == FS_CREATE_BATCH && request.pathname == "/") {
+        // "<name> <type>"
+        for (const std::pmr::string &entry : request.paths) {
+            if (entry.compare(0, entry.find(' '), FS_SNAPSHOT_DIR) == 0) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+bool Network::snapshot_read(request &request, std::string &response) {
+    path_t path(std::next(request.path.begin()), request.path.end());
+
+    // "/.snapshots" itself
+    if (path.empty()) {
+        std::vector<std::string> names = snapshots.names();
+        if (request.type == FS_STAT) {
+            std::string result = "d " + std::to_string(names.size()) + " ";
+            response.append(request.header.data(), request.header.size() + 1);
+            response.append(result.data(), result.size() + 1);
+            return true;
+        }
+        if (request.type != FS_READDIR) {
+            return false;
+        }
+        std::string entries;
+        unsigned int count = 0;
+        unsigned long next_cookie = 0;
+        for (size_t i = request.arg; i < names.size(); ++i) {
+            if (count == FS_READDIR_CHUNK) {
+                next_cookie = i;
+                break;
+            }
+            std::string entry = names[i];
+            if (request.command == "attrs") {
+                // a snapshot lists as its root directory
+                fs_inode root;
+                auto snap = snapshots.find(names[i]);
+                if (snap && snapshot_find(*snap, {}, request.username, root) == 0) {
+                    entry += " d " + std::to_string(root.size);
+                } else {
+                    entry += " - 0";
+                }
+            }
+            entries.append(entry.data(), entry.size() + 1);
+            ++count;
+        }
+        std::string chunk_info = std::to_string(next_cookie) + " " + std::to_string(count);
+        response.append(request.header.data(), request.header.size() + 1);
+        response.append(chunk_info.data(), chunk_info.size() + 1);
+        response.append(entries);
+        return true;
+    }
+
+    auto snap = snapshots.find(std::string(path.front()));
+    if (!snap) {
+        return false;
+    }
+    path.pop_front();
+    fs_inode inode;
+    if (snapshot_find(*snap, path, request.username, inode) == -1) {
+        return false;
+    }
+    std::string owner(inode.owner);
+
+    if (request.type == FS_STAT) {
+        if (owner != request.username && !owner.empty()) {
+            return false;
+        }
+        std::string result = std::string(1, inode.type) + " " + std::to_string(inode.size) + " " + owner;
+        response.append(request.header.data(), request.header.size() + 1);
+        response.append(result.data(), result.size() + 1);
+        return true;
+    }
+
+    if (request.type == FS_READDIR) {
+        if (inode.type != 'd' || (owner != request.username && !owner.empty())) {
+            return false;
+        }
+        return list_directory(inode, request,
+            [this, &snap](uint32_t block, fs_direntry* page) {
+                return snapshots.read(*snap, block, page);
+            },
+            [this, &snap](uint32_t child_block, fs_inode &child) {
+                char buf[FS_BLOCKSIZE];
+                if (!snapshots.read(*snap, child_block, buf)) {
+                    return false;
+                }
+                child = *reinterpret_cast<fs_inode*>(buf);
+                return true;
+            },
+            response);
+    }
+
+    // FS_READBLOCK and FS_READLEASE, as read_block()
+    if (inode.type != 'f' || owner != request.username) {
+        return false;
+    }
+    if (request.block >= static_cast<int>(inode.size)) {
+        return false;
+    }
+    char data[FS_BLOCKSIZE];
+    const char* block_data = zero_block;
+    if (inode.blocks[request.block] != 0) {
+        if (!snapshots.read(*snap, inode.blocks[request.block], data)) {
+            return false;
+        }
+        block_data = data;
+    }
+    response.append(request.header.data(), request.header.size() + 1);
+    if (request.type == FS_READLEASE) {
+        // a lease would be cached under the inode block, which a live file may have
+        static constexpr char no_lease[] = "0 0";
+        response.append(no_lease, sizeof(no_lease));
+    }
+    response.append(block_data, FS_BLOCKSIZE);
+    return true;
+} // Network::snapshot_read()
+
+int Network::snapshot_find(const SnapshotTable::snapshot &snap, const path_t &path,
+                           const std::string &user, fs_inode &inode) {
+    auto read_inode = [this, &snap](uint32_t block, fs_inode &out) {
+        char buf[FS_BLOCKSIZE];
+        if (!snapshots.read(snap, block, buf)) {
+            return false;
+        }
+        out = *reinterpret_cast<fs_inode*>(buf);
+        return true;
+    };
+
+    uint32_t block = 0;
+    if (!read_inode(block, inode)) {
+        return -1;
+    }
+    for (const std::pmr::string &name : path) {
+        // the same checks as path_find()
+        std::string owner(inode.owner);
+        if (inode.type != 'd' || (owner != user && !owner.empty())) {
+            return -1;
+        }
+        dir_scan_key key(name);
+        int child_block = -1;
+        for (uint32_t i = 0; i < inode.size && child_block == -1; ++i) {
+            fs_direntry entries[FS_DIRENTRIES];
+            if (!snapshots.read(snap, inode.blocks[i], entries)) {
+                return -1;
+            }
+            dir_page_scan page = scan_dir_page(entries, key);
+            if (page.match != -1) {
+                child_block = static_cast<int>(entries[page.match].inode_block);
+            }
+        }
+        if (child_block == -1) {
+            return -1;
+        }
+        block = static_cast<uint32_t>(child_block);
+        if (!read_inode(block, inode)) {
+            return -1;
+        }
+    }
+    return static_cast<int>(block);
+} // Network::snapshot_find()
+
+bool Network::sys_create(request &request, std::string &response) {
+    fs_inode new_inode{};
+    new_inode.type = request.create_type; // f or d
+    std::strncpy(new_inode.owner, request.username.c_str(), FS_MAXUSERNAME); // ensure its null terminated
+    new_inode.owner[FS_MAXUSERNAME] = '\0';
+    new_inode.size = 0;
+    if (!create_entry(request.path, request.pathname, request.username, new_inode)) {
+        return false;
+    }
+    response.append(request.header.data(), request.header.size() + 1);
+    return true;
+}
+
+bool Network::create_entry(path_t &path, std::string_view pathname, std::string &user,
+                           const fs_inode &new_inode) {
     // the new file/directory
-    std::string new_name = request.path.back();
-    request.path.pop_back();
+    std::string new_name(path.back());
+    path.pop_back();
 
     path_find_info<upgrade_lock> parent_lm;
-    int parent_inode_block = path_find_upgrade(request.path, request.username, &parent_lm);
+    int parent_inode_block = path_find_upgrade(path, user, &parent_lm);
     // path does not exist
     if (parent_inode_block == -1) {
-        return;
+        return false;
     }
 
     fs_inode parent_inode;
     read_inode_block(parent_inode_block, parent_inode);
     // cant make a new file or directory in a file -- not the owner and not the root
-    if (parent_inode.type != 'd' || (std::string(parent_inode.owner) != request.username && 
-        std::string(parent_inode.owner) != "")) {
-        return;
+    if (parent_inode.type != 'd' || (std::string_view(parent_inode.owner) != user && 
+        std::string_view(parent_inode.owner) != "")) {
+        return false;
     }
     create_scan_info scan = scan_directory_for_create(parent_inode, new_name);
+    auto parent_path = [&pathname]() { return parent_of(pathname); };
 
     // should not exist already exist
     if (scan.exists) {
-        return; 
+        return false; 
     }
 
     bool found = scan.has_open_entry;  // if we found an open entry
@@ -290,12 +1032,12 @@ void Network::sys_create(request &request, int socket) {
     } else {
         // already at max size
         if(parent_inode.size >= FS_MAXFILEBLOCKS) {
-            return;
+            return false;
         }
         // get new block for new dir page
         int next_block = get_new_block();
         if (next_block == -1){
-            return; // failure
+            return false; // failure
         }
         new_dir_block = static_cast<uint32_t>(next_block);
         slot_block = parent_inode.size;
@@ -313,38 +1055,237 @@ void Network::sys_create(request &request, int socket) {
             boost::lock_guard<boost::mutex> g(free_disk_mutex);
             free_disk_blocks.insert(new_dir_block);
         }
-        return; // faliure so we must return the block we took 
-    } 
-    uint32_t new_inode_block = static_cast<uint32_t>(b);
+        return false; // faliure so we must return the block we took 
+    } 
+    uint32_t new_inode_block = static_cast<uint32_t>(b);
+
+    // write the new inode FIRST ensures proper ordering
+    write_disk_block(new_inode_block, &new_inode);
+    // nobody can reach the new inode before its direntry is written
+    inode_generation[new_inode_block].store(new_generation(), std::memory_order_relaxed);
+
+    // fill in the direntry
+    std::strncpy(entries[slot_offset].name, new_name.c_str(), FS_MAXFILENAME);
+    entries[slot_offset].name[FS_MAXFILENAME] = '\0';
+    entries[slot_offset].inode_block = new_inode_block; 
+
+    // if we got a new direntry block, update the parent
+    if (!found) {
+        // everything went well we can write the pointer
+        parent_inode.blocks[slot_block] = new_dir_block;
+        parent_inode.size++;
+        write_disk_block(dir_data_block, write_buf);
+        unique_lock parent_write_lock = acquire_profiled<unique_lock>(std::move(parent_lm.lock), parent_lm.timer,
+                                                                      parent_inode_block, parent_path);
+        write_disk_block(parent_inode_block, &parent_inode);
+    } else {
+        unique_lock parent_write_lock = acquire_profiled<unique_lock>(std::move(parent_lm.lock), parent_lm.timer,
+                                                                      parent_inode_block, parent_path);
+        write_disk_block(dir_data_block, write_buf);
+    }
+    return true;
+} // Network::create_entry()
+
+bool Network::sys_copy(request &request, std::string &response) {
+    path_find_info<shared_lock> source_lm;
+    int source_block = path_find(request.path, request.username, &source_lm);
+    if (source_block == -1) {
+        return false;
+    }
+
+    fs_inode source_inode;
+    read_inode_block(source_block, source_inode);
+    if (source_inode.type != 'f' || std::string_view(source_inode.owner) != request.username) {
+        return false;
+    }
+
+    fs_inode new_inode{};
+    new_inode.type = 'f';
+    std::strncpy(new_inode.owner, request.username.c_str(), FS_MAXUSERNAME);
+    new_inode.owner[FS_MAXUSERNAME] = '\0';
+    new_inode.size = source_inode.size;
+
+    if (dedup) {
+        // the copy shares the source's blocks; they are referenced before a writer to the source can change them
+        std::copy(source_inode.blocks, source_inode.blocks + source_inode.size, new_inode.blocks);
+        for (uint32_t i = 0; i < source_inode.size; ++i) {
+            if (source_inode.blocks[i] != 0) {
+                dedup->ref(source_inode.blocks[i]);
+            }
+        }
+        source_lm.lock.unlock();
+        source_lm.timer.released();
+        if (!create_entry(request.target_path, request.target, request.username, new_inode)) {
+            std::vector<uint32_t> freed;
+            release_file_blocks(new_inode, freed);
+            free_blocks(freed);
+            return false;
+        }
+        response.append(request.header.data(), request.header.size() + 1);
+        return true;
+    }
+
+    // the whole file is read under the shared lock, so the copy is of one version of it; holes stay holes
+    std::vector<char> data;
+    for (uint32_t i = 0; i < source_inode.size; ++i) {
+        if (source_inode.blocks[i] != 0) {
+            data.resize(data.size() + FS_BLOCKSIZE);
+            read_disk_block(source_inode.blocks[i], data.data() + data.size() - FS_BLOCKSIZE);
+        }
+    }
+    source_lm.lock.unlock();
+    source_lm.timer.released();
+
+    // the data goes in ascending blocks, one run if there is one, before anything can reach them
+    std::vector<uint32_t> blocks;
+    if (!get_new_run(data.size() / FS_BLOCKSIZE, blocks)) {
+        return false;
+    }
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        write_disk_block(blocks[i], data.data() + i * FS_BLOCKSIZE);
+    }
+
+    for (uint32_t i = 0, next = 0; i < source_inode.size; ++i) {
+        new_inode.blocks[i] = source_inode.blocks[i] != 0 ? blocks[next++] : 0;
+    }
+    if (!create_entry(request.target_path, request.target, request.username, new_inode)) {
+        free_blocks(blocks);
+        return false;
+    }
+    response.append(request.header.data(), request.header.size() + 1);
+    return true;
+} // Network::sys_copy()
+
+
+ /*
+  * 1. Grab upgradable lock for the directory and read it
+  * 2. Scan its pages once for the names taken and the open slots
+  * 3. Grab every new inode and directory block in one allocation
+  * 4. Write the new inodes, then the new directory blocks
+  * 5. Upgrade to a unique lock, write the changed pages and the parent inode
+  * 6. Send a result per entry
+ */
+bool Network::sys_create_batch(request &request, std::string &response) {
+    path_find_info<upgrade_lock> parent_lm;
+    int parent_inode_block = path_find_upgrade(request.path, request.username, &parent_lm);
+    if (parent_inode_block == -1) {
+        return false;
+    }
+
+    fs_inode parent_inode;
+    read_inode_block(parent_inode_block, parent_inode);
+    if (parent_inode.type != 'd' || (std::string_view(parent_inode.owner) != request.username &&
+        std::string_view(parent_inode.owner) != "")) {
+        return false;
+    }
+
+    // one scan of the parent finds the names taken and every open slot
+    std::vector<std::array<fs_direntry, FS_DIRENTRIES>> pages(parent_inode.size);
+    std::set<std::string> taken;
+    std::vector<std::pair<uint32_t, uint32_t>> open_slots;       // (blocks[] index, slot)
+    {
+        trace_span lookup_span("lookup", parent_inode_block);
+        for (uint32_t i = 0; i < parent_inode.size; ++i) {
+            read_disk_block(parent_inode.blocks[i], pages[i].data());
+            for (uint32_t j = 0; j < FS_DIRENTRIES; ++j) {
+                if (pages[i][j].inode_block == 0) {
+                    open_slots.emplace_back(i, j);
+                } else {
+                    taken.emplace(pages[i][j].name);
+                }
+            }
+        }
+    }
+
+    // "<name> <type>", each name at most once
+    std::vector<std::string> results(request.paths.size(), "-1");
+    std::vector<size_t> accepted;
+    std::vector<std::string> names(request.paths.size());
+    for (size_t i = 0; i < request.paths.size(); ++i) {
+        const std::pmr::string &item = request.paths[i];
+        size_t space = item.find(' ');
+        if (space == std::string::npos || space == 0 || space > FS_MAXFILENAME || item.size() != space + 2
+            || (item[space + 1] != 'f' && item[space + 1] != 'd')) {
+            continue;
+        }
+        names[i] = item.substr(0, space);
+        if (names[i].find('/') != std::string::npos || has_space(names[i]) || !taken.insert(names[i]).second) {
+            continue;
+        }
+        accepted.push_back(i);
+    }
 
-    // Craete the new inode then write it FIRST ensures proper ordering
-    fs_inode new_inode{};
-    new_inode.type = request.create_type; // f or d
-    std::strncpy(new_inode.owner, request.username.c_str(), FS_MAXUSERNAME); // ensure its null terminated
-    new_inode.owner[FS_MAXUSERNAME] = '\0';
-    new_inode.size = 0;
-    disk_writeblock(new_inode_block, &new_inode);
+    // entries that fit in neither an open slot nor a directory block the parent has room for fail
+    size_t new_pages = 0;
+    if (accepted.size() > open_slots.size()) {
+        new_pages = std::min<size_t>((accepted.size() - open_slots.size() + FS_DIRENTRIES - 1) / FS_DIRENTRIES,
+                                     FS_MAXFILEBLOCKS - parent_inode.size);
+        accepted.resize(std::min(accepted.size(), open_slots.size() + new_pages * FS_DIRENTRIES));
+    }
 
-    // fill in the direntry
-    std::strncpy(entries[slot_offset].name, new_name.c_str(), FS_MAXFILENAME);
-    entries[slot_offset].name[FS_MAXFILENAME] = '\0';
-    entries[slot_offset].inode_block = new_inode_block; 
+    // every inode and directory block in one allocation, or the whole batch fails
+    std::vector<uint32_t> blocks;
+    if (!accepted.empty() && !get_new_blocks(accepted.size() + new_pages, blocks)) {
+        accepted.clear();
+        new_pages = 0;
+    }
+    for (size_t k = 0; k < new_pages; ++k) {
+        open_slots.emplace_back(parent_inode.size + k, 0);
+        for (uint32_t j = 1; j < FS_DIRENTRIES; ++j) {
+            open_slots.emplace_back(parent_inode.size + k, j);
+        }
+        pages.emplace_back();
+        std::memset(pages.back().data(), 0, FS_BLOCKSIZE);
+    }
 
-    // if we got a new direntry block, update the parent
-    if (!found) {
-        // everything went well we can write the pointer
-        parent_inode.blocks[slot_block] = new_dir_block;
-        parent_inode.size++;
-        disk_writeblock(dir_data_block, write_buf);
-        unique_lock parent_write_lock(std::move(parent_lm.lock));
-        disk_writeblock(parent_inode_block, &parent_inode);
-    } else {
-        unique_lock parent_write_lock(std::move(parent_lm.lock));
-        disk_writeblock(dir_data_block, write_buf);
+    // inodes FIRST, like sys_create(), then each directory page once with all of its new entries
+    std::vector<bool> dirty(pages.size(), false);
+    for (size_t k = 0; k < accepted.size(); ++k) {
+        size_t i = accepted[k];
+        uint32_t new_inode_block = blocks[new_pages + k];
+        fs_inode new_inode{};
+        new_inode.type = request.paths[i].back();
+        std::strncpy(new_inode.owner, request.username.c_str(), FS_MAXUSERNAME);
+        new_inode.owner[FS_MAXUSERNAME] = '\0';
+        new_inode.size = 0;
+        write_disk_block(new_inode_block, &new_inode);
+        // nobody can reach the new inode before its direntry is written
+        inode_generation[new_inode_block].store(new_generation(), std::memory_order_relaxed);
+
+        auto [page, slot] = open_slots[k];
+        std::strncpy(pages[page][slot].name, names[i].c_str(), FS_MAXFILENAME);
+        pages[page][slot].name[FS_MAXFILENAME] = '\0';
+        pages[page][slot].inode_block = new_inode_block;
+        dirty[page] = true;
+        results[i] = "0";
     }
 
-    send_all(socket, request.header.data(), request.header.size() + 1);
-}
+    // new directory blocks are not reachable until the parent inode is written
+    for (size_t k = 0; k < new_pages; ++k) {
+        parent_inode.blocks[parent_inode.size] = blocks[k];
+        write_disk_block(blocks[k], pages[parent_inode.size].data());
+        ++parent_inode.size;
+    }
+    if (!accepted.empty()) {
+        auto parent_path = [&request]() { return std::string_view(request.pathname); };
+        unique_lock parent_write_lock = acquire_profiled<unique_lock>(std::move(parent_lm.lock), parent_lm.timer,
+                                                                      parent_inode_block, parent_path);
+        for (size_t p = 0; p + new_pages < pages.size(); ++p) {
+            if (dirty[p]) {
+                write_disk_block(parent_inode.blocks[p], pages[p].data());
+            }
+        }
+        if (new_pages > 0) {
+            write_disk_block(parent_inode_block, &parent_inode);
+        }
+    }
+
+    response.append(request.header.data(), request.header.size() + 1);
+    for (const std::string &result : results) {
+        response.append(result.data(), result.size() + 1);
+    }
+    return true;
+} // Network::sys_create_batch()
 
 
  /*
@@ -361,9 +1302,9 @@ void Network::sys_create(request &request, int socket) {
   * 11. Send all 
   * 
  */
-void Network::sys_delete(request &request, int socket) {
+bool Network::sys_delete(request &request, std::string &response) {
     // the file/directory to delete
-    std::string target_file = request.path.back();
+    std::string target_file(request.path.back());
     request.path.pop_back();
 
     path_find_info<upgrade_lock> parent_lm;
@@ -371,155 +1312,340 @@ void Network::sys_delete(request &request, int socket) {
 
     // path does not exist
     if (parent_inode_block == -1) {
-        return;
+        return false;
     }
 
     fs_inode parent_inode;
     read_inode_block(parent_inode_block, parent_inode);
 
     // not directory or not proper owner ship
-    if (parent_inode.type != 'd' || (std::string(parent_inode.owner) != request.username && 
-        std::string(parent_inode.owner) != "")) {
-        return;
+    if (parent_inode.type != 'd' || (std::string_view(parent_inode.owner) != request.username && 
+        std::string_view(parent_inode.owner) != "")) {
+        return false;
     }
 
     delete_scan_info scan = scan_directory_for_delete(parent_inode, target_file);
+    auto parent_path = [&request]() { return parent_of(request.pathname); };
+    auto target_path = [&request]() { return std::string_view(request.pathname); };
 
     // target does not exist
     if(!scan.found) {
-        return; 
+        return false; 
     }
     
     int target_inode_block = scan.inode_block;
     // aquire write lock for the target
     auto target_mtx_sp = get_inode_mutex_sp(static_cast<uint32_t>(target_inode_block));
 
-    unique_lock parent_write_lock(std::move(parent_lm.lock));
-    upgrade_lock target_up_lock(*target_mtx_sp);
+    // clients caching the target must stop using it before it goes away
+    LeaseTable::recall_guard recall = leases.recall(static_cast<uint32_t>(target_inode_block));
+    unique_lock parent_write_lock = acquire_profiled<unique_lock>(std::move(parent_lm.lock), parent_lm.timer,
+                                                                      parent_inode_block, parent_path);
+    lock_timer target_timer;
+    upgrade_lock target_up_lock = acquire_profiled<upgrade_lock>(*target_mtx_sp, target_timer,
+                                                                 target_inode_block, target_path);
 
     fs_inode target_inode;
     read_inode_block(target_inode_block, target_inode);
 
     // need proper ownership
-    if ((std::string(target_inode.owner) != request.username)) {
-        return;
+    if ((std::string_view(target_inode.owner) != request.username)) {
+        return false;
     }
 
     // ensure that this file exist OR it is an empty directory
     if (target_inode.type == 'd' && target_inode.size > 0) {
-        return;
+        return false;
     }
 
-    // If its the last direntry also free that direntry block and send that blocks entry to = 0
-    if (!scan.only_entry) {
-        scan.dir_page[scan.dir_offset].inode_block = 0;
-        scan.dir_page[scan.dir_offset].name[0] = '\0';
-        disk_writeblock(scan.dir_block, scan.dir_page);
-        parent_write_lock.unlock();
-    } else {
-        // Delete compression
-        for(uint32_t i = static_cast<uint32_t>(scan.parent_blocks_idx); i + 1 < parent_inode.size; ++i) {
-            parent_inode.blocks[i] = parent_inode.blocks[i + 1];
-        }
-        --parent_inode.size;
-        disk_writeblock(parent_inode_block, &parent_inode);
-        parent_write_lock.unlock();
-
-        {
-            boost::lock_guard<boost::mutex> g(free_disk_mutex);
-            free_disk_blocks.insert(static_cast<uint32_t>(scan.dir_block));
-        }
+    int freed_dir_block = unlink_direntry(parent_inode_block, parent_inode, scan);
+    parent_write_lock.unlock();
+    parent_lm.timer.released();
+    if (freed_dir_block != -1) {
+        boost::lock_guard<boost::mutex> g(free_disk_mutex);
+        free_disk_blocks.insert(static_cast<uint32_t>(freed_dir_block));
     }
 
     // need to free the files blocks 
     {
-        unique_lock target_write_lock(std::move(target_up_lock));
-        boost::lock_guard<boost::mutex> g(free_disk_mutex);
-        for(uint32_t i = 0; i < target_inode.size; ++i) {
-            uint32_t b = target_inode.blocks[i];
-            if (b != 0) {
-                free_disk_blocks.insert(b);
-            }
-        }
+        unique_lock target_write_lock = acquire_profiled<unique_lock>(std::move(target_up_lock), target_timer,
+                                                                          target_inode_block, target_path);
+        // handles to it stop working, even once the block is reused
+        inode_generation[target_inode_block].store(0, std::memory_order_relaxed);
+        // an empty directory has no blocks, so these are all file blocks
+        std::vector<uint32_t> freed;
+        release_file_blocks(target_inode, freed);
         // mark the target block as free
-        free_disk_blocks.insert(target_inode_block);
+        freed.push_back(static_cast<uint32_t>(target_inode_block));
+        free_blocks(freed);
     }
 
     
     // only have to send back the request message
-    send_all(socket, request.header.data(), request.header.size() + 1);
+    response.append(request.header.data(), request.header.size() + 1);
+    return true;
 } 
 
-int Network::find_child(const fs_inode &dir_node, const std::string &name) {
+bool Network::sys_delete_tree(request &request, std::string &response) {
+    // the root of the subtree to delete
+    std::string target_name(request.path.back());
+    request.path.pop_back();
+
+    path_find_info<upgrade_lock> parent_lm;
+    int parent_inode_block = path_find_upgrade(request.path, request.username, &parent_lm);
+    if (parent_inode_block == -1) {
+        return false;
+    }
+
+    fs_inode parent_inode;
+    read_inode_block(parent_inode_block, parent_inode);
+    if (parent_inode.type != 'd' || (std::string_view(parent_inode.owner) != request.username &&
+        std::string_view(parent_inode.owner) != "")) {
+        return false;
+    }
+
+    delete_scan_info scan = scan_directory_for_delete(parent_inode, target_name);
+    if (!scan.found) {
+        return false;
+    }
+
+    uint32_t root_block = static_cast<uint32_t>(scan.inode_block);
+    // clients caching any file in the tree must stop using it before it goes away, and the recall must not
+    // wait while this holds locks in the tree
+    std::vector<uint32_t> recalled;
+    std::vector<LeaseTable::recall_guard> recalls;
+    {
+        std::vector<subtree_node<shared_lock>> readers;
+        if (!lock_subtree(root_block, request, readers)) {
+            return false;
+        }
+        for (const subtree_node<shared_lock> &node : readers) {
+            if (node.inode.type == 'f') {
+                recalled.push_back(node.block);
+            }
+        }
+    }
+    std::sort(recalled.begin(), recalled.end());
+    for (uint32_t block : recalled) {
+        recalls.push_back(leases.recall(block));
+    }
+
+    // with the parent unique no new path walk enters the tree, and the ones already in it only wait on inodes
+    // below the ones they hold, so locking the tree top down never waits on a walk that waits on this
+    auto parent_path = [&request]() { return parent_of(request.pathname); };
+    unique_lock parent_write_lock = acquire_profiled<unique_lock>(std::move(parent_lm.lock), parent_lm.timer,
+                                                                  parent_inode_block, parent_path);
+    // every inode is locked and checked again before anything changes, so a failed delete leaves the tree as it was
+    std::vector<subtree_node<unique_lock>> nodes;
+    if (!lock_subtree(root_block, request, nodes)) {
+        return false;
+    }
+    for (const subtree_node<unique_lock> &node : nodes) {
+        // created since the check, its leases can only have been granted before the lock was taken
+        if (node.inode.type == 'f' && !std::binary_search(recalled.begin(), recalled.end(), node.block)) {
+            recalls.push_back(leases.recall(node.block));
+        }
+    }
+
+    // one write to the parent detaches the whole tree, nothing in it has to be written
+    std::vector<uint32_t> freed;
+    int freed_dir_block = unlink_direntry(parent_inode_block, parent_inode, scan);
+    if (freed_dir_block != -1) {
+        freed.push_back(static_cast<uint32_t>(freed_dir_block));
+    }
+    parent_write_lock.unlock();
+    parent_lm.timer.released();
+
+    for (const subtree_node<unique_lock> &node : nodes) {
+        // handles to it stop working, even once the block is reused
+        inode_generation[node.block].store(0, std::memory_order_relaxed);
+        if (node.inode.type == 'f') {
+            release_file_blocks(node.inode, freed);
+        } else {
+            freed.insert(freed.end(), node.inode.blocks, node.inode.blocks + node.inode.size);
+        }
+        freed.push_back(node.block);
+    }
+    free_blocks(freed);
+
+    response.append(request.header.data(), request.header.size() + 1);
+    return true;
+} // Network::sys_delete_tree()
+
+template <typename LockT>
+bool Network::lock_subtree(uint32_t root_block, const request &request, std::vector<subtree_node<LockT>> &nodes) {
+    auto target_path = [&request]() { return std::string_view(request.pathname); };
+    // nodes[i] is locked before its children are found, so every inode is locked after its parent
+    std::vector<uint32_t> pending{root_block};
+    while (!pending.empty()) {
+        uint32_t block = pending.back();
+        pending.pop_back();
+
+        nodes.emplace_back();
+        subtree_node<LockT> &node = nodes.back();
+        node.block = block;
+        node.lm.mtx_sp = get_inode_mutex_sp(block);
+        node.lm.lock = acquire_profiled<LockT>(*node.lm.mtx_sp, node.lm.timer, block, target_path);
+        read_inode_block(static_cast<int>(block), node.inode);
+
+        // the same check FS_DELETE makes of its target, for every inode in the tree
+        if (std::string_view(node.inode.owner) != request.username) {
+            return false;
+        }
+        if (node.inode.type != 'd') {
+            continue;
+        }
+        trace_span lookup_span("lookup");
+        lookup_span.set_arg(block);
+        for (uint32_t i = 0; i < node.inode.size; ++i) {
+            fs_direntry entries[FS_DIRENTRIES];
+            read_disk_block(node.inode.blocks[i], entries);
+            for (const fs_direntry &entry : entries) {
+                if (entry.inode_block != 0) {
+                    pending.push_back(entry.inode_block);
+                }
+            }
+        }
+    }
+    return true;
+} // Network::lock_subtree()
+
+int Network::unlink_direntry(int parent_inode_block, fs_inode &parent_inode, delete_scan_info &scan) {
+    // If its the last direntry also free that direntry block and send that blocks entry to = 0
+    if (!scan.only_entry) {
+        scan.dir_page[scan.dir_offset].inode_block = 0;
+        scan.dir_page[scan.dir_offset].name[0] = '\0';
+        write_disk_block(scan.dir_block, scan.dir_page);
+        return -1;
+    }
+    // Delete compression
+    for(uint32_t i = static_cast<uint32_t>(scan.parent_blocks_idx); i + 1 < parent_inode.size; ++i) {
+        parent_inode.blocks[i] = parent_inode.blocks[i + 1];
+    }
+    --parent_inode.size;
+    write_disk_block(parent_inode_block, &parent_inode);
+    return scan.dir_block;
+}
+
+bool Network::sys_stats(request &request, std::string &response) {
+    size_t free_blocks = 0;
+    {
+        boost::lock_guard<boost::mutex> g(free_disk_mutex);
+        free_blocks = free_disk_blocks.size();
+    }
+    std::ostringstream os;
+    Metrics::instance().render(os, free_blocks);
+    admission->render(os);
+    if (dedup) {
+        dedup->render(os);
+    }
+    if (replication) {
+        replication->render(os);
+    }
+    if (replica) {
+        replica->render(os);
+    }
+    snapshots.render(os);
+    if (defrag) {
+        defrag->render(os);
+    }
+    std::string text = os.str();
+
+    response.append(request.header.data(), request.header.size() + 1);
+    response.append(text.c_str(), text.size() + 1);
+    return true;
+}
+
+bool Network::sys_lockprof(request &request, std::string &response) {
+    LockProfiler &profiler = LockProfiler::instance();
+    std::ostringstream os;
+    if (request.command == "sample") {
+        profiler.set_sample_rate(static_cast<unsigned int>(request.arg));
+        os << "# sample_rate " << profiler.sample_rate() << "\n";
+    } else if (request.command == "reset") {
+        profiler.reset();
+        os << "# sample_rate " << profiler.sample_rate() << "\n";
+    } else {
+        profiler.render(os, request.arg);
+    }
+    std::string text = os.str();
+
+    response.append(request.header.data(), request.header.size() + 1);
+    response.append(text.c_str(), text.size() + 1);
+    return true;
+}
+
+bool Network::sys_trace(request &request, std::string &response) {
+    Tracer &tracer = Tracer::instance();
+    std::ostringstream os;
+    if (request.command == "sample") {
+        tracer.set_sample_permille(static_cast<unsigned int>(request.arg));
+        os << "sample_permille " << tracer.sample_permille() << "\n";
+    } else {
+        tracer.export_json(os);
+    }
+    std::string text = os.str();
+
+    response.append(request.header.data(), request.header.size() + 1);
+    response.append(text.c_str(), text.size() + 1);
+    return true;
+}
+
+int Network::find_child(const fs_inode &dir_node, std::string_view name) {
+    dir_scan_key key(name);
     for (uint32_t i = 0; i < dir_node.size; ++i) {
         uint32_t block = dir_node.blocks[i];
         fs_direntry entries[FS_DIRENTRIES];
-        disk_readblock(block, entries);
+        read_disk_block(block, entries);
 
-        for (size_t j = 0; j < FS_DIRENTRIES; ++j) {
-            fs_direntry &de = entries[j];
-            if (de.inode_block == 0) continue;
-            if (std::string(de.name) == name) {
-                return de.inode_block;
-            }
+        dir_page_scan page = scan_dir_page(entries, key);
+        if (page.match != -1) {
+            return entries[page.match].inode_block;
         }
     }
     return -1;
 }
 
-Network::create_scan_info Network::scan_directory_for_create(const fs_inode &parent_inode, const std::string &name) {
+Network::create_scan_info Network::scan_directory_for_create(const fs_inode &parent_inode, std::string_view name) {
     create_scan_info res;
+    dir_scan_key key(name);
     for (uint32_t i = 0; i < parent_inode.size; ++i) {
         uint32_t block = parent_inode.blocks[i];
         fs_direntry entries[FS_DIRENTRIES];
-        disk_readblock(block, entries);
-
-        for (size_t j = 0; j < FS_DIRENTRIES; ++j) {
-            fs_direntry &de = entries[j];
-            if (de.inode_block == 0) {
-                if (!res.has_open_entry) {
-                    res.has_open_entry         = true;
-                    res.open_parent_blocks_idx = static_cast<int>(i);
-                    res.open_dir_offset        = static_cast<int>(j);
-                    std::memcpy(res.open_dir_page, entries, FS_BLOCKSIZE);
-                }
-                continue;
-            }
-            if (std::string(de.name) == name) {
-                res.exists = true;
-                return res;
-            }
+        read_disk_block(block, entries);
+
+        dir_page_scan page = scan_dir_page(entries, key);
+        if (page.match != -1) {
+            res.exists = true;
+            return res;
+        }
+        if (page.first_free != -1 && !res.has_open_entry) {
+            res.has_open_entry         = true;
+            res.open_parent_blocks_idx = static_cast<int>(i);
+            res.open_dir_offset        = page.first_free;
+            std::memcpy(res.open_dir_page, entries, FS_BLOCKSIZE);
         }
     }
     return res;  
 }
 
-Network::delete_scan_info Network::scan_directory_for_delete(const fs_inode &parent_inode, const std::string &name){
+Network::delete_scan_info Network::scan_directory_for_delete(const fs_inode &parent_inode, std::string_view name){
     delete_scan_info res;
+    dir_scan_key key(name);
     for (uint32_t i = 0; i < parent_inode.size; ++i) {
         uint32_t block = parent_inode.blocks[i];
         fs_direntry entries[FS_DIRENTRIES];
-        disk_readblock(block, entries);
-
-        int count        = 0;
-        int target_block = -1;
-        for (size_t j = 0; j < FS_DIRENTRIES; ++j) {
-            const fs_direntry &de = entries[j];
-            if (de.inode_block == 0) continue;
-            ++count;
-            if (!res.found && std::string(de.name) == name) {
-                res.found = true;
-                res.inode_block       = static_cast<int>(de.inode_block);
-                res.parent_blocks_idx = static_cast<int>(i);
-                res.dir_block         = static_cast<int>(block);
-                std::memcpy(res.dir_page, entries, FS_BLOCKSIZE);      
-                res.dir_offset        = static_cast<int>(j);
-                target_block          = static_cast<int>(j);
-            }
-        }
-
-        if (res.found && target_block != -1) {
-            res.only_entry = (count == 1);
+        read_disk_block(block, entries);
+
+        dir_page_scan page = scan_dir_page(entries, key);
+        if (page.match != -1) {
+            res.found = true;
+            res.inode_block       = static_cast<int>(entries[page.match].inode_block);
+            res.parent_blocks_idx = static_cast<int>(i);
+            res.dir_block         = static_cast<int>(block);
+            std::memcpy(res.dir_page, entries, FS_BLOCKSIZE);      
+            res.dir_offset        = page.match;
+            res.only_entry        = (page.live == 1);
             return res;
         }
     }
@@ -527,30 +1653,40 @@ Network::delete_scan_info Network::scan_directory_for_delete(const fs_inode &par
 }
 
 template <typename LockT>
-int Network::path_find_impl(std::deque<std::string> &path, std::string &user, path_find_info<LockT>* out_info) {
+int Network::path_find_impl(path_t &path, std::string &user, path_find_info<LockT>* out_info) {
 
     // if path is empty is looking for the root
     if (path.empty()){
         auto root_mtx = get_inode_mutex_sp(0);
-        LockT tmp(*root_mtx);
+        out_info->lock = acquire_profiled<LockT>(*root_mtx, out_info->timer, 0, []() { return std::string_view("/"); });
         out_info->mtx_sp = std::move(root_mtx);
-        out_info->lock = std::move(tmp);
         return 0;
     }
     uint32_t curr_block = 0;
 
+    // the path walked so far, only kept while the contention profiler is on
+    bool profiling = LockProfiler::instance().enabled();
+    std::string walked;
+    auto walked_fn = [&walked]() { return std::string_view(walked); };
+
     // need to first acquire the lock for the root
     auto curr_mtx_sp = get_inode_mutex_sp(curr_block);
-    inode_read_block walker(*curr_mtx_sp);
+    inode_read_block walker(*curr_mtx_sp, curr_block, []() { return std::string_view("/"); });
     while(!path.empty()){
-        std::string target = path.front();
+        // moved, so the name stays in the request's arena
+        std::pmr::string target = std::move(path.front());
         path.pop_front();
+        if (profiling) {
+            walked += '/';
+            walked += target;
+        }
+        trace_span lookup_span("lookup");
 
         fs_inode curr_inode;
         read_inode_block(curr_block, curr_inode);
 
         // if we are still looking for our target it should be a directory and we shoudl have permmission
-        if (curr_inode.type != 'd' || ((std::string(curr_inode.owner) != user) && std::string(curr_inode.owner) != "")) { 
+        if (curr_inode.type != 'd' || ((std::string_view(curr_inode.owner) != user) && std::string_view(curr_inode.owner) != "")) { 
             return -1;
         }
         int child_block = find_child(curr_inode, target);
@@ -558,15 +1694,16 @@ int Network::path_find_impl(std::deque<std::string> &path, std::string &user, pa
         if (child_block == -1) {
             return -1;
         }
+        lookup_span.set_arg(child_block);
 
         auto child_mtx_sp = get_inode_mutex_sp(static_cast<uint32_t>(child_block));
         // hand over hand locking
         if (!path.empty()) {
-            walker.hand_over(*child_mtx_sp);
+            walker.hand_over(*child_mtx_sp, static_cast<uint32_t>(child_block), walked_fn);
             curr_mtx_sp = std::move(child_mtx_sp);
         } else {
-            LockT final_lock(*child_mtx_sp);
-            out_info->lock = std::move(final_lock);
+            out_info->lock = acquire_profiled<LockT>(*child_mtx_sp, out_info->timer,
+                                                     static_cast<uint32_t>(child_block), walked_fn);
             out_info->mtx_sp = std::move(child_mtx_sp); // move lock to caller
         }
         curr_block = static_cast<uint32_t>(child_block);
@@ -575,31 +1712,113 @@ int Network::path_find_impl(std::deque<std::string> &path, std::string &user, pa
     return static_cast<int>(curr_block);
 }
     
-int Network::path_find(std::deque<std::string> &path, std::string &user, path_find_info<shared_lock>* out_info) {
+int Network::path_find(path_t &path, std::string &user, path_find_info<shared_lock>* out_info) {
     return path_find_impl<shared_lock>(
         path, user, out_info
     );
 }
 
-int Network::path_find_upgrade(std::deque<std::string> &path, std::string &user, path_find_info<upgrade_lock>* out_info) {
+int Network::path_find_upgrade(path_t &path, std::string &user, path_find_info<upgrade_lock>* out_info) {
     return path_find_impl<upgrade_lock>(
         path, user, out_info
     );
 }
 
-void Network::send_all(int sockfd, const void* buf, size_t len) {
+template <typename LockT>
+int Network::handle_find(const request &request, path_find_info<LockT>* out_info) {
+    uint32_t block = request.inode_block;
+    auto mtx_sp = get_inode_mutex_sp(block);
+    trace_span lookup_span("lookup");
+    lookup_span.set_arg(block);
+    out_info->lock = acquire_profiled<LockT>(*mtx_sp, out_info->timer, block,
+                                             [&request]() { return std::string_view(request.pathname); });
+    out_info->mtx_sp = std::move(mtx_sp);
+    // 0 never matches, it marks blocks that are not inodes
+    if (inode_generation[block].load(std::memory_order_relaxed) != request.generation) {
+        return -1;
+    }
+    return static_cast<int>(block);
+}
+
+std::string Network::handle_of(uint32_t inode_block) {
+    return std::to_string(inode_block) + "." +
+           std::to_string(inode_generation[inode_block].load(std::memory_order_relaxed));
+}
+
+uint64_t Network::new_generation() {
+    static thread_local std::mt19937_64 rng(std::random_device{}());
+    // at most 19 digits and never 0, see the handle regexes in request.cpp
+    uint64_t generation = 0;
+    while (generation == 0) {
+        generation = rng() >> 1;
+    }
+    return generation;
+}
+
+task<> Network::send_all(socket_io &io, const void* buf, size_t len) {
+    trace_span span("send");
     const char *p = static_cast<const char*>(buf);
     size_t total = 0;
     while (total < len) {
-        ssize_t n = send(sockfd, p + total, len - total, MSG_NOSIGNAL); // spec says MSG_NOSIGNAL
+        ssize_t n = send(io.fd, p + total, len - total, MSG_NOSIGNAL); // spec says MSG_NOSIGNAL
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            co_await ready_for{io, EPOLLOUT};
+            continue;
+        }
         // either the send failed or the user bailed
         if (n <= 0) {
-            return; 
+            co_return; 
         }
         total += static_cast<size_t>(n);
     }
 }
 
+int Network::open_listener(bool reuseport) {
+    int sockfd = socket(PF_INET, SOCK_STREAM, IPPROTO_IP);
+    if (sockfd < 0) {
+        throw std::runtime_error("socket() failed");
+    }
+    // configure the socket to reuse local addresses
+    int yesval = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yesval, sizeof(yesval)) < 0) {
+        throw std::runtime_error("setsockopt() failed");
+    }
+    if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yesval, sizeof(yesval)) < 0) {
+        throw std::runtime_error("setsockopt() failed");
+    }
+
+    // socket is created and configured, bind the socket
+    addr.sin_family         = AF_INET; // Address Family Internet (IPV4)
+    addr.sin_addr.s_addr    = htonl(INADDR_ANY);
+    addr.sin_port           = htons(portnum);
+
+    if (bind(sockfd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        throw std::runtime_error("bind() failed");
+    }
+
+    // check to see if OS needs to choose the portnumber, the later listeners then share it
+    get_port_number(sockfd);
+
+    if (listen(sockfd, static_cast<int>(config.backlog)) < 0) {
+        throw std::runtime_error("syscall to listen() failed");
+    }
+    return sockfd;
+} // Network::open_listener()
+
+void Network::accept_loop(int listen_sock, unsigned int group) {
+    scheduler->pin_to_group(group);
+    while (true) {
+        // accept a connection to the server socket, its I/O never blocks from here on
+        int connection_sock = accept4(listen_sock, nullptr, nullptr, SOCK_NONBLOCK);
+        if (connection_sock < 0) {
+            throw std::runtime_error("syscall to accept() failed");
+        }
+
+        event_loop &loop = scheduler->next_loop(group);
+        scheduler->spawn(loop, serve_connection(connection_sock, loop, metrics_clock::now()));
+    }
+}
+
 void Network::get_port_number(int sockfd) {
     if (portnum == 0) {
         sockaddr_in addr{};
@@ -613,31 +1832,86 @@ void Network::get_port_number(int sockfd) {
     }
 } // Network::get_port_number()
 
-std::string Network::receive_data(int connection_sock) {
-    // Read only a byte of data each time 
-    std::string data; 
-    char c = 0;
+task<std::pmr::string> Network::receive_data(socket_io &io, receive_buffer &rb, std::pmr::memory_resource* arena) {
+    std::pmr::string data(arena);
     while (true) {
-        ssize_t bytes_recv = recv(connection_sock, &c, 1, 0);
-        if (bytes_recv < 0) {
-            throw std::runtime_error("syscall to recv() failed");
+        if (rb.begin == rb.end) {
+            ssize_t bytes_recv = recv(io.fd, rb.data, BUFFER, 0);
+            if (bytes_recv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                co_await ready_for{io, EPOLLIN};
+                continue;
+            }
+            if (bytes_recv < 0) {
+                throw std::runtime_error("syscall to recv() failed");
+            }
+            if (bytes_recv == 0) {
+                // the client closed the connection, a partial header must never be executed
+                if (!data.empty()) {
+                    throw std::runtime_error("connection closed inside a request header");
+                }
+                break;
+            }
+            rb.begin = 0;
+            rb.end = static_cast<size_t>(bytes_recv);
         }
-        // Reached null terminator, only data has not yet been received 
-        if(c == '\0') { 
+        // the header ends at the null terminator, anything after it belongs to the payload or next request
+        const char* first = rb.data + rb.begin;
+        const char* last = rb.data + rb.end;
+        const char* nul = std::find(first, last, '\0');
+        data.append(first, nul);
+        rb.begin = static_cast<size_t>(nul - rb.data);
+        if (nul != last) {
+            ++rb.begin;
             break;
         }
-        data.push_back(c);
         // maximum ish size of a valid request
         if (data.size() > FS_MAXUSERNAME + FS_MAXPATHNAME + 25) {
             break;
         }
     }
-    return data;
+    co_return data;
 } // Network::receive_data()
 
+task<bool> Network::receive_payload(socket_io &io, receive_buffer &rb, char* out, size_t len) {
+    // whatever followed the header in the last recv() comes first
+    size_t got = std::min(len, rb.end - rb.begin);
+    memcpy(out, rb.data + rb.begin, got);
+    rb.begin += got;
+    while (got < len) {
+        ssize_t n = recv(io.fd, out + got, len - got, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            co_await ready_for{io, EPOLLIN};
+            continue;
+        }
+        // the client does not send that much or closes the connection
+        if (n <= 0) {
+            co_return false;
+        }
+        got += static_cast<size_t>(n);
+    }
+    co_return true;
+} // Network::receive_payload()
+
+void Network::read_disk_block(uint32_t block, void* buf) {
+    trace_span span("disk_read", block);
+    Metrics::instance().record_disk_read();
+    disk_readblock(block, buf);
+}
+
+void Network::write_disk_block(uint32_t block, const void* buf) {
+    trace_span span("disk_write", block);
+    Metrics::instance().record_disk_write();
+    // held until the block is on disk, so a snapshot being taken sees this write whole or not at all
+    auto snapshot_guard = snapshots.before_write(block);
+    disk_writeblock(block, buf);
+    if (replication) {
+        replication->record(block, buf);
+    }
+}
+
 void Network::read_inode_block(const int &block, fs_inode &inode) {
     char buff[FS_BLOCKSIZE];
-    disk_readblock(block, buff);
+    read_disk_block(block, buff);
     // the dereference enforces a deep assingment operator avoiding a dangling pointer
     inode = *reinterpret_cast<fs_inode*>(buff);
 } // Network::read_inode_block()
@@ -650,7 +1924,7 @@ std::shared_ptr<shared_mutex> Network::get_inode_mutex_sp(uint32_t block) {
     auto sp = weak.lock();
     // might not exist 
     if (!sp) {
-        sp = std::make_shared<shared_mutex>();
+        sp = std::allocate_shared<shared_mutex>(std::pmr::polymorphic_allocator<shared_mutex>(&lock_memory));
         weak = sp;
     }
     return sp;
@@ -664,4 +1938,184 @@ int Network::get_new_block() {
     uint32_t next_block = *free_disk_blocks.begin();
     free_disk_blocks.erase(next_block);
     return static_cast<int>(next_block);
+}
+
+bool Network::get_new_blocks(size_t n, std::vector<uint32_t> &blocks) {
+    boost::lock_guard<boost::mutex> g(free_disk_mutex);
+    if (free_disk_blocks.size() < n) {
+        return false;
+    }
+    auto last = std::next(free_disk_blocks.begin(), static_cast<std::ptrdiff_t>(n));
+    blocks.insert(blocks.end(), free_disk_blocks.begin(), last);
+    free_disk_blocks.erase(free_disk_blocks.begin(), last);
+    return true;
+}
+
+bool Network::get_new_run(size_t n, std::vector<uint32_t> &blocks) {
+    boost::lock_guard<boost::mutex> g(free_disk_mutex);
+    if (free_disk_blocks.size() < n) {
+        return false;
+    }
+    // the lowest n consecutive free blocks
+    auto first = free_disk_blocks.begin();
+    auto last = free_disk_blocks.begin();
+    size_t run = 0;
+    for (auto it = free_disk_blocks.begin(); it != free_disk_blocks.end() && run < n; ++it) {
+        if (run == 0 || *it != *std::prev(it) + 1) {
+            first = it;
+            run = 0;
+        }
+        ++run;
+        last = std::next(it);
+    }
+    // the free space is too fragmented, the lowest n blocks will do
+    if (run < n) {
+        first = free_disk_blocks.begin();
+        last = std::next(first, static_cast<std::ptrdiff_t>(n));
+    }
+    blocks.insert(blocks.end(), first, last);
+    free_disk_blocks.erase(first, last);
+    return true;
+}
+
+void Network::free_blocks(const std::vector<uint32_t> &blocks) {
+    boost::lock_guard<boost::mutex> g(free_disk_mutex);
+    free_disk_blocks.insert(blocks.begin(), blocks.end());
+}
+
+Defragmenter::layout Network::defrag_scan() {
+    Defragmenter::layout res;
+    std::vector<std::pair<uint32_t, uint64_t>> dirs{{0, inode_generation[0].load(std::memory_order_relaxed)}};
+    while (!dirs.empty()) {
+        auto [dir_block, dir_generation] = dirs.back();
+        dirs.pop_back();
+
+        std::vector<std::pair<uint32_t, uint64_t>> children;
+        {
+            auto mtx = get_inode_mutex_sp(dir_block);
+            shared_lock lock(*mtx);
+            if (inode_generation[dir_block].load(std::memory_order_relaxed) != dir_generation) {
+                continue;
+            }
+            fs_inode dir;
+            read_inode_block(static_cast<int>(dir_block), dir);
+            if (dir.type != 'd') {
+                continue;
+            }
+            for (uint32_t i = 0; i < dir.size; ++i) {
+                fs_direntry page[FS_DIRENTRIES];
+                read_disk_block(dir.blocks[i], page);
+                for (const fs_direntry &entry : page) {
+                    if (entry.inode_block != 0) {
+                        children.emplace_back(entry.inode_block,
+                                              inode_generation[entry.inode_block].load(std::memory_order_relaxed));
+                    }
+                }
+            }
+        }
+
+        for (const auto &[block, generation] : children) {
+            auto mtx = get_inode_mutex_sp(block);
+            shared_lock lock(*mtx);
+            if (inode_generation[block].load(std::memory_order_relaxed) != generation) {
+                continue;
+            }
+            fs_inode inode;
+            read_inode_block(static_cast<int>(block), inode);
+            if (inode.type == 'd') {
+                dirs.emplace_back(block, generation);
+                continue;
+            }
+            unsigned int extents = count_extents(inode);
+            if (extents == 0) {
+                continue;
+            }
+            ++res.files;
+            res.extents += extents;
+            res.data_blocks += static_cast<size_t>(std::count_if(inode.blocks, inode.blocks + inode.size,
+                                                                 [](uint32_t b) { return b != 0; }));
+            if (extents > 1) {
+                res.fragmented.push_back({block, generation, extents});
+            }
+        }
+    }
+    return res;
+} // Network::defrag_scan()
+
+size_t Network::defrag_move(const Defragmenter::candidate &c, const std::function<bool()> &busy) {
+    auto mtx = get_inode_mutex_sp(c.block);
+    // writers wait, readers go on while the data is copied
+    upgrade_lock lock(*mtx);
+    if (inode_generation[c.block].load(std::memory_order_relaxed) != c.generation) {
+        return 0;
+    }
+    fs_inode inode;
+    read_inode_block(static_cast<int>(c.block), inode);
+    if (inode.type != 'f' || count_extents(inode) < 2) {
+        return 0;
+    }
+    std::vector<uint32_t> old_blocks;
+    for (uint32_t i = 0; i < inode.size; ++i) {
+        if (inode.blocks[i] != 0) {
+            old_blocks.push_back(inode.blocks[i]);
+        }
+    }
+
+    std::vector<uint32_t> run;
+    if (!get_new_run(old_blocks.size(), run)) {
+        return 0;
+    }
+    // get_new_run() falls back to scattered blocks, which would gain nothing
+    if (run.back() - run.front() + 1 != run.size()) {
+        free_blocks(run);
+        return 0;
+    }
+
+    // data first
+    char data[FS_BLOCKSIZE];
+    for (size_t k = 0; k < old_blocks.size(); ++k) {
+        if (busy()) {
+            free_blocks(run);
+            return 0;
+        }
+        read_disk_block(old_blocks[k], data);
+        write_disk_block(run[k], data);
+    }
+
+    // then the inode.  The contents are unchanged, so cached copies and leases stay valid
+    size_t k = 0;
+    for (uint32_t i = 0; i < inode.size; ++i) {
+        if (inode.blocks[i] != 0) {
+            inode.blocks[i] = run[k++];
+        }
+    }
+    {
+        unique_lock write_lock(std::move(lock));
+        write_disk_block(c.block, &inode);
+    }
+    // the old blocks are only free once the inode no longer points at them
+    free_blocks(old_blocks);
+    return old_blocks.size();
+} // Network::defrag_move()
+
+int Network::get_new_block_where(const std::function<bool(uint32_t)> &usable) {
+    boost::lock_guard<boost::mutex> g(free_disk_mutex);
+    for (auto it = free_disk_blocks.begin(); it != free_disk_blocks.end(); ++it) {
+        if (usable(*it)) {
+            uint32_t block = *it;
+            free_disk_blocks.erase(it);
+            return static_cast<int>(block);
+        }
+    }
+    return -1;
+}
+
+std::bitset<FS_DISKSIZE> Network::blocks_in_use() {
+    std::bitset<FS_DISKSIZE> in_use;
+    in_use.set();
+    boost::lock_guard<boost::mutex> g(free_disk_mutex);
+    for (uint32_t block : free_disk_blocks) {
+        in_use.reset(block);
+    }
+    return in_use;
 }
\ No newline at end of file
@@ -10,18 +10,62 @@
 #include <deque>
 #include <utility>
 #include <memory>
+#include <atomic>
 #include <unordered_map>
+#include <map>
+#include <vector>
+#include <bitset>
+#include <functional>
+#include <memory_resource>
 
 #include <boost/thread.hpp>
 #include <boost/thread/shared_mutex.hpp>
 #include <boost/thread/locks.hpp>
 
 #include "fs_server.h"
+#include "arena.hpp"
 #include "request.hpp"
+#include "metrics.hpp"
+#include "lock_profiler.hpp"
+#include "tracer.hpp"
+#include "lease_table.hpp"
+#include "scheduler.hpp"
+#include "dedup.hpp"
+#include "replication.hpp"
+#include "snapshot.hpp"
+#include "defrag.hpp"
+
+
+static constexpr unsigned int DEFAULT_BACKLOG = 1024;
+static constexpr unsigned int BUFFER    = 1024;
 
+// length of the read leases granted to caching clients, 0 turns leases off
+static constexpr unsigned int DEFAULT_LEASE_MS = 1000;
 
-static constexpr unsigned short BACKLOG = 30; 
-static constexpr unsigned int BUFFER    = 1024;
+// admission control, see admission.hpp
+static constexpr unsigned int DEFAULT_MAX_QUEUE  = 1024;
+static constexpr unsigned int DEFAULT_TARGET_MS  = 5;       // acceptable standing queue delay
+static constexpr unsigned int CODEL_INTERVAL_MS  = 100;
+
+/*
+ * Server settings, from the command line (see fs.cpp)
+ */
+struct server_config {
+    int port               = 0;                 // 0 lets the OS choose
+    unsigned int lease_ms  = DEFAULT_LEASE_MS;
+    unsigned int loops     = 0;                 // connection event loops, 0 for one per core
+    unsigned int workers   = 0;                 // request handler threads, 0 for a few per core
+    unsigned int backlog   = DEFAULT_BACKLOG;   // pending connections the kernel queues
+    unsigned int max_queue = DEFAULT_MAX_QUEUE; // requests waiting for a slot
+    unsigned int target_ms = DEFAULT_TARGET_MS;
+    std::unordered_map<std::string, unsigned int> weights{};   // users' shares of the workers, 1 if not listed
+    bool dedup             = false;             // share blocks with identical contents, see dedup.hpp
+    unsigned int listeners = 1;                 // SO_REUSEPORT listening sockets, > 1 pins each to a CPU group
+    std::string replica_socket{};               // ship writes to replicas on this unix socket, see replication.hpp
+    std::string follow{};                       // be a read-only replica of the primary at this unix socket
+    unsigned int max_staleness_ms = DEFAULT_MAX_STALENESS_MS;   // replica: refuse reads when further behind
+    bool defrag            = false;             // rewrite fragmented files into runs while idle, see defrag.hpp
+};
 
 /*
  * Raii class wrapper to help us with the hand over hand locking
@@ -37,7 +81,10 @@ using upgrade_lock = boost::upgrade_lock<shared_mutex>;
 template <typename Lock, typename Mutex>
 class HandOverLock {
 public: 
-    explicit HandOverLock(Mutex& m) : lock_(m) {}
+    // block and path() identify the inode for the contention profiler
+    template <typename PathFn>
+    HandOverLock(Mutex& m, uint32_t block, PathFn &&path)
+        : lock_(acquire_profiled<Lock>(m, timer_, block, std::forward<PathFn>(path))) {}
 
     HandOverLock(HandOverLock&&) = default;
     HandOverLock& operator=(HandOverLock&&) = default;
@@ -49,10 +96,14 @@ public:
     ~HandOverLock() = default;
 
     // We enforce that we always aquire the parents lock before the childs, preventes deadlocks
-    void hand_over(Mutex & next_m) {
-        Lock next_lock(next_m); // lock the next
+    template <typename PathFn>
+    void hand_over(Mutex & next_m, uint32_t next_block, PathFn &&next_path) {
+        lock_timer next_timer;
+        Lock next_lock = acquire_profiled<Lock>(next_m, next_timer, next_block,
+                                                std::forward<PathFn>(next_path)); // lock the next
         
         lock_.swap(next_lock);  // now this instance owns next
+        timer_ = std::move(next_timer);
     } // old lock destructs and releases the lock
 
     Lock& get() {return lock_; }
@@ -62,6 +113,7 @@ public:
     }
 
 private:
+    lock_timer timer_;  // declared first, lock_ is acquired through it
     Lock lock_;
 };
 
@@ -73,22 +125,35 @@ using inode_upgrade_block = HandOverLock<upgrade_lock, shared_mutex>;
 */
 class Network {
 public:
-    Network(int port_in);
+    explicit Network(const server_config &config);
 
     /*
      * start_server
      * 
      * Creates the server for the file network
      *
+     * With config.listeners > 1 every listener has its own accepting thread and
+     * event loops, pinned to one group of CPUs, so that a connection is accepted
+     * and served on the same cores.
+     *
      * start_server does not return 
      */
     void start_server(); 
 private:
+    // the microbenchmarks in fs_microbench.cpp drive the internals directly
+    friend struct network_microbench;
 
     template<typename LockT>
     struct path_find_info {
         std::shared_ptr<shared_mutex> mtx_sp;       
         LockT lock;
+        lock_timer timer;                           // wait/hold time of lock, including upgrades
+    };
+
+    // the paths of an FS_STATMANY request, merged by common prefix
+    struct stat_node {
+        std::map<std::string, stat_node, std::less<>> children;
+        std::vector<size_t> wanted;                 // requests for the path ending here
     };
 
     struct create_scan_info {
@@ -111,8 +176,19 @@ private:
         bool only_entry       = false;         // if its the only entry in the block
     };
 
-    int sockfd = 0; 
+    // an inode of a tree being deleted, held until the delete (or its check) is done
+    template <typename LockT>
+    struct subtree_node {
+        uint32_t block = 0;
+        fs_inode inode;
+        path_find_info<LockT> lm;
+    };
+
+    std::vector<int> listen_socks;              // one per listener, all on portnum
     int portnum = 0;
+    server_config config;
+    std::unique_ptr<AdmissionControl> admission; // created by start_server
+    std::unique_ptr<Scheduler> scheduler;      // created by start_server
     sockaddr_in addr{};
     std::set<uint32_t> free_disk_blocks;
 
@@ -120,8 +196,32 @@ private:
     // per inode reader/write blocks
     // the 6 credit version needs to be space efficient with the use of smart pointers - weak pointers allow them to deallocate when not being used
     boost::mutex lock_table_mutex;
+    // the mutexes and their shared_ptr control blocks, recycled rather than freed to the heap
+    std::pmr::synchronized_pool_resource lock_memory;
     std::unordered_map<uint32_t, std::weak_ptr<shared_mutex>> inode_lock_table;
 
+    // read leases of caching clients, recalled by writers
+    LeaseTable leases;
+
+    // reference counts and fingerprints of file blocks in dedup mode, else nullptr
+    std::unique_ptr<DedupIndex> dedup;
+
+    // the write log shipped to replicas (config.replica_socket), else nullptr
+    std::unique_ptr<ReplicationSource> replication;
+
+    // set when this server is a read-only replica (config.follow)
+    std::unique_ptr<ReplicaSink> replica;
+
+    // point-in-time copies of the disk taken with FS_SNAPSHOT, read under "/.snapshots"
+    SnapshotTable snapshots;
+
+    // the background defragmenter (config.defrag), else nullptr
+    std::unique_ptr<Defragmenter> defrag;
+
+    // random generation of every inode, 0 for blocks that are not inodes.  Handles carry it, so a handle
+    // stops working when its file is deleted and cannot be forged.  Changed under the inode's lock.
+    std::atomic<uint64_t> inode_generation[FS_DISKSIZE]{};
+
     // this helper will return the sp for a given inode_block
     std::shared_ptr<shared_mutex> get_inode_mutex_sp(uint32_t block);
 
@@ -135,6 +235,10 @@ private:
      * The file server should be able to start with any valid file system (an empty file system as well as file systems
      * containing directories and/or files)
      *
+     * In dedup mode also counts the references to every file block and indexes their contents.  A disk
+     * with blocks shared by several files (written in dedup mode) turns dedup mode on, as only it keeps
+     * such blocks from being overwritten or freed while still in use.
+     *
      */
     void sys_init();
 
@@ -152,25 +256,86 @@ private:
     void get_port_number(int sockfd);
 
     /*
-     * handle_request
+     * open_listener
+     *
+     *  Binds and listens on a new socket on portnum (choosing it if it is 0), with
+     *  SO_REUSEPORT if reuseport so that further listeners can share the port.
+     *  The kernel spreads incoming connections over all the listeners of a port.
+     *
+     *  Throws an exception if a syscall fails
+     */
+    int open_listener(bool reuseport);
+
+    /*
+     * accept_loop
+     *
+     *  Accepts connections on listen_sock forever and starts each on the next
+     *  event loop of the scheduler's group, from a thread pinned to that group's
+     *  CPUs.  Throws an exception if accept() fails.
+     */
+    void accept_loop(int listen_sock, unsigned int group);
+
+    /*
+     * serve_connection
      *     
-     * This is the wrapper function called with every new thread created to 
-     * completely handle the request.
+     * The coroutine started on an event loop for every accepted connection to
+     * completely handle the request.  Socket I/O suspends the coroutine; the
+     * request itself runs on a worker thread through execute_request().
+     * accepted is when accept() returned, so traced requests also show the
+     * hand-off.
+     *
+     * A connection that starts with FS_SESSION stays open and serves requests
+     * until the client closes it; failed requests on it are answered with
+     * FS_ERROR_REPLY instead of closing the connection.
      */
-    void handle_request(int connection_sock);
+    task<> serve_connection(int connection_sock, event_loop &loop, metrics_clock::time_point accepted);
+
+    /*
+     * execute_request
+     *
+     * Dispatches a parsed request (and its payload, if any) to its handler.
+     * Returns the handler's result; on success response holds everything to
+     * send back.  Blocks on inode locks and the disk.
+     *
+     * A replica serves only reads (FS_READBLOCK, FS_READLEASE, FS_STAT,
+     * FS_STATMANY, FS_READDIR) and the admin requests, and fails the reads while
+     * it is not caught up or further behind than config.max_staleness_ms.  Each
+     * read sees the disk as of one point of the primary's write stream.
+     */
+    bool execute_request(request &request, std::string &response);
+
+    /*
+     * Bytes received on a connection but not yet consumed.  Data is read in
+     * chunks, so a batch of pipelined requests costs one recv() rather than
+     * one per byte.
+     */
+    struct receive_buffer {
+        char data[BUFFER];
+        size_t begin = 0;
+        size_t end   = 0;
+    };
 
     /*
      * receive_data
      *
      * RETURNS:
-     *          A string to data received from the client 
+     *          A string to data received from the client, allocated from arena
+     *
+     * Reads from the connection until a null terminator is read.  Returns an
+     * empty string if the client closed the connection before sending anything.
      *
-     * Performs a syscall to recv() in which a byte of data is read 
-     * until a null terminator is read. 
+     * Throws an exception if an error occurs on recv() or the connection
+     * closes inside a header
+     */
+    task<std::pmr::string> receive_data(socket_io &io, receive_buffer &rb, std::pmr::memory_resource* arena);
+
+    /*
+     * receive_payload
      *
-     * Throws an exception if an error occurs on recv()
+     * Reads exactly len bytes into out.  Returns false if the connection
+     * closes first.
      */
-    std::string receive_data(int connection_sock);
+    task<bool> receive_payload(socket_io &io, receive_buffer &rb, char* out, size_t len);
 
     /*
      * read_inode_block
@@ -179,30 +344,170 @@ private:
      */
     void read_inode_block(const int &block, fs_inode &inode);
 
+    /*
+     * read_disk_block / write_disk_block
+     *
+     *  All disk accesses go through these so they are counted per request type, and
+     *  every write is logged for the replicas.  Write with the lock that orders writes
+     *  to the block held, so the replicas get them in disk order.  A write to a block
+     *  that a snapshot still reads in place first copies it out (see snapshot.hpp).
+     */
+    void read_disk_block(uint32_t block, void* buf);
+    void write_disk_block(uint32_t block, const void* buf);
+
     /*
      * Handles FS_READBLOCK request
      * - Uses path_find() to locate the target inode and holds a shared_lock
      *     on it while validating and reading.
      * - Verifies: target is a file, owned by username, and block index is balid
-     * - On success: disk_readblock() + send header then data that data read.
-     * - On error: sends no response; caller closes the socket
-     * 
+     * - On success: disk_readblock() + respond with the header then the data read.
+     *   A hole (blocks[i] == 0, see write_block()) is answered with zeros
+     *   without reading the disk.
+     * - On error: no response; caller closes the socket
+     * - FS_READLEASE also grants a read lease on the file before reading and
+     *   sends "<inode_block> <lease_ms>" null terminated between the header
+     *   and the data.  lease_ms is 0 when no lease was granted.
+     * - FS_READHANDLE finds the file with handle_find() instead.
+     *
+     * All request handlers return true if the request succeeded and append
+     * the response to response, false otherwise.
+     */
+    bool read_block(request &request, std::string &response);
+
+
+    /*
+     * Handles FS_OPEN request
+     * - Uses path_find() like FS_READBLOCK; the target must be a file owned
+     *   by username.
+     * - On success: responds with the header then the file's handle, null
+     *   terminated (see handle_of()).
+     */
+    bool sys_open(request &request, std::string &response);
+
+    /*
+     * Handles FS_STAT and FS_STATMANY requests
+     * - Looks up every path in request.paths in one walk from the root (see
+     *   stat_walk()) under shared locks.
+     * - A path resolves if every directory on it is owned by username or the
+     *   root, and so is the target.
+     * - On success: responds with the header, then for each path in order
+     *   "<type> <size_in_blocks> <owner>" null terminated, or "-" if it did
+     *   not resolve.  The owner is empty for the root's.  FS_STAT fails
+     *   instead of answering "-".
      */
-    void read_block(request &request, int socket);
+    bool sys_stat(request &request, std::string &response);
 
+    /*
+     * Handles FS_READDIR request
+     * - Uses path_find() like FS_STAT ("/" included) and holds a shared_lock
+     *   on the directory while it lists one chunk; the directory must be owned
+     *   by username or the root.
+     * - The cookie is where the chunk starts: blocks[] index * FS_DIRENTRIES
+     *   + slot.  0 starts the listing.
+     * - On success: responds with the header, then "<next_cookie> <count>"
+     *   and count live entries in directory order, each null terminated.
+     *   next_cookie is 0 once the listing is done.  With "attrs" an entry is
+     *   "<name> <type> <size_in_blocks>", with the child locked while its
+     *   inode is read, else "<name>"; type is '-' and size 0 for children
+     *   not owned by username or the root, as FS_STAT would refuse them.
+     * - The lock is only held per chunk, so entries created or deleted
+     *   between chunks may or may not be listed.  Deleting the last entry of
+     *   a directory block moves the later blocks up one (see sys_delete()),
+     *   which can skip or repeat entries of a listing that spans it.
+     */
+    bool sys_readdir(request &request, std::string &response);
+
+    /*
+     * list_directory
+     *
+     *  Appends the "<next_cookie> <count>" and entries of one FS_READDIR chunk of dir_inode to
+     *  response.  read_page(block, page) reads a directory block and read_child(block, inode)
+     *  a child's inode for "attrs", both returning false on failure, which fails the listing.
+     *  Shared by the live tree and the snapshots.
+     */
+    template <typename ReadPage, typename ReadChild>
+    bool list_directory(const fs_inode &dir_inode, const request &request, ReadPage read_page,
+                        ReadChild read_child, std::string &response);
+
+    /*
+     * Handles FS_SNAPSHOT request
+     * - "create <name>" takes a snapshot of the whole disk, owned by username.
+     *   It does no disk I/O and does not wait for readers; writes in progress
+     *   finish first.  Fails if the name is taken or FS_MAXSNAPSHOTS exist.
+     * - "delete <name>" deletes one of username's snapshots and frees the
+     *   blocks it kept.
+     * - On success: responds with only the request header.
+     */
+    bool sys_snapshot(request &request, std::string &response);
+
+    /*
+     * names_snapshot_dir
+     *
+     *  True if the request names "/.snapshots" or something under it, including creating it in the
+     *  root with FS_CREATE_BATCH.  Such requests go to snapshot_read() or fail.
+     */
+    static bool names_snapshot_dir(const request &request);
+
+    /*
+     * Handles FS_READBLOCK, FS_READLEASE, FS_STAT and FS_READDIR under "/.snapshots"
+     * - "/.snapshots" is a directory owned by the root listing the snapshots
+     *   by name; FS_STAT gives "d <count> ".
+     * - "/.snapshots/<name>/<path>" is <path> as it was when the snapshot was
+     *   taken, with the same ownership checks and replies as the live tree.
+     *   FS_READLEASE grants no lease.
+     * - Takes no inode locks, a snapshot never changes.  Fails if the
+     *   snapshot is deleted or lost meanwhile.
+     * - FS_STATMANY does not look into snapshots, their paths answer "-".
+     */
+    bool snapshot_read(request &request, std::string &response);
+
+    /*
+     * snapshot_find
+     *
+     *  path_find in a snapshot: returns the block of path's inode as of snap and reads it into inode,
+     *  or -1 if it does not resolve for user.
+     */
+    int snapshot_find(const SnapshotTable::snapshot &snap, const path_t &path,
+                      const std::string &user, fs_inode &inode);
 
     /*
      * Handles FS_WRITEBLOCK request
-     * - Uses path_find_upgrade() to locate the file and hold an upgrade_lock.
+     * - Uses path_find_upgrade() to locate the file and hold an upgrade_lock
+     *   (handle_find() for FS_WRITEHANDLE).
      * - Verifies ownership, type=file, block index in [0, size] and within 
      *   FS_MAXFILEBLOCKS, and space available if extending.
-     * - Overwrite: upgrade to unique_lock and write new data to existing block.
+     * - Overwrite: recall read leases on the file, then upgrade to unique_lock
+     *   and write new data to existing block.
      * - Extend: allocate new block, write data, then update inode (data first
      *   then metadta for crash safety).
-     * - On success: sends back only the request header.s
+     * - Dedup mode: see write_block_dedup().
+     * - Sparse files: an all zero block is never stored.  It is appended or
+     *   written as a hole, blocks[i] == 0, which costs only the inode write;
+     *   overwriting a block with zeros frees it, and writing data to a hole
+     *   allocates a block like an extend does.
+     * - On success: responds with only the request header.
      * 
      */
-    void write_block(request &request, int socket);
+    bool write_block(request &request, std::string &response);
+
+    /*
+     * write_block() of data that is not all zeros in dedup mode, with the
+     * file's upgrade lock in lock_info.
+     * - A block already holding the data is shared instead of writing another.
+     * - Otherwise a block only this file uses is overwritten in place (once
+     *   the unique lock shows no copy is sharing it), and a shared one is left
+     *   alone: the data goes to a new block (copy on write).
+     * - The inode is repointed after the data is on disk, then the old block's
+     *   reference is released.
+     */
+    bool write_block_dedup(request &request, int target_inode_block, fs_inode &target_inode,
+                           path_find_info<upgrade_lock> &lock_info);
+
+    /*
+     * release_file_blocks
+     *      drops the references of a file's blocks, appending those no other file uses to freed
+     */
+    void release_file_blocks(const fs_inode &inode, std::vector<uint32_t> &freed);
 
     /*
      * Handle an FS_CREATE request (new file or directory).
@@ -215,7 +520,48 @@ private:
      *   updates the directory entry (and parent inode if adding a new block).
      *  - On succes: sends back orginal request header.
      */
-    void sys_create(request &request, int socket);
+    bool sys_create(request &request, std::string &response);
+
+    /*
+     * create_entry
+     *
+     *  The work of FS_CREATE for path (split from pathname, used by the lock
+     *  profiler): links new_inode, written to a new inode block first, into the
+     *  parent directory, which must be owned by user or the root and not hold
+     *  the name yet.  Blocks new_inode points at must already be written.
+     *  Returns false if nothing was created.
+     */
+    bool create_entry(path_t &path, std::string_view pathname, std::string &user,
+                      const fs_inode &new_inode);
+
+    /*
+     * Handle an FS_COPY request (a new file with the data of an existing one).
+     * - Uses path_find() on the source, which must be a file owned by
+     *   username, and reads all of its blocks in order under the shared lock.
+     * - Writes the data to new blocks taken with get_new_run(), in ascending
+     *   order, then creates the destination like FS_CREATE with an inode
+     *   that already points at them.  The data never leaves the server.
+     *   In dedup mode the new inode shares the source's blocks instead, each
+     *   referenced under the source's shared lock.
+     * - On succes: sends back the orginal request header.
+     */
+    bool sys_copy(request &request, std::string &response);
+
+    /*
+     * Handle an FS_CREATE_BATCH request (many new entries in one directory).
+     * - Uses path_find_upgrade() on the directory ("/" included) and checks
+     *   it like FS_CREATE.
+     * - Scans the directory once for the names taken and the open slots.
+     *   Entries with a bad name or type, a name that is taken (or repeated in
+     *   the batch), or no room left in the directory fail on their own.
+     * - Takes every new inode and directory block with one get_new_blocks()
+     *   call, writes the inodes first, then each directory page once with all
+     *   of its new entries, new pages before the unique lock and existing ones
+     *   under it, then the parent inode once if it grew.
+     * - On success: responds with the header, then "0" or "-1" for each entry
+     *   in order, null terminated.
+     */
+    bool sys_create_batch(request &request, std::string &response);
 
     /*
      * Handle on FS_DELETE reqest (file or empty directory).
@@ -223,14 +569,86 @@ private:
      *   the target direntry via scan_directory_for_delete().
      * - Verifies parent is a directory with proper ownership; verifes target
      *   is owned by username, not "/", and (if a directory) is empty.
-     * - Under a unique_lock on the parent, either clears just the entry or
+     * - Recalls read leases on the target, then under a unique_lock on the
+     *   parent, either clears just the entry or
      *   shrinks the directory by removing an all-empty dir block and compacting
      *   parent_inodes.blocks[].
      * - Under a unique lock on the target plus free_disk_mutex, 
      *   returns all target data blocks and its inode block to free_disk_blocks.
      * - On succes: sends back the orginal request header.
      */
-    void sys_delete(request &request, int socket);
+    bool sys_delete(request &request, std::string &response);
+
+    /*
+     * Handle an FS_DELETE_TREE request (a file, or a directory and everything
+     * under it).
+     * - Finds the target in its parent like FS_DELETE, holding an upgrade
+     *   lock on the parent.
+     * - Checks the tree under shared locks with lock_subtree(), which fails
+     *   unless every inode is owned by username, and recalls read leases on
+     *   every file in it.  The shared locks are dropped again: holding locks
+     *   in the tree while waiting for a unique lock above them would deadlock
+     *   with writes inside it.
+     * - Takes the parent unique, so no new path walk can enter the tree, then
+     *   unique locks the tree top down with lock_subtree() and checks it again.
+     *   Files created since the first check are recalled now.  Nothing is
+     *   changed if either check fails.
+     * - Removes the target's entry from the parent with one write (see
+     *   unlink_direntry()); the tree itself is not written, it is no longer
+     *   reachable.
+     * - Clears the generation of every inode in the tree and returns all their
+     *   blocks with one free_blocks() call.
+     * - On succes: sends back the orginal request header.
+     */
+    bool sys_delete_tree(request &request, std::string &response);
+
+    /*
+     * lock_subtree
+     *
+     *  Locks (LockT) the inode in root_block and every inode under it, each
+     *  after its parent, and appends them to nodes in that order with their
+     *  inodes read.  Returns false as soon as one is not owned by
+     *  request.username; the locks taken so far are in nodes.
+     */
+    template <typename LockT>
+    bool lock_subtree(uint32_t root_block, const request &request, std::vector<subtree_node<LockT>> &nodes);
+
+    /*
+     * unlink_direntry
+     *
+     *  Removes the entry scan found from the parent directory, which must be
+     *  unique locked: clears it in its block, or if it was the block's only
+     *  entry, drops the block from parent_inode.blocks[] and writes the inode.
+     *  Returns the directory block that is no longer used, or -1.
+     */
+    int unlink_direntry(int parent_inode_block, fs_inode &parent_inode, delete_scan_info &scan);
+
+    /*
+     * Handle an FS_STATS request.
+     * - Sends back the original request header followed by the server metrics
+     *   in the Prometheus text format, null terminated.
+     */
+    bool sys_stats(request &request, std::string &response);
+
+    /*
+     * Handle an FS_LOCKPROF request for the inode lock contention profiler.
+     * - "sample N" samples one in N inode lock acquisitions (0 disables)
+     * - "reset" drops the samples collected so far
+     * - "top N" dumps the N inodes with the most sampled wait time
+     * - On success: sends back the original request header followed by the
+     *   profiler report, null terminated.
+     */
+    bool sys_lockprof(request &request, std::string &response);
+
+    /*
+     * Handle an FS_TRACE request for the request tracer.
+     * - "sample N" traces N out of every 1000 requests (0 disables)
+     * - "dump" sends back the buffered spans as Chrome trace-event JSON and
+     *   empties the buffers
+     * - On success: sends back the original request header followed by the
+     *   reply text, null terminated.
+     */
+    bool sys_trace(request &request, std::string &response);
 
     /*
      * path_find
@@ -245,17 +663,52 @@ private:
     template <typename LockT>
 
     //
-    int path_find_impl(std::deque<std::string> &path, std::string &user, path_find_info<LockT>* out_info);
+    int path_find_impl(path_t &path, std::string &user, path_find_info<LockT>* out_info);
     
-    int path_find(std::deque<std::string> &path, std::string &user, path_find_info<shared_lock>* out_info);
+    int path_find(path_t &path, std::string &user, path_find_info<shared_lock>* out_info);
 
-    int path_find_upgrade(std::deque<std::string> &path, std::string &user, path_find_info<upgrade_lock>* out_info);
+    int path_find_upgrade(path_t &path, std::string &user, path_find_info<upgrade_lock>* out_info);
+
+    /*
+     * stat_walk
+     *
+     *  Fills in results for the paths ending at node, whose inode is block, then descends into the children
+     *  wanted from it.  The directory is scanned once for all of them, and each child is locked (shared)
+     *  while its subtree is walked, after its parent like in path_find.  The caller holds block's lock.
+     */
+    void stat_walk(const stat_node &node, uint32_t block, const std::string &user, std::vector<std::string> &results);
+
+    /*
+     * handle_find
+     *
+     *  path_find for handle requests: locks the handle's inode directly and returns its block, or -1 if the
+     *  handle is not (or no longer) valid.  Only the path was checked for permission when the handle was
+     *  opened; the caller still checks the file's owner.
+     */
+    template <typename LockT>
+    int handle_find(const request &request, path_find_info<LockT>* out_info);
+
+    /*
+     * handle_of
+     *
+     *  The handle of an inode: "<inode_block>.<generation>".  Call with the inode locked.
+     */
+    std::string handle_of(uint32_t inode_block);
+
+    /*
+     * new_generation
+     *
+     *  A random, non zero generation for a new inode
+     */
+    static uint64_t new_generation();
 
     
     /*
      * find_child
      *
      *  This function will be used within path_find to only explore for the target name.
+     *  Every directory page is scanned with scan_dir_page() (dir_scan.hpp), as in the
+     *  create and delete scans below.
      *  
      *  input: 
      *          dir inode
@@ -265,7 +718,7 @@ private:
      *          on failure -1 
      *  
     */
-    int find_child(const fs_inode &dir_inode, const std::string &name);
+    int find_child(const fs_inode &dir_inode, std::string_view name);
 
     /*
      * scan_directory_for_create
@@ -280,7 +733,7 @@ private:
      *          create_scan struct object       
      *  
     */
-    create_scan_info scan_directory_for_create(const fs_inode &parent_inode, const std::string &name);
+    create_scan_info scan_directory_for_create(const fs_inode &parent_inode, std::string_view name);
     
     /*
      * scan_directory_for_delete
@@ -295,15 +748,15 @@ private:
      *          a delete_scan struct object
      *  
     */
-    delete_scan_info scan_directory_for_delete(const fs_inode &parent_inode, const std::string &name);
+    delete_scan_info scan_directory_for_delete(const fs_inode &parent_inode, std::string_view name);
     
     /*
      * send_all
      *
      *  send() does not guarantee to send all the bytes, so we need to loop until it does
-     *  we will do this in each function so well make a helper
+     *  suspends while the socket buffer is full
     */
-    void send_all(int sockfd, const void* buf, size_t len);
+    task<> send_all(socket_io &io, const void* buf, size_t len);
 
     /*
      * get_new_block
@@ -312,4 +765,56 @@ private:
      */
     int get_new_block();
 
+    /*
+     * get_new_blocks
+     *      appends the n lowest free blocks to blocks, taking free_disk_mutex once
+     *      returns false and takes nothing if fewer than n are free
+     */
+    bool get_new_blocks(size_t n, std::vector<uint32_t> &blocks);
+
+    /*
+     * get_new_run
+     *      get_new_blocks(), but takes the lowest run of n consecutive free blocks
+     *      if there is one, so they can be written sequentially
+     */
+    bool get_new_run(size_t n, std::vector<uint32_t> &blocks);
+
+    /*
+     * free_blocks
+     *      returns blocks to the free list, taking free_disk_mutex once
+     */
+    void free_blocks(const std::vector<uint32_t> &blocks);
+
+    /*
+     * defrag_scan
+     *
+     *  Walks the whole tree for the defragmenter, locking one inode at a time (shared), and returns
+     *  the layout of its files.  A child is recorded with its generation, so the walk need not hold
+     *  its parent: defrag_move() checks that it is still the same file.
+     */
+    Defragmenter::layout defrag_scan();
+
+    /*
+     * defrag_move
+     *
+     *  Rewrites the file c into the lowest free run that holds its data blocks, as described in
+     *  defrag.hpp, and returns the number of blocks moved.  Returns 0 without changing anything if the
+     *  file is gone or no longer fragmented, there is no such run, or busy() turns true before the
+     *  last block is copied.
+     */
+    size_t defrag_move(const Defragmenter::candidate &c, const std::function<bool()> &busy);
+
+    /*
+     * get_new_block_where
+     *      gets the lowest free block usable(block) accepts
+     *      failure returns -1
+     */
+    int get_new_block_where(const std::function<bool(uint32_t)> &usable);
+
+    /*
+     * blocks_in_use
+     *      the blocks not on the free list
+     */
+    std::bitset<FS_DISKSIZE> blocks_in_use();
+
 };
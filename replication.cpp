@@ -0,0 +1,317 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "replication.hpp"
+
+/***************************************************************************************************
+ *                                           Replication                                           *
+ ***************************************************************************************************/
+
+/* function docs are in the header file */
+
+// bytes buffered before a send, and the receive buffer of a replica
+static constexpr size_t STREAM_CHUNK = 256 * 1024;
+
+static sockaddr_un unix_address(const std::string &path) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        throw std::runtime_error("replication socket path too long");
+    }
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    return addr;
+}
+
+// blocking send of the whole buffer, false once the other end is gone
+static bool send_all(int sock, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(sock, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += n;
+        len -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+static void append_msg(std::vector<char> &out, uint32_t kind, uint32_t block, uint64_t seq, const void* data) {
+    replication_msg msg{kind, block, seq};
+    const char* p = reinterpret_cast<const char*>(&msg);
+    out.insert(out.end(), p, p + sizeof(msg));
+    if (data) {
+        const char* d = static_cast<const char*>(data);
+        out.insert(out.end(), d, d + FS_BLOCKSIZE);
+    }
+}
+
+/***************************************************************************************************
+ *                                        ReplicationSource                                        *
+ ***************************************************************************************************/
+
+ReplicationSource::ReplicationSource(const std::string &path, used_blocks_fn used_blocks)
+    : used_blocks(std::move(used_blocks)) {
+    sockaddr_un addr = unix_address(path);
+    listen_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_sock < 0) {
+        throw std::runtime_error("socket() failed");
+    }
+    // a socket file left by an earlier run would make bind() fail
+    unlink(path.c_str());
+    if (bind(listen_sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        throw std::runtime_error("bind() failed for the replication socket");
+    }
+    if (listen(listen_sock, 16) < 0) {
+        throw std::runtime_error("syscall to listen() failed");
+    }
+    boost::thread t(&ReplicationSource::accept_loop, this);
+    t.detach();
+}
+
+void ReplicationSource::record(uint32_t block, const void* data) {
+    if (replica_count.load() == 0) {
+        return;
+    }
+    {
+        boost::lock_guard<boost::mutex> g(m);
+        ++seq;
+        for (const std::shared_ptr<replica> &r : replicas) {
+            if (r->dropped) {
+                continue;
+            }
+            if (r->queue.size() >= REPLICATION_MAX_BACKLOG) {
+                r->dropped = true;
+                r->queue.clear();
+                continue;
+            }
+            logged_write &w = r->queue.emplace_back();
+            w.seq = seq;
+            w.block = block;
+            std::memcpy(w.data, data, FS_BLOCKSIZE);
+        }
+    }
+    cv.notify_all();
+}
+
+void ReplicationSource::render(std::ostream &os) {
+    uint64_t logged;
+    {
+        boost::lock_guard<boost::mutex> g(m);
+        logged = seq;
+    }
+    os << "# TYPE fs_replication_replicas gauge\n";
+    os << "fs_replication_replicas " << replica_count.load() << "\n";
+    os << "# TYPE fs_replication_writes_total counter\n";
+    os << "fs_replication_writes_total " << logged << "\n";
+}
+
+void ReplicationSource::accept_loop() {
+    while (true) {
+        int sock = accept(listen_sock, nullptr, nullptr);
+        if (sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            std::cerr << "replication: accept() failed, no more replicas are taken\n";
+            return;
+        }
+        boost::thread t(&ReplicationSource::serve, this, sock);
+        t.detach();
+    }
+}
+
+void ReplicationSource::serve(int sock) {
+    auto r = std::make_shared<replica>();
+    {
+        // from here on every write is queued for it, so the copy cannot miss one
+        boost::lock_guard<boost::mutex> g(m);
+        replicas.push_back(r);
+        replica_count.store(replicas.size());
+    }
+
+    std::vector<char> out;
+    out.reserve(STREAM_CHUNK + sizeof(replication_msg) + FS_BLOCKSIZE);
+    bool ok = true;
+    char data[FS_BLOCKSIZE];
+    for (uint32_t block : used_blocks()) {
+        disk_readblock(block, data);
+        append_msg(out, replication_msg::BLOCK, block, 0, data);
+        if (out.size() >= STREAM_CHUNK) {
+            ok = ok && send_all(sock, out.data(), out.size());
+            out.clear();
+        }
+    }
+    append_msg(out, replication_msg::COPY_END, 0, 0, nullptr);
+    ok = ok && send_all(sock, out.data(), out.size());
+
+    std::deque<logged_write> batch;
+    while (ok) {
+        uint64_t sent_to;
+        {
+            boost::unique_lock<boost::mutex> g(m);
+            cv.wait_for(g, std::chrono::milliseconds(REPLICATION_HEARTBEAT_MS),
+                        [&r]() { return !r->queue.empty() || r->dropped; });
+            if (r->dropped) {
+                break;
+            }
+            batch.swap(r->queue);
+            sent_to = seq;
+        }
+        out.clear();
+        for (const logged_write &w : batch) {
+            append_msg(out, replication_msg::BLOCK, w.block, w.seq, w.data);
+            if (out.size() >= STREAM_CHUNK) {
+                ok = ok && send_all(sock, out.data(), out.size());
+                out.clear();
+            }
+        }
+        batch.clear();
+        append_msg(out, replication_msg::HEARTBEAT, 0, sent_to, nullptr);
+        ok = ok && send_all(sock, out.data(), out.size());
+    }
+
+    {
+        boost::lock_guard<boost::mutex> g(m);
+        replicas.erase(std::find(replicas.begin(), replicas.end(), r));
+        replica_count.store(replicas.size());
+    }
+    close(sock);
+} // ReplicationSource::serve()
+
+/***************************************************************************************************
+ *                                           ReplicaSink                                           *
+ ***************************************************************************************************/
+
+ReplicaSink::ReplicaSink(const std::string &path, std::chrono::milliseconds max_staleness)
+    : path(path), max_staleness(max_staleness) {
+    unix_address(path);     // fail now on a bad path rather than in the thread
+    boost::thread t(&ReplicaSink::follow_loop, this);
+    t.detach();
+}
+
+ReplicaSink::read_view ReplicaSink::begin_read() {
+    if (!ready.load()) {
+        return {};
+    }
+    clock::rep age = clock::now().time_since_epoch().count() - fresh_at.load();
+    if (age > std::chrono::duration_cast<clock::duration>(max_staleness).count()) {
+        return {};
+    }
+    read_view view(apply_mutex);
+    // a new copy may have started while we waited
+    if (!ready.load()) {
+        return {};
+    }
+    return view;
+}
+
+void ReplicaSink::render(std::ostream &os) {
+    long long staleness_ms = -1;
+    if (ready.load()) {
+        clock::duration age(clock::now().time_since_epoch().count() - fresh_at.load());
+        staleness_ms = std::chrono::duration_cast<std::chrono::milliseconds>(age).count();
+    }
+    os << "# TYPE fs_replica_ready gauge\n";
+    os << "fs_replica_ready " << (ready.load() ? 1 : 0) << "\n";
+    os << "# TYPE fs_replica_applied_writes gauge\n";
+    os << "fs_replica_applied_writes " << applied_seq.load() << "\n";
+    os << "# TYPE fs_replica_staleness_ms gauge\n";
+    os << "fs_replica_staleness_ms " << staleness_ms << "\n";
+}
+
+void ReplicaSink::follow_loop() {
+    sockaddr_un addr = unix_address(path);
+    while (true) {
+        int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sock >= 0 && connect(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0) {
+            follow(sock);
+        }
+        if (sock >= 0) {
+            close(sock);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(REPLICA_RECONNECT_MS));
+    }
+}
+
+void ReplicaSink::follow(int sock) {
+    {
+        // the copy overwrites the disk out of order, stop serving until it is done and caught up
+        boost::unique_lock<boost::shared_mutex> g(apply_mutex);
+        ready.store(false);
+    }
+    bool copied = false;
+
+    std::vector<char> buf(STREAM_CHUNK);
+    size_t have = 0;
+    std::vector<replication_msg> headers;
+    std::vector<const char*> data;
+    while (true) {
+        ssize_t n = recv(sock, buf.data() + have, buf.size() - have, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        have += static_cast<size_t>(n);
+
+        // everything received is applied under one lock, up to each heartbeat
+        size_t pos = 0;
+        while (have - pos >= sizeof(replication_msg)) {
+            replication_msg msg;
+            std::memcpy(&msg, buf.data() + pos, sizeof(msg));
+            size_t len = sizeof(msg) + (msg.kind == replication_msg::BLOCK ? FS_BLOCKSIZE : 0);
+            if (have - pos < len) {
+                break;
+            }
+            if (msg.kind == replication_msg::BLOCK) {
+                if (msg.block >= FS_DISKSIZE) {
+                    std::cerr << "replica: bad block in the replication stream\n";
+                    return;
+                }
+                headers.push_back(msg);
+                data.push_back(buf.data() + pos + sizeof(msg));
+            } else {
+                apply(headers, data);
+                if (msg.kind == replication_msg::COPY_END) {
+                    copied = true;
+                } else if (msg.kind == replication_msg::HEARTBEAT) {
+                    applied_seq.store(msg.seq);
+                    if (copied) {
+                        fresh_at.store(clock::now().time_since_epoch().count());
+                        ready.store(true);
+                    }
+                }
+            }
+            pos += len;
+        }
+        apply(headers, data);
+        std::memmove(buf.data(), buf.data() + pos, have - pos);
+        have -= pos;
+    }
+} // ReplicaSink::follow()
+
+void ReplicaSink::apply(std::vector<replication_msg> &headers, std::vector<const char*> &data) {
+    if (headers.empty()) {
+        return;
+    }
+    {
+        boost::unique_lock<boost::shared_mutex> g(apply_mutex);
+        for (size_t i = 0; i < headers.size(); ++i) {
+            disk_writeblock(headers[i].block, data[i]);
+        }
+    }
+    headers.clear();
+    data.clear();
+}
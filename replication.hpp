@@ -0,0 +1,162 @@
+/***************************************************************************************************
+ *                                           Replication                                           *
+ ***************************************************************************************************/
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <boost/thread.hpp>
+
+#include "fs_server.h"
+
+/*
+ * Log shipping to read-only replicas.
+ *
+ * A primary started with --replica-socket <path> listens on that unix socket
+ * and streams every block it writes to each replica connected there, in the
+ * order the writes reached its disk.  Writes are whole blocks and every
+ * request orders its writes so that the disk is readable after each one (an
+ * inode before the directory entry naming it, a directory entry removed
+ * before its blocks are freed), so each prefix of the stream is a disk the
+ * primary's readers could have seen.
+ *
+ * A replica started with --follow <path> connects there, first receives a
+ * copy of every block in use, then applies the stream to its own disk image.
+ * The copy is read while writes go on, but every write made after it started
+ * follows in the stream, so the image is exact once the replica has applied
+ * the stream up to the point where the copy ended.  Only then does it serve
+ * reads, and each read request sees the disk as of one prefix of the stream.
+ *
+ * The primary sends a heartbeat with its latest position whenever it has sent
+ * everything, at least every REPLICATION_HEARTBEAT_MS.  A replica that has
+ * applied everything up to a heartbeat is fresh as of its arrival, and it
+ * refuses reads once that is more than its staleness bound ago (lost
+ * primary, or a replica that cannot keep up).  A replica that falls more than
+ * REPLICATION_MAX_BACKLOG writes behind is disconnected; it reconnects and
+ * copies the disk again.
+ */
+
+static constexpr unsigned int REPLICATION_HEARTBEAT_MS = 50;
+static constexpr size_t       REPLICATION_MAX_BACKLOG  = 65536;   // queued writes per replica, 32 MB
+static constexpr unsigned int REPLICA_RECONNECT_MS     = 500;
+static constexpr unsigned int DEFAULT_MAX_STALENESS_MS = 1000;
+
+/*
+ * One message of the replication stream, in host byte order (both ends run on
+ * one machine).  BLOCK messages are followed by the FS_BLOCKSIZE bytes of the
+ * block.
+ */
+struct replication_msg {
+    enum kind_t : uint32_t {
+        BLOCK,                              // a block of the copy (seq 0) or a logged write
+        COPY_END,                           // the copy is done, the writes it may have missed follow
+        HEARTBEAT,                          // every write up to seq has been sent
+    };
+    uint32_t kind;
+    uint32_t block;
+    uint64_t seq;
+};
+
+/*
+ * The primary's side: the write log and the replicas following it.  Thread
+ * safe.
+ */
+class ReplicationSource {
+public:
+    using used_blocks_fn = std::function<std::vector<uint32_t>()>;
+
+    /*
+     * Listens on the unix socket at path (replacing a stale one) and serves
+     * every replica that connects from its own thread.  used_blocks lists the
+     * blocks a new replica must copy.  Throws an exception if a syscall fails.
+     */
+    ReplicationSource(const std::string &path, used_blocks_fn used_blocks);
+
+    /*
+     * Logs a write of block for the connected replicas.  Call it after the
+     * block is on disk and before releasing the lock that orders writes to
+     * it, so the log has writes to one block in disk order.  Costs one atomic
+     * load while no replica is connected.
+     */
+    void record(uint32_t block, const void* data);
+
+    /*
+     * Writes the replication gauges in the Prometheus text format
+     */
+    void render(std::ostream &os);
+
+private:
+    struct logged_write {
+        uint64_t seq;
+        uint32_t block;
+        char data[FS_BLOCKSIZE];
+    };
+
+    struct replica {
+        std::deque<logged_write> queue;     // written but not sent yet
+        bool dropped = false;               // fell too far behind
+    };
+
+    void accept_loop();
+    void serve(int sock);
+
+    int listen_sock;
+    used_blocks_fn used_blocks;
+
+    boost::mutex m;
+    std::condition_variable_any cv;         // std:: for its std::chrono timed wait
+    uint64_t seq = 0;                       // of the last write logged
+    std::vector<std::shared_ptr<replica>> replicas;
+    std::atomic<size_t> replica_count{0};
+};
+
+/*
+ * The replica's side: follows a primary and says when reads may be served.
+ * Thread safe.
+ */
+class ReplicaSink {
+public:
+    using clock = std::chrono::steady_clock;
+    using read_view = boost::shared_lock<boost::shared_mutex>;
+
+    /*
+     * Follows the primary at the unix socket path from a thread of its own,
+     * reconnecting whenever the stream ends.
+     */
+    ReplicaSink(const std::string &path, std::chrono::milliseconds max_staleness);
+
+    /*
+     * A lock that keeps the stream from being applied while held, or an
+     * empty lock if the replica is not serving: not caught up yet, or its
+     * last heartbeat is older than the staleness bound.  Hold it for the
+     * whole request.
+     */
+    read_view begin_read();
+
+    /*
+     * Writes the replica gauges in the Prometheus text format
+     */
+    void render(std::ostream &os);
+
+private:
+    void follow_loop();
+    void follow(int sock);
+    void apply(std::vector<replication_msg> &headers, std::vector<const char*> &data);
+
+    std::string path;
+    std::chrono::milliseconds max_staleness;
+
+    boost::shared_mutex apply_mutex;        // unique while applying, shared while serving a read
+    std::atomic<bool> ready{false};         // caught up with the primary since the last copy
+    std::atomic<uint64_t> applied_seq{0};
+    std::atomic<clock::rep> fresh_at{0};    // when the last heartbeat applied arrived
+};
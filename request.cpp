@@ -3,7 +3,8 @@
 #include <cstring>
 #include <string>
 #include <netdb.h>
-#include <sstream> 
+#include <algorithm>
+#include <charconv>
 #include <cctype>
 #include <boost/regex.hpp>
 
@@ -27,6 +28,10 @@ static const boost::regex read_re{
     R"(^(FS_READBLOCK) ([^ ]+) (/[^ ]+) ([1-9][0-9]*|0)$)"
 };
 
+static const boost::regex readlease_re{
+    R"(^(FS_READLEASE) ([^ ]+) (/[^ ]+) ([1-9][0-9]*|0)$)"
+};
+
 static const boost::regex write_re{
     R"(^(FS_WRITEBLOCK) ([^ ]+) (/[^ ]+) ([1-9][0-9]*|0)$)"
 };
@@ -35,61 +40,243 @@ static const boost::regex create_re{
     R"(^(FS_CREATE) ([^ ]+) (/[^ ]+) ([fd])$)"
 };
 
+// the new entries follow the header, each "<name> <type>" null terminated
+static const boost::regex create_batch_re{
+    R"(^(FS_CREATE_BATCH) ([^ ]+) (/[^ ]*) ([1-9][0-9]{0,3})$)"
+};
+
+static const boost::regex copy_re{
+    R"(^(FS_COPY) ([^ ]+) (/[^ ]+) (/[^ ]+)$)"
+};
+
 static const boost::regex delete_re{
     R"(^(FS_DELETE) ([^ ]+) (/[^ ]+)$)"
 };
 
+static const boost::regex delete_tree_re{
+    R"(^(FS_DELETE_TREE) ([^ ]+) (/[^ ]+)$)"
+};
+
+static const boost::regex open_re{
+    R"(^(FS_OPEN) ([^ ]+) (/[^ ]+)$)"
+};
+
+// a handle is <inode_block>.<generation>, see Network::handle_of()
+static const boost::regex readhandle_re{
+    R"(^(FS_READHANDLE) ([^ ]+) ([0-9]{1,4}\.[1-9][0-9]{0,18}) ([1-9][0-9]*|0)$)"
+};
+
+static const boost::regex writehandle_re{
+    R"(^(FS_WRITEHANDLE) ([^ ]+) ([0-9]{1,4}\.[1-9][0-9]{0,18}) ([1-9][0-9]*|0)$)"
+};
+
+static const boost::regex stat_re{
+    R"(^(FS_STAT) ([^ ]+) (/[^ ]*)$)"
+};
+
+// the paths follow the header, each null terminated
+static const boost::regex statmany_re{
+    R"(^(FS_STATMANY) ([^ ]+) ([1-9][0-9]{0,3})$)"
+};
+
+// the cookie is where the listing resumes, see Network::sys_readdir()
+static const boost::regex readdir_re{
+    R"(^(FS_READDIR) ([^ ]+) (/[^ ]*) ([1-9][0-9]{0,3}|0)(?: (attrs))?$)"
+};
+
+// snapshot names are read back as a directory entry under "/.snapshots"
+static const boost::regex snapshot_re{
+    R"(^(FS_SNAPSHOT) ([^ ]+) (create|delete) ([^ /]+)$)"
+};
+
+static const boost::regex stats_re{
+    R"(^(FS_STATS) ([^ ]+)$)"
+};
+
+static const boost::regex lockprof_re{
+    R"(^(FS_LOCKPROF) ([^ ]+) (top|sample|reset)(?: ([1-9][0-9]{0,8}|0))?$)"
+};
+
+static const boost::regex session_re{
+    R"(^(FS_SESSION)$)"
+};
+
+static const boost::regex trace_re{
+    R"(^(FS_TRACE) ([^ ]+) (sample|dump)(?: ([1-9][0-9]{0,3}|0))?$)"
+};
 
-bool parse_request(std::string &header, request &out){
+const char* request_name(request_t type) {
+    switch (type) {
+        case FS_READBLOCK:  return "FS_READBLOCK";
+        case FS_WRITEBLOCK: return "FS_WRITEBLOCK";
+        case FS_CREATE:     return "FS_CREATE";
+        case FS_DELETE:     return "FS_DELETE";
+        case FS_STATS:      return "FS_STATS";
+        case FS_LOCKPROF:   return "FS_LOCKPROF";
+        case FS_TRACE:      return "FS_TRACE";
+        case FS_SESSION:    return "FS_SESSION";
+        case FS_READLEASE:  return "FS_READLEASE";
+        case FS_OPEN:       return "FS_OPEN";
+        case FS_READHANDLE: return "FS_READHANDLE";
+        case FS_WRITEHANDLE: return "FS_WRITEHANDLE";
+        case FS_STAT:       return "FS_STAT";
+        case FS_STATMANY:   return "FS_STATMANY";
+        case FS_READDIR:    return "FS_READDIR";
+        case FS_DELETE_TREE: return "FS_DELETE_TREE";
+        case FS_CREATE_BATCH: return "FS_CREATE_BATCH";
+        case FS_COPY:       return "FS_COPY";
+        case FS_SNAPSHOT:   return "FS_SNAPSHOT";
+    }
+    return "UNKNOWN";
+}
+
+
+bool parse_request(std::string_view header, request &out){
     // the object that will hold the contents if there is a match
     // m[0] is the entire capture 
     // 1, n is the other caputes
-    boost::smatch m;
+    // matched in place, with the captures in the request's memory
+    std::pmr::memory_resource* arena = out.path.get_allocator().resource();
+    request_match m(arena);
+    const char* first = header.data();
+    const char* last  = header.data() + header.size();
 
-    if(boost::regex_match(header, m, read_re)){
+    if(boost::regex_match(first, last, m, read_re)){
         out.type     = FS_READBLOCK;
         if(!fill_user_and_path(m, out)) return false;
         if(!fill_block(m, out))         return false;
-    } else if(boost::regex_match(header, m, write_re)){
+    } else if(boost::regex_match(first, last, m, readlease_re)){
+        out.type     = FS_READLEASE;
+        if(!fill_user_and_path(m, out)) return false;
+        if(!fill_block(m, out))         return false;
+    } else if(boost::regex_match(first, last, m, write_re)){
         out.type     = FS_WRITEBLOCK;
         if(!fill_user_and_path(m, out)) return false;
         if(!fill_block(m, out))         return false;
-    } else if(boost::regex_match(header, m, create_re)){
+    } else if(boost::regex_match(first, last, m, open_re)){
+        out.type     = FS_OPEN;
+        if(!fill_user_and_path(m, out)) return false;
+    } else if(boost::regex_match(first, last, m, readhandle_re)){
+        out.type     = FS_READHANDLE;
+        if(!fill_user(m, out))          return false;
+        if(!fill_handle(m, out))        return false;
+        if(!fill_block(m, out))         return false;
+    } else if(boost::regex_match(first, last, m, writehandle_re)){
+        out.type     = FS_WRITEHANDLE;
+        if(!fill_user(m, out))          return false;
+        if(!fill_handle(m, out))        return false;
+        if(!fill_block(m, out))         return false;
+    } else if(boost::regex_match(first, last, m, stat_re)){
+        out.type     = FS_STAT;
+        if(!fill_user(m, out))          return false;
+        out.pathname.assign(m[3].first, m[3].second);
+        // unlike other requests, the root can be looked up
+        if (out.pathname != "/" && !fill_user_and_path(m, out)) return false;
+        out.paths.push_back(out.pathname);
+    } else if(boost::regex_match(first, last, m, statmany_re)){
+        out.type     = FS_STATMANY;
+        if(!fill_user(m, out))          return false;
+        out.arg      = std::stoul(m[3]);
+        if (out.arg > FS_MAXSTATMANY)   return false;
+    } else if(boost::regex_match(first, last, m, readdir_re)){
+        out.type     = FS_READDIR;
+        if(!fill_user(m, out))          return false;
+        out.pathname.assign(m[3].first, m[3].second);
+        // the root can be listed too
+        if (out.pathname != "/" && !fill_user_and_path(m, out)) return false;
+        out.arg      = std::stoul(m[4]);
+        if (out.arg >= FS_MAXFILEBLOCKS * FS_DIRENTRIES) return false;
+        out.command.assign(m[5].first, m[5].second);
+    } else if(boost::regex_match(first, last, m, create_re)){
         out.type        = FS_CREATE;
         if(!fill_user_and_path(m, out)) return false;
         out.create_type = m[4].str()[0];
-    } else if(boost::regex_match(header, m, delete_re)){
+    } else if(boost::regex_match(first, last, m, create_batch_re)){
+        out.type        = FS_CREATE_BATCH;
+        if(!fill_user(m, out))          return false;
+        out.pathname.assign(m[3].first, m[3].second);
+        // entries can be created in the root too
+        if (out.pathname != "/" && !fill_user_and_path(m, out)) return false;
+        out.arg         = std::stoul(m[4]);
+        if (out.arg > FS_MAXCREATEBATCH) return false;
+    } else if(boost::regex_match(first, last, m, copy_re)){
+        out.type        = FS_COPY;
+        if(!fill_user_and_path(m, out)) return false;
+        out.target.assign(m[4].first, m[4].second);
+        out.target_path = split_path_ss(out.target, arena);
+        if (out.target_path.empty())    return false;
+    } else if(boost::regex_match(first, last, m, delete_re)){
         out.type        = FS_DELETE;
         if(!fill_user_and_path(m, out)) return false;
+    } else if(boost::regex_match(first, last, m, delete_tree_re)){
+        out.type        = FS_DELETE_TREE;
+        if(!fill_user_and_path(m, out)) return false;
+    } else if(boost::regex_match(first, last, m, snapshot_re)){
+        out.type        = FS_SNAPSHOT;
+        if(!fill_user(m, out))          return false;
+        out.command.assign(m[3].first, m[3].second);
+        out.target.assign(m[4].first, m[4].second);
+        if (out.target.size() > FS_MAXFILENAME || out.target == "." || out.target == "..") return false;
+    } else if(boost::regex_match(first, last, m, stats_re)){
+        out.type        = FS_STATS;
+        if(!fill_user(m, out))          return false;
+    } else if(boost::regex_match(first, last, m, lockprof_re)){
+        out.type        = FS_LOCKPROF;
+        if(!fill_user(m, out))          return false;
+        out.command.assign(m[3].first, m[3].second);
+        // top and sample take a number, reset does not
+        if (m[4].matched == (out.command == "reset")) return false;
+        if (m[4].matched) {
+            out.arg     = std::stoul(m[4]);
+        }
+    } else if(boost::regex_match(first, last, m, session_re)){
+        out.type        = FS_SESSION;
+    } else if(boost::regex_match(first, last, m, trace_re)){
+        out.type        = FS_TRACE;
+        if(!fill_user(m, out))          return false;
+        out.command.assign(m[3].first, m[3].second);
+        // sample takes a per mille rate, dump does not
+        if (m[4].matched != (out.command == "sample")) return false;
+        if (m[4].matched) {
+            out.arg     = std::stoul(m[4]);
+            if (out.arg > 1000) return false;
+        }
     } else {
         // else its invalid input
         return false;
     }
-    out.header = header;
+    out.header.assign(header);
     return true;
 } // parse_request()
 
-bool fill_user_and_path(const boost::smatch &m, request &out) { 
-    out.username    = m[2];
+bool fill_user(const request_match &m, request &out) {
+    out.username.assign(m[2].first, m[2].second);
     if (out.username.empty() || 
         out.username.size() > FS_MAXUSERNAME ||
         has_space(out.username)) {
         return false;
     }
+    return true;
+}
 
-    out.pathname = m[3];
+bool fill_user_and_path(const request_match &m, request &out) { 
+    if (!fill_user(m, out)) {
+        return false;
+    }
+
+    out.pathname.assign(m[3].first, m[3].second);
     if (has_space(out.pathname)) {
         return false;
     }
 
-    out.path = split_path_ss(out.pathname);
+    out.path = split_path_ss(out.pathname, out.path.get_allocator().resource());
     if (out.path.empty()) {
         return false;
     }
     return true;
 }
 
-bool fill_block(const boost::smatch &m, request &out) {
+bool fill_block(const request_match &m, request &out) {
     out.block = std::stoll(m[4]);
     if (out.block < 0 || 
         static_cast<unsigned int>(out.block) >= FS_MAXFILEBLOCKS) {
@@ -98,37 +285,52 @@ bool fill_block(const boost::smatch &m, request &out) {
     return true;
 }
 
-std::deque<std::string> split_path_ss(const std::string &path) {
-    std::deque<std::string> d;
-    // skip initial /
-    std::stringstream ss(path.substr(1)); 
-    std::string step;
+bool fill_handle(const request_match &m, request &out) {
+    // the regex bounds both numbers, so they fit
+    const char* dot = std::find(m[3].first, m[3].second, '.');
+    std::from_chars(m[3].first, dot, out.inode_block);
+    std::from_chars(dot + 1, m[3].second, out.generation);
+    if (out.inode_block >= FS_DISKSIZE) {
+        return false;
+    }
+    // shows up as the path in the lock profiler
+    out.pathname.assign(m[3].first, m[3].second);
+    return true;
+}
+
+path_t split_path_ss(std::string_view path, std::pmr::memory_resource* arena) {
+    path_t d(arena);
 
     // should always begin with / 
     if(path.empty() || path[0] != '/') {
-        return {};
+        return d;
     }
 
     // should not end with /
     if(path.size() > 1 && path.back() == '/') {
-        return {};
+        return d;
     }
     // max path limit 
     if(path.size() > FS_MAXPATHNAME) {
-        return {};
+        return d;
     }
 
-    while(std::getline(ss, step, '/')){
+    // skip initial /
+    path.remove_prefix(1);
+    while(!path.empty()){
+        std::string_view step = path.substr(0, path.find('/'));
         // if its a // or its too big return error
         if (step.empty() || step.size() > FS_MAXFILENAME) {
-            return {};
+            d.clear();
+            return d;
         }
-        d.push_back(step);
+        d.emplace_back(step);
+        path.remove_prefix(std::min(step.size() + 1, path.size()));
     }
     return d;
 } // split_path_ss
 
-bool has_space(std::string& s) {
+bool has_space(std::string_view s) {
     for (unsigned char c: s) {
         if (std::isspace(c)) {
             return true;
@@ -2,9 +2,13 @@
 #pragma once
 
 #include <iostream>
+#include <cstdint>
 #include <cstring>
 #include <string>
 #include <deque>
+#include <vector>
+#include <memory_resource>
+#include <string_view>
 #include <netdb.h>
 #include <sstream>
 #include <boost/regex.hpp>
@@ -15,17 +19,64 @@ enum request_t { // request type
      FS_READBLOCK, 
      FS_WRITEBLOCK, 
      FS_CREATE, 
-     FS_DELETE
+     FS_DELETE,
+     FS_STATS,
+     FS_LOCKPROF,
+     FS_TRACE,
+     FS_SESSION,
+     FS_READLEASE,
+     FS_OPEN,
+     FS_READHANDLE,
+     FS_WRITEHANDLE,
+     FS_STAT,
+     FS_STATMANY,
+     FS_READDIR,
+     FS_DELETE_TREE,
+     FS_CREATE_BATCH,
+     FS_COPY,
+     FS_SNAPSHOT
 };
 
+// number of request types, keep in sync with request_t
+static constexpr unsigned int FS_REQUEST_TYPES = FS_SNAPSHOT + 1;
+
+/*
+ * The protocol name of a request type, e.g. "FS_READBLOCK"
+ */
+const char* request_name(request_t type);
+
+// a path split up, see split_path_ss()
+using path_t = std::pmr::deque<std::pmr::string>;
+
+// the regex captures of a header
+using request_match = boost::match_results<const char*, std::pmr::polymorphic_allocator<boost::sub_match<const char*>>>;
+
+/*
+ * The variable length parts of a request live in the memory resource it is
+ * made with, a connection's request_arena (arena.hpp) on the server.  The
+ * username and the admin subcommand always fit in std::string's inline
+ * buffer.
+ */
 struct request { // request info struct
+    explicit request(std::pmr::memory_resource* arena = std::pmr::get_default_resource())
+        : pathname(arena), header(arena), path(arena), target(arena), target_path(arena), paths(arena) {}
+
     request_t type;                 
     int block;                      // what block was requsted
     std::string username;          
-    std::string pathname;           
-    std::string header;             // the original unparsed input
+    std::pmr::string pathname;           
+    std::pmr::string header;        // the original unparsed input
     char create_type;               // 'f' or 'd'
-    std::deque<std::string> path;   // path split up
+    path_t path;                    // path split up
+    std::pmr::string target;        // FS_COPY: the destination pathname, FS_SNAPSHOT: the snapshot's name
+    path_t target_path;             // FS_COPY: the destination split up
+    std::string command;            // subcommand of admin requests, e.g. "top", FS_READDIR's "attrs"
+                                    // or FS_SNAPSHOT's "create"/"delete"
+    unsigned long arg = 0;          // numeric argument of the subcommand, or FS_READDIR's cookie
+    uint32_t inode_block = 0;       // handle requests: the file's inode
+    uint64_t generation = 0;        // handle requests: the inode's generation when opened
+    std::pmr::vector<std::pmr::string> paths; // FS_STAT and FS_STATMANY: the paths to look up,
+                                    // FS_CREATE_BATCH: "<name> <type>" of each new entry
     char buf[FS_BLOCKSIZE];         // either the read data or the write data
 };
 
@@ -37,26 +88,37 @@ struct request { // request info struct
  * parse_request returns trye on success, false on failure. 
  *
  */
-bool parse_request(std::string &header, request &out);
+bool parse_request(std::string_view header, request &out);
 
 /*
- * Split the path from the parser into a deque of elements.
+ * Split the path from the parser into a deque of elements, allocated from
+ * arena.  Returns an empty deque for "/" and for invalid paths.
  */
-std::deque<std::string> split_path_ss(const std::string &path);
+path_t split_path_ss(std::string_view path, std::pmr::memory_resource* arena = std::pmr::get_default_resource());
+
+/*
+ * Fill the user part of our request object
+*/
+bool fill_user(const request_match &m, request &out);
 
 /*
  * Fill the user and path parts of our request object
 */
-bool fill_user_and_path(const boost::smatch &m, request &out);
+bool fill_user_and_path(const request_match &m, request &out);
 
 /*
  * Fill the block of our request object
 */
-bool fill_block(const boost::smatch &m, request &out);
+bool fill_block(const request_match &m, request &out);
+
+/*
+ * Fill the handle parts of our request object from a handle in m[3]
+ */
+bool fill_handle(const request_match &m, request &out);
 
 
 /* 
  * Use ssis_space to check for spaces 
  * Also checks for special characters
 */
-bool has_space(std::string& s);
\ No newline at end of file
+bool has_space(std::string_view s);
\ No newline at end of file
@@ -0,0 +1,251 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "scheduler.hpp"
+
+/***************************************************************************************************
+ *                                            Scheduler                                            *
+ ***************************************************************************************************/
+
+/* function docs are in the header file */
+
+// epoll events handled per epoll_wait()
+static constexpr int EVENTS_PER_WAIT = 64;
+
+event_loop::event_loop() {
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epfd < 0 || wakefd < 0) {
+        throw std::runtime_error("syscall to epoll_create1() or eventfd() failed");
+    }
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;          // the wake up fd is the only one without a socket_io
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev) < 0) {
+        throw std::runtime_error("syscall to epoll_ctl() failed");
+    }
+}
+
+event_loop::~event_loop() {
+    close(wakefd);
+    close(epfd);
+}
+
+void event_loop::post(std::coroutine_handle<> h) {
+    bool was_empty = false;
+    {
+        boost::lock_guard<boost::mutex> g(posted_mutex);
+        was_empty = posted.empty();
+        posted.push_back(h);
+    }
+    // one wake up is enough for everything posted before the loop drains the list
+    if (was_empty) {
+        uint64_t one = 1;
+        ssize_t n = write(wakefd, &one, sizeof(one));
+        (void)n;
+    }
+}
+
+void event_loop::wait(socket_io &io, uint32_t events, std::coroutine_handle<> h) {
+    io.waiter = h;
+    epoll_event ev{};
+    // one shot: the fd is disarmed once it fires until the coroutine waits again
+    ev.events = events | EPOLLONESHOT | EPOLLRDHUP;
+    ev.data.ptr = &io;
+    int op = io.registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    io.registered = true;
+    if (epoll_ctl(epfd, op, io.fd, &ev) < 0) {
+        // the fd is unusable, let the coroutine find out from its next syscall
+        post(h);
+    }
+}
+
+void event_loop::run() {
+    epoll_event events[EVENTS_PER_WAIT];
+    std::vector<std::coroutine_handle<>> ready;
+    while (true) {
+        int n = epoll_wait(epfd, events, EVENTS_PER_WAIT, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error("syscall to epoll_wait() failed");
+        }
+        for (int i = 0; i < n; ++i) {
+            socket_io* io = static_cast<socket_io*>(events[i].data.ptr);
+            if (io == nullptr) {
+                uint64_t count = 0;
+                ssize_t r = read(wakefd, &count, sizeof(count));
+                (void)r;
+                continue;
+            }
+            ready.push_back(std::exchange(io->waiter, {}));
+        }
+        {
+            boost::lock_guard<boost::mutex> g(posted_mutex);
+            ready.insert(ready.end(), posted.begin(), posted.end());
+            posted.clear();
+        }
+        for (std::coroutine_handle<> h : ready) {
+            h.resume();
+        }
+        ready.clear();
+    }
+} // event_loop::run()
+
+worker_pool::worker_pool(unsigned int threads, AdmissionControl* admission, weight_fn weight)
+    : admission(admission), fair(weight ? std::move(weight) : [](const std::string&) { return 1u; }, &queue_memory) {
+    for (unsigned int i = 0; i < threads; ++i) {
+        boost::thread t(&worker_pool::run, this);
+        t.detach();
+    }
+}
+
+void worker_pool::submit(std::function<void()> job) {
+    {
+        boost::lock_guard<boost::mutex> g(m);
+        priority.push_back(entry{std::move(job), {}, AdmissionControl::clock::now()});
+    }
+    cv.notify_one();
+}
+
+void worker_pool::submit(const std::string &flow, std::function<void()> job, std::function<void()> shed) {
+    entry e{std::move(job), std::move(shed), AdmissionControl::clock::now()};
+    entry victim;
+    bool admitted = true;
+    {
+        boost::lock_guard<boost::mutex> g(m);
+        if (admission && !admission->arrive()) {
+            // the queue is full, make room at the expense of the longest flow if that is another one
+            admitted = fair.displace(flow, victim);
+        }
+        if (admitted) {
+            fair.push(flow, std::move(e));
+        }
+    }
+    // answer shed jobs now rather than after everything queued
+    if (!admitted) {
+        e.shed();
+        return;
+    }
+    if (victim.shed) {
+        victim.shed();
+    }
+    cv.notify_one();
+}
+
+void worker_pool::run() {
+    while (true) {
+        entry e;
+        bool shed = false;
+        {
+            boost::unique_lock<boost::mutex> g(m);
+            while (priority.empty() && fair.empty()) {
+                cv.wait(g);
+            }
+            if (!priority.empty()) {
+                e = std::move(priority.front());
+                priority.pop_front();
+            } else {
+                e = fair.pop();
+            }
+            if (e.shed && admission) {
+                shed = admission->depart(AdmissionControl::clock::now(), e.enqueued);
+            }
+        }
+        if (shed) {
+            e.shed();
+        } else {
+            e.job();
+        }
+    }
+}
+
+static unsigned int cores() {
+    unsigned int n = boost::thread::hardware_concurrency();
+    return n == 0 ? 1 : n;
+}
+
+// the CPUs this process may run on
+static std::vector<int> usable_cpus() {
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &set)) {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+    if (cpus.empty()) {
+        for (unsigned int cpu = 0; cpu < cores(); ++cpu) {
+            cpus.push_back(static_cast<int>(cpu));
+        }
+    }
+    return cpus;
+}
+
+Scheduler::Scheduler(unsigned int loops, unsigned int workers, AdmissionControl* admission, weight_fn weight,
+                     unsigned int groups)
+    : workers_(workers != 0 ? workers : DEFAULT_WORKERS_PER_CORE * cores(), admission, std::move(weight)) {
+    if (loops == 0) {
+        loops = cores();
+    }
+    if (groups == 0) {
+        groups_.push_back(loop_group{0, loops});
+    } else {
+        loops = std::max(loops, groups);
+        std::vector<int> cpus = usable_cpus();
+        for (unsigned int g = 0; g < groups; ++g) {
+            // neighbouring loops and neighbouring CPUs, more groups than CPUs share them round robin
+            size_t first = static_cast<size_t>(g) * loops / groups;
+            size_t last = static_cast<size_t>(g + 1) * loops / groups;
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            if (groups <= cpus.size()) {
+                for (size_t c = g * cpus.size() / groups; c < (g + 1) * cpus.size() / groups; ++c) {
+                    CPU_SET(cpus[c], &set);
+                }
+            } else {
+                CPU_SET(cpus[g % cpus.size()], &set);
+            }
+            groups_.push_back(loop_group{first, last - first, 0, set});
+        }
+    }
+    for (unsigned int g = 0; g < groups_.size(); ++g) {
+        for (size_t i = 0; i < groups_[g].count; ++i) {
+            loops_.push_back(std::make_unique<event_loop>());
+            event_loop* loop = loops_.back().get();
+            boost::thread t([this, loop, g]() {
+                pin_to_group(g);
+                loop->run();
+            });
+            t.detach();
+        }
+    }
+}
+
+event_loop& Scheduler::next_loop(unsigned int group) {
+    loop_group &g = groups_[group];
+    event_loop &loop = *loops_[g.first + g.next];
+    g.next = (g.next + 1) % g.count;
+    return loop;
+}
+
+void Scheduler::pin_to_group(unsigned int group) {
+    const std::optional<cpu_set_t> &cpus = groups_[group].cpus;
+    if (cpus) {
+        // best effort, an unpinned thread still works
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &*cpus);
+    }
+}
+
+void Scheduler::spawn(event_loop &loop, task<void> t) {
+    loop.post(t.release());
+}
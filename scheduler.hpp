@@ -0,0 +1,446 @@
+/***************************************************************************************************
+ *                                            Scheduler                                            *
+ ***************************************************************************************************/
+#pragma once
+
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <optional>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <sched.h>
+
+#include <boost/thread.hpp>
+
+#include "admission.hpp"
+#include "fair_queue.hpp"
+#include "tracer.hpp"
+
+/*
+ * Coroutine runtime for connection I/O.
+ *
+ * Every connection is a coroutine that runs on one of a few event loops (one
+ * per core by default) and suspends while its socket is not ready, so an idle
+ * connection costs its coroutine frame and receive buffer instead of a thread
+ * stack.  The disk library and the inode locks block, so request handlers are
+ * offloaded to a pool of worker threads and the connection co_awaits their
+ * result.
+ *
+ * The tracer's per-request state is thread local; every suspension point
+ * saves it and restores it on resumption, so a coroutine keeps its trace
+ * context whichever thread it resumes on.
+ */
+
+/*
+ * Lazily started coroutine returning T.  co_await runs it and resumes the
+ * awaiter when it finishes; exceptions propagate to the awaiter.
+ */
+template <typename T = void>
+class task;
+
+namespace task_detail {
+
+/*
+ * Free coroutine frames of the calling thread, by size rounded up to
+ * FRAME_GRANULE.  Frames are kept for reuse instead of going back to the
+ * heap, so the coroutines a request awaits (receive_data(), send_all(), ...)
+ * allocate nothing once every thread has seen a request.  A frame freed on
+ * another thread than the one that allocated it joins the freeing thread's
+ * cache.  The cache is never torn down: the loop and worker threads live as
+ * long as the server.
+ */
+static constexpr size_t FRAME_GRANULE    = 64;
+static constexpr size_t MAX_CACHED_FRAME = 4096;    // larger frames (a connection's) use the heap
+static constexpr size_t FRAMES_PER_CLASS = 64;      // per thread
+
+struct frame_cache {
+    struct free_frame {
+        free_frame* next;
+    };
+    struct size_class {
+        free_frame* head = nullptr;
+        size_t count = 0;
+    };
+    size_class classes[MAX_CACHED_FRAME / FRAME_GRANULE];
+
+    static frame_cache& local() {
+        static thread_local frame_cache cache;
+        return cache;
+    }
+
+    static void* allocate(size_t size) {
+        if (size > MAX_CACHED_FRAME) {
+            return ::operator new(size);
+        }
+        size_class &c = local().classes[(size - 1) / FRAME_GRANULE];
+        if (free_frame* f = c.head) {
+            c.head = f->next;
+            --c.count;
+            return f;
+        }
+        return ::operator new(((size - 1) / FRAME_GRANULE + 1) * FRAME_GRANULE);
+    }
+
+    static void deallocate(void* p, size_t size) noexcept {
+        if (size > MAX_CACHED_FRAME) {
+            ::operator delete(p);
+            return;
+        }
+        size_class &c = local().classes[(size - 1) / FRAME_GRANULE];
+        if (c.count == FRAMES_PER_CLASS) {
+            ::operator delete(p);
+            return;
+        }
+        c.head = new (p) free_frame{c.head};
+        ++c.count;
+    }
+};
+
+struct promise_base {
+    std::coroutine_handle<> continuation = std::noop_coroutine();
+    std::exception_ptr error;
+    bool detached = false;                  // nothing awaits it, it frees itself
+
+    // the coroutine's frame, see frame_cache
+    static void* operator new(size_t size) { return frame_cache::allocate(size); }
+    static void operator delete(void* p, size_t size) noexcept { frame_cache::deallocate(p, size); }
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    struct final_awaiter {
+        bool await_ready() noexcept { return false; }
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept {
+            if (h.promise().detached) {
+                h.destroy();
+                return std::noop_coroutine();
+            }
+            return h.promise().continuation;
+        }
+        void await_resume() noexcept {}
+    };
+    final_awaiter final_suspend() noexcept { return {}; }
+
+    void unhandled_exception() { error = std::current_exception(); }
+};
+
+template <typename T>
+struct promise : promise_base {
+    std::optional<T> value;
+
+    task<T> get_return_object();
+    void return_value(T v) { value.emplace(std::move(v)); }
+    T result() {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        return std::move(*value);
+    }
+};
+
+template <>
+struct promise<void> : promise_base {
+    task<void> get_return_object();
+    void return_void() {}
+    void result() {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+};
+
+} // namespace task_detail
+
+template <typename T>
+class task {
+public:
+    using promise_type = task_detail::promise<T>;
+    using handle = std::coroutine_handle<promise_type>;
+
+    explicit task(handle h) : h_(h) {}
+    task(task &&other) noexcept : h_(std::exchange(other.h_, {})) {}
+    task(const task&) = delete;
+    task& operator=(const task&) = delete;
+    task& operator=(task&&) = delete;
+    ~task() {
+        if (h_) {
+            h_.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept {
+        h_.promise().continuation = awaiter;
+        return h_;
+    }
+    T await_resume() { return h_.promise().result(); }
+
+    /*
+     * Hands the coroutine over to the caller, used to start top level tasks.
+     * It frees itself when it finishes.
+     */
+    handle release() {
+        h_.promise().detached = true;
+        return std::exchange(h_, {});
+    }
+
+private:
+    handle h_;
+};
+
+template <typename T>
+task<T> task_detail::promise<T>::get_return_object() {
+    return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+}
+
+inline task<void> task_detail::promise<void>::get_return_object() {
+    return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this));
+}
+
+/*
+ * Tracer state of the running coroutine, carried across suspension points
+ */
+struct trace_context {
+    Tracer::context saved = Tracer::save();
+    void restore() const { Tracer::restore(saved); }
+};
+
+class event_loop;
+
+/*
+ * A non-blocking socket owned by one coroutine on one event loop
+ */
+struct socket_io {
+    int fd;
+    event_loop* loop;
+    bool registered = false;                // added to the loop's epoll set
+    std::coroutine_handle<> waiter{};       // coroutine waiting for readiness
+};
+
+/*
+ * One epoll event loop.  Coroutines are resumed on its thread when their
+ * socket is ready or when they are posted from another thread.
+ */
+class event_loop {
+public:
+    event_loop();
+    ~event_loop();
+    event_loop(const event_loop&) = delete;
+    event_loop& operator=(const event_loop&) = delete;
+
+    /*
+     * Runs the loop on the calling thread, never returns
+     */
+    void run();
+
+    /*
+     * Resumes h on this loop's thread.  Thread safe.
+     */
+    void post(std::coroutine_handle<> h);
+
+    /*
+     * Suspends the calling coroutine until io.fd has one of events (EPOLLIN,
+     * EPOLLOUT) or an error.  Only call from this loop's thread.
+     */
+    void wait(socket_io &io, uint32_t events, std::coroutine_handle<> h);
+
+private:
+    int epfd;
+    int wakefd;                                      // eventfd, wakes the loop for posted coroutines
+
+    boost::mutex posted_mutex;
+    std::vector<std::coroutine_handle<>> posted;
+};
+
+/*
+ * Awaitable: suspends until io is readable (EPOLLIN) or writable (EPOLLOUT)
+ */
+struct ready_for {
+    socket_io &io;
+    uint32_t events;
+    trace_context ctx{};
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) {
+        ctx = trace_context{};
+        io.loop->wait(io, events, h);
+    }
+    void await_resume() const { ctx.restore(); }
+};
+
+// weight of a user's share of the workers, see FairQueue
+using weight_fn = std::function<unsigned int(const std::string&)>;
+
+/*
+ * Fixed pool of threads that run blocking work
+ */
+class worker_pool {
+public:
+    worker_pool(unsigned int threads, AdmissionControl* admission, weight_fn weight);
+
+    /*
+     * Queues job ahead of any fair share work
+     */
+    void submit(std::function<void()> job);
+
+    /*
+     * Queues job in flow's queue, which gets its weighted share of the
+     * workers.  When the pool is overloaded shed() runs instead of job(),
+     * either right away or once the job reaches the head of the queue.  A
+     * full queue sheds from its longest flow, so one flow cannot crowd the
+     * others out.
+     */
+    void submit(const std::string &flow, std::function<void()> job, std::function<void()> shed);
+
+private:
+    struct entry {
+        std::function<void()> job;
+        std::function<void()> shed;
+        AdmissionControl::clock::time_point enqueued;
+    };
+
+    void run();
+
+    AdmissionControl* admission;                    // nullptr admits everything
+
+    boost::mutex m;
+    boost::condition_variable cv;
+    std::pmr::unsynchronized_pool_resource queue_memory;    // for both queues, under m
+    std::pmr::deque<entry> priority{&queue_memory};
+    FairQueue<entry> fair;
+};
+
+class Scheduler {
+public:
+    /*
+     * Starts loops event loop threads and workers worker threads, 0 means one
+     * loop per core and DEFAULT_WORKERS_PER_CORE workers per core.  Jobs
+     * started with try_offload() are admitted by admission, if given, and
+     * share the workers by weight (1 for every flow if not given).
+     *
+     * With groups > 0 the usable CPUs are split into that many groups and the
+     * loops into as many groups of neighbouring loops (at least one each);
+     * each loop thread is pinned to its group's CPUs.  0 pins nothing and
+     * makes a single group.
+     */
+    Scheduler(unsigned int loops, unsigned int workers, AdmissionControl* admission = nullptr,
+              weight_fn weight = {}, unsigned int groups = 0);
+
+    /*
+     * Starts t on loop.  t owns itself from here on and is destroyed when it
+     * finishes.
+     */
+    void spawn(event_loop &loop, task<void> t);
+
+    /*
+     * Awaitable: runs fn() on a worker thread and resumes the awaiting
+     * coroutine on its event loop with the result
+     */
+    template <typename Fn>
+    auto offload(event_loop &loop, Fn fn);
+
+    /*
+     * offload() as part of flow's fair share, subject to admission control:
+     * resumes with an empty optional if the job was shed instead of run
+     */
+    template <typename Fn>
+    auto try_offload(event_loop &loop, const std::string &flow, Fn fn);
+
+    /*
+     * The loop for the next connection, round robin over the loops of group.
+     * Only call from the thread accepting for that group.
+     */
+    event_loop& next_loop(unsigned int group = 0);
+
+    /*
+     * Pins the calling thread to group's CPUs, if the loops are pinned
+     */
+    void pin_to_group(unsigned int group);
+
+    unsigned int groups() const { return static_cast<unsigned int>(groups_.size()); }
+
+private:
+    template <typename Fn, bool Sheddable>
+    struct offload_awaitable;
+
+    // a run of loops sharing a set of CPUs, and the accepting thread that feeds them
+    struct loop_group {
+        size_t first;                       // index of its first loop in loops_
+        size_t count;
+        size_t next = 0;                    // round robin position, touched by the accepting thread only
+        std::optional<cpu_set_t> cpus{};    // none when nothing is pinned
+    };
+
+    std::vector<std::unique_ptr<event_loop>> loops_;
+    std::vector<loop_group> groups_;
+    worker_pool workers_;
+};
+
+// handler threads per core when none are configured; handlers spend most of their time blocked
+static constexpr unsigned int DEFAULT_WORKERS_PER_CORE = 4;
+
+template <typename Fn, bool Sheddable>
+struct Scheduler::offload_awaitable {
+    using result_t = decltype(std::declval<Fn&>()());
+
+    worker_pool &pool;
+    event_loop &loop;
+    Fn fn;
+    std::string flow{};
+    std::optional<result_t> result{};
+    std::exception_ptr error{};
+    trace_context ctx{};
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) {
+        ctx = trace_context{};
+        auto job = [this, h]() {
+            // the job runs as part of the suspended coroutine's request
+            ctx.restore();
+            try {
+                result.emplace(fn());
+            } catch (...) {
+                error = std::current_exception();
+            }
+            Tracer::instance().end_request();
+            loop.post(h);
+        };
+        if constexpr (Sheddable) {
+            // a shed job resumes the coroutine with no result
+            pool.submit(flow, job, [this, h]() { loop.post(h); });
+        } else {
+            pool.submit(job);
+        }
+    }
+    std::conditional_t<Sheddable, std::optional<result_t>, result_t> await_resume() {
+        ctx.restore();
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        if constexpr (Sheddable) {
+            return std::move(result);
+        } else {
+            return std::move(*result);
+        }
+    }
+};
+
+template <typename Fn>
+auto Scheduler::offload(event_loop &loop, Fn fn) {
+    return offload_awaitable<Fn, false>{workers_, loop, std::move(fn)};
+}
+
+template <typename Fn>
+auto Scheduler::try_offload(event_loop &loop, const std::string &flow, Fn fn) {
+    return offload_awaitable<Fn, true>{workers_, loop, std::move(fn), flow};
+}
@@ -0,0 +1,151 @@
+#include "snapshot.hpp"
+
+/***************************************************************************************************
+ *                                          SnapshotTable                                          *
+ ***************************************************************************************************/
+
+/* function docs are in the header file */
+
+SnapshotTable::SnapshotTable(in_use_fn in_use, alloc_fn alloc, free_fn free)
+    : in_use(std::move(in_use)), alloc(std::move(alloc)), free(std::move(free)) {}
+
+boost::shared_lock<boost::shared_mutex> SnapshotTable::before_write(uint32_t block) {
+    boost::shared_lock<boost::shared_mutex> g(write_mutex);
+    // taking a snapshot waits for g, so no capture of block can start meanwhile
+    if (captures[block].load(std::memory_order_relaxed) == 0) {
+        return g;
+    }
+
+    std::vector<uint32_t> freed;
+    {
+        boost::unique_lock<boost::shared_mutex> s(snapshot_mutex);
+        char data[FS_BLOCKSIZE];
+        bool have_data = false;
+        for (auto &[name, snap] : snapshots) {
+            if (snap->gone || !snap->captured.test(block)) {
+                continue;
+            }
+            if (!have_data) {
+                disk_readblock(block, data);
+                have_data = true;
+            }
+            // never copy to a block that a snapshot still reads in place
+            int copy = alloc([this](uint32_t b) { return captures[b].load(std::memory_order_relaxed) == 0; });
+            if (copy < 0) {
+                // the disk is full, give up this snapshot rather than the write
+                snap->lost = true;
+                release(*snap, freed);
+                continue;
+            }
+            disk_writeblock(static_cast<uint32_t>(copy), data);
+            snap->moved[block] = static_cast<uint32_t>(copy);
+            ++snap->moved_count;
+            snap->captured.reset(block);
+            --captures[block];
+        }
+    }
+    if (!freed.empty()) {
+        free(freed);
+    }
+    return g;
+} // SnapshotTable::before_write()
+
+bool SnapshotTable::create(const std::string &name, const std::string &owner) {
+    boost::unique_lock<boost::shared_mutex> w(write_mutex);
+    boost::unique_lock<boost::shared_mutex> s(snapshot_mutex);
+    if (snapshots.size() >= FS_MAXSNAPSHOTS || snapshots.count(name)) {
+        return false;
+    }
+    auto snap = std::make_shared<snapshot>();
+    snap->owner = owner;
+    snap->captured = in_use();
+    for (uint32_t block = 0; block < FS_DISKSIZE; ++block) {
+        if (snap->captured.test(block)) {
+            ++captures[block];
+        }
+    }
+    snapshots.emplace(name, std::move(snap));
+    return true;
+}
+
+bool SnapshotTable::remove(const std::string &name, const std::string &user) {
+    std::vector<uint32_t> freed;
+    {
+        boost::unique_lock<boost::shared_mutex> s(snapshot_mutex);
+        auto it = snapshots.find(name);
+        if (it == snapshots.end() || it->second->owner != user) {
+            return false;
+        }
+        release(*it->second, freed);
+        snapshots.erase(it);
+    }
+    free(freed);
+    return true;
+}
+
+std::shared_ptr<const SnapshotTable::snapshot> SnapshotTable::find(const std::string &name) {
+    boost::shared_lock<boost::shared_mutex> s(snapshot_mutex);
+    auto it = snapshots.find(name);
+    if (it == snapshots.end() || it->second->gone) {
+        return nullptr;
+    }
+    return it->second;
+}
+
+std::vector<std::string> SnapshotTable::names() {
+    boost::shared_lock<boost::shared_mutex> s(snapshot_mutex);
+    std::vector<std::string> res;
+    for (const auto &[name, snap] : snapshots) {
+        res.push_back(name);
+    }
+    return res;
+}
+
+bool SnapshotTable::read(const snapshot &snap, uint32_t block, void* buf) {
+    // a shared snapshot_mutex keeps the block from being copied out and then
+    // overwritten while it is read in place
+    boost::shared_lock<boost::shared_mutex> s(snapshot_mutex);
+    if (snap.gone || block >= FS_DISKSIZE) {
+        return false;
+    }
+    disk_readblock(snap.moved[block] ? snap.moved[block] : block, buf);
+    return true;
+}
+
+void SnapshotTable::render(std::ostream &os) {
+    size_t count = 0;
+    size_t preserved = 0;
+    size_t lost = 0;
+    {
+        boost::shared_lock<boost::shared_mutex> s(snapshot_mutex);
+        for (const auto &[name, snap] : snapshots) {
+            ++count;
+            preserved += snap->moved_count;
+            lost += snap->lost;
+        }
+    }
+    os << "# TYPE fs_snapshots gauge\n";
+    os << "fs_snapshots " << count << "\n";
+    os << "# TYPE fs_snapshot_preserved_blocks gauge\n";
+    os << "fs_snapshot_preserved_blocks " << preserved << "\n";
+    os << "# TYPE fs_snapshots_lost gauge\n";
+    os << "fs_snapshots_lost " << lost << "\n";
+}
+
+void SnapshotTable::release(snapshot &snap, std::vector<uint32_t> &freed) {
+    if (snap.gone) {
+        return;
+    }
+    snap.gone = true;
+    for (uint32_t block = 0; block < FS_DISKSIZE; ++block) {
+        if (snap.captured.test(block)) {
+            --captures[block];
+        }
+        if (snap.moved[block]) {
+            freed.push_back(snap.moved[block]);
+        }
+    }
+    snap.captured.reset();
+    snap.moved.assign(FS_DISKSIZE, 0);
+    snap.moved_count = 0;
+}
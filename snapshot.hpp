@@ -0,0 +1,122 @@
+/***************************************************************************************************
+ *                                          SnapshotTable                                          *
+ ***************************************************************************************************/
+#pragma once
+
+#include <atomic>
+#include <bitset>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <boost/thread.hpp>
+#include <boost/thread/shared_mutex.hpp>
+
+#include "fs_server.h"
+
+/*
+ * Point-in-time snapshots of the whole disk (FS_SNAPSHOT).
+ *
+ * Taking a snapshot does no disk I/O: it records which blocks are in use,
+ * and those blocks are "captured" as they are.  The live tree keeps its
+ * blocks and never moves an inode, because inode blocks are what the lock
+ * table, leases and handles know files by.  Instead, the first write to a
+ * captured block after the snapshot copies the old contents to a free block
+ * that is not captured, and the snapshot reads the block from there from
+ * then on.  A snapshot therefore costs one block per block changed since it
+ * was taken, and a write pays one extra read and write the first time it
+ * touches a block.
+ *
+ * Writers hold a shared lock from the capture check through their disk
+ * write, and taking a snapshot holds it unique, so a snapshot sees every
+ * block as of one instant between disk writes.  Requests write in an order
+ * that leaves the disk readable after each write, so that instant is a tree
+ * the live readers could have seen.
+ *
+ * Snapshots live in memory: after a restart sys_init() finds only the live
+ * tree, and the copied blocks are free again.  If a copy finds no free block,
+ * the snapshot is lost (reads of it fail, deleting it frees its space)
+ * rather than failing the write.
+ *
+ * Thread safe.  Lock order: inode locks, then write_mutex, then
+ * snapshot_mutex, then the allocator.
+ */
+class SnapshotTable {
+public:
+    using in_use_fn = std::function<std::bitset<FS_DISKSIZE>()>;
+    // the lowest free block usable(block) accepts, taken off the free list, or -1
+    using alloc_fn  = std::function<int(const std::function<bool(uint32_t)> &usable)>;
+    using free_fn   = std::function<void(const std::vector<uint32_t>&)>;
+
+    struct snapshot {
+        std::string owner;                          // who took it, only they can delete it
+        std::bitset<FS_DISKSIZE> captured;          // in use when taken and still in place
+        std::vector<uint32_t> moved = std::vector<uint32_t>(FS_DISKSIZE, 0);   // where a changed block's
+                                                                               // old contents went, 0 if not
+        size_t moved_count = 0;
+        bool gone = false;                          // deleted or lost, reads fail
+        bool lost = false;
+    };
+
+    SnapshotTable(in_use_fn in_use, alloc_fn alloc, free_fn free);
+
+    /*
+     * before_write
+     *
+     * Call before writing block and keep the returned lock until the write is
+     * on disk.  Copies the block's current contents out for every snapshot
+     * that captured it.  The caller holds the lock that orders writes to
+     * block.
+     */
+    boost::shared_lock<boost::shared_mutex> before_write(uint32_t block);
+
+    /*
+     * Takes a snapshot of the disk called name.  Returns false if the name is
+     * taken or FS_MAXSNAPSHOTS exist.
+     */
+    bool create(const std::string &name, const std::string &owner);
+
+    /*
+     * Deletes user's snapshot called name and frees its copied blocks.
+     * Returns false if there is no such snapshot of theirs.
+     */
+    bool remove(const std::string &name, const std::string &user);
+
+    /*
+     * The snapshot called name, or nullptr
+     */
+    std::shared_ptr<const snapshot> find(const std::string &name);
+
+    /*
+     * Names of the snapshots, in order
+     */
+    std::vector<std::string> names();
+
+    /*
+     * Reads block as it was when snap was taken.  Returns false if snap has
+     * been deleted or lost.
+     */
+    bool read(const snapshot &snap, uint32_t block, void* buf);
+
+    /*
+     * Writes the snapshot gauges in the Prometheus text format
+     */
+    void render(std::ostream &os);
+
+private:
+    // drops what snap holds, with snapshot_mutex held; its copies go to freed
+    void release(snapshot &snap, std::vector<uint32_t> &freed);
+
+    in_use_fn in_use;
+    alloc_fn alloc;
+    free_fn free;
+
+    boost::shared_mutex write_mutex;                // shared by writers, unique while taking a snapshot
+    boost::shared_mutex snapshot_mutex;             // unique while copying out or deleting, shared by reads
+    std::map<std::string, std::shared_ptr<snapshot>> snapshots;
+    std::atomic<uint8_t> captures[FS_DISKSIZE]{};   // snapshots that captured each block
+};
@@ -0,0 +1,107 @@
+#include <algorithm>
+#include <random>
+
+#include "tracer.hpp"
+
+/***************************************************************************************************
+ *                                             Tracer                                              *
+ ***************************************************************************************************/
+
+/* function docs are in the header file */
+
+/*
+ * Owns the calling thread's ring and returns it to the free list when the
+ * thread exits.
+ */
+struct ring_lease {
+    Tracer::ring* r = nullptr;
+
+    ~ring_lease() {
+        if (r) {
+            Tracer &t = Tracer::instance();
+            boost::lock_guard<boost::mutex> g(t.rings_mutex);
+            t.free_rings.push_back(r);
+        }
+    }
+};
+
+Tracer& Tracer::instance() {
+    // never destroyed so thread exit handlers can still return their rings
+    static Tracer* t = new Tracer();
+    return *t;
+}
+
+Tracer::ring& Tracer::local() {
+    static thread_local ring_lease lease;
+    if (!lease.r) {
+        boost::lock_guard<boost::mutex> g(rings_mutex);
+        if (!free_rings.empty()) {
+            lease.r = free_rings.back();
+            free_rings.pop_back();
+        } else {
+            rings.push_back(std::make_unique<ring>());
+            lease.r = rings.back().get();
+            lease.r->tid = static_cast<uint32_t>(rings.size());
+        }
+    }
+    return *lease.r;
+}
+
+void Tracer::begin_request() {
+    unsigned int permille = sample_permille();
+    if (permille == 0) {
+        tracing = false;
+        return;
+    }
+    static thread_local std::minstd_rand rng(std::random_device{}());
+    tracing = permille >= 1000 || rng() % 1000 < permille;
+    if (tracing) {
+        current_request = next_request.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void Tracer::record(const char* name, metrics_clock::time_point start, metrics_clock::time_point end,
+                    int64_t arg) {
+    if (!tracing) {
+        return;
+    }
+    ring &r = local();
+    boost::lock_guard<boost::mutex> g(r.m);
+    r.spans[r.next] = span{
+        name,
+        current_request,
+        std::chrono::duration_cast<std::chrono::nanoseconds>(start - epoch).count(),
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count(),
+        arg
+    };
+    if (++r.next == TRACE_RING_SPANS) {
+        r.next = 0;
+        r.wrapped = true;
+    }
+}
+
+void Tracer::export_json(std::ostream &os) {
+    os << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [";
+    bool first = true;
+    boost::lock_guard<boost::mutex> g(rings_mutex);
+    for (const auto &r : rings) {
+        boost::lock_guard<boost::mutex> rg(r->m);
+        size_t count = r->wrapped ? TRACE_RING_SPANS : r->next;
+        size_t begin = r->wrapped ? r->next : 0;
+        for (size_t i = 0; i < count; ++i) {
+            const span &s = r->spans[(begin + i) % TRACE_RING_SPANS];
+            os << (first ? "\n" : ",\n")
+               << "{\"name\": \"" << s.name << "\", \"cat\": \"fs\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << r->tid
+               << ", \"ts\": " << s.start_ns / 1000.0 << ", \"dur\": " << s.dur_ns / 1000.0
+               << ", \"args\": {\"request\": " << s.request_id;
+            if (s.arg >= 0) {
+                os << ", \"block\": " << s.arg;
+            }
+            os << "}}";
+            first = false;
+        }
+        r->next = 0;
+        r->wrapped = false;
+    }
+    os << "\n]}\n";
+} // Tracer::export_json()
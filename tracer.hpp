@@ -0,0 +1,138 @@
+/***************************************************************************************************
+ *                                             Tracer                                              *
+ ***************************************************************************************************/
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <vector>
+
+#include <boost/thread.hpp>
+
+#include "metrics.hpp"
+
+/*
+ * Sampled per-request tracing.
+ *
+ * A sampled fraction of requests records a span for every phase (accept,
+ * header receive, parse, each path component lookup, lock waits, disk reads
+ * and writes, send) into a ring buffer owned by the serving thread.  The
+ * rings are exported as Chrome trace-event JSON, which chrome://tracing and
+ * Perfetto open directly.  Requests that are not sampled only pay a
+ * thread-local flag check per span.
+ */
+
+// spans kept per thread, older spans are overwritten
+static constexpr size_t TRACE_RING_SPANS = 4096;
+
+class Tracer {
+public:
+    struct span {
+        const char* name;                   // static string, never freed
+        uint64_t request_id;
+        int64_t start_ns;                   // since the tracer epoch
+        int64_t dur_ns;
+        int64_t arg;                        // block number, or -1
+    };
+
+    static Tracer& instance();
+
+    /*
+     * Trace "permille" out of every 1000 requests, 0 turns tracing off
+     */
+    void set_sample_permille(unsigned int permille) { permille_.store(permille, std::memory_order_relaxed); }
+    unsigned int sample_permille() const { return permille_.load(std::memory_order_relaxed); }
+
+    /*
+     * begin_request / end_request
+     *
+     * Bracket the handling of one request on the calling thread.  begin_request
+     * decides whether this request is sampled; spans are only recorded in
+     * between for sampled requests.
+     */
+    void begin_request();
+    void end_request() { tracing = false; }
+
+    static bool active() { return tracing; }
+
+    /*
+     * The calling thread's request state, for requests that move between
+     * threads (see scheduler.hpp)
+     */
+    struct context {
+        bool tracing;
+        uint64_t request;
+    };
+    static context save() { return context{tracing, current_request}; }
+    static void restore(const context &c) {
+        tracing = c.tracing;
+        current_request = c.request;
+    }
+
+    void record(const char* name, metrics_clock::time_point start, metrics_clock::time_point end,
+                int64_t arg = -1);
+
+    /*
+     * export_json
+     *
+     * Writes every buffered span as Chrome trace-event JSON and empties the
+     * buffers.
+     */
+    void export_json(std::ostream &os);
+
+private:
+    struct ring {
+        boost::mutex m;                     // only contended while exporting
+        uint32_t tid = 0;
+        size_t next = 0;
+        bool wrapped = false;
+        span spans[TRACE_RING_SPANS];
+    };
+
+    Tracer() = default;
+
+    ring& local();
+
+    static inline thread_local bool tracing = false;
+    static inline thread_local uint64_t current_request = 0;
+
+    std::atomic<unsigned int> permille_{0};
+    std::atomic<uint64_t> next_request{1};
+    metrics_clock::time_point epoch = metrics_clock::now();
+
+    boost::mutex rings_mutex;
+    std::vector<std::unique_ptr<ring>> rings;       // every ring ever handed out
+    std::vector<ring*> free_rings;                  // rings of exited threads
+
+    friend struct ring_lease;
+};
+
+/*
+ * Records the enclosing scope as a span when the current request is traced.
+ */
+class trace_span {
+public:
+    explicit trace_span(const char* name, int64_t arg = -1) : name_(name), arg_(arg) {
+        if (Tracer::active()) {
+            start_ = metrics_clock::now();
+        }
+    }
+    trace_span(const trace_span&) = delete;
+    trace_span& operator=(const trace_span&) = delete;
+
+    ~trace_span() {
+        if (start_ != metrics_clock::time_point{}) {
+            Tracer::instance().record(name_, start_, metrics_clock::now(), arg_);
+        }
+    }
+
+    void rename(const char* name) { name_ = name; }
+    void set_arg(int64_t arg) { arg_ = arg; }
+
+private:
+    const char* name_;
+    int64_t arg_;
+    metrics_clock::time_point start_{};
+};